@@ -0,0 +1,54 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Reading at the end of an empty file into buffers of different sizes. The host read returns immediately,
+ * so this mostly measures translating and bounds checking the guest buffer.
+ */
+
+#define BIG (60 * 1024)
+
+static char buf[BIG];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(int fd, const char *name, unsigned size, long iters) {
+    long i;
+    double start, end;
+
+    start = now();
+    for (i = 0; i < iters; i++) {
+        read(fd, buf, size);
+    }
+    end = now();
+    printf("bench! %s %.0f ns\n", name, (end - start) / iters);
+}
+
+int main(int argc, char **argv) {
+    long iters = 200000;
+    int fd;
+
+    if (argc > 1) {
+        iters = atol(argv[1]);
+    }
+
+    fd = open("bounds.dat", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    bench(fd, "read_eof_1", 1, iters);
+    bench(fd, "read_eof_60k", BIG, iters);
+
+    close(fd);
+    unlink("bounds.dat");
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Latency of running another QNX program: a chain of execs of ourselves, and spawning a child that exits
+ * immediately and waiting for it, like a shell or make does.
+ */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    long iterations = 200;
+    long i;
+    double start, end;
+    char left[32];
+    char since[32];
+
+    /* exec chain: argv[1] = remaining execs, argv[2] = start time */
+    if (argc == 4 && argv[1][0] == 'x') {
+        long n = atol(argv[2]);
+        if (n > 0) {
+            sprintf(left, "%ld", n - 1);
+            execl(argv[0], argv[0], "x", left, argv[3], NULL);
+            perror("exec");
+            return 1;
+        }
+        printf("bench! exec_chain %.0f ns\n", (now() - atof(argv[3])) / iterations);
+        return 0;
+    }
+    if (argc == 2 && argv[1][0] == 'c') {
+        return 0;
+    }
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        if (spawnl(P_WAIT, argv[0], argv[0], "c", NULL) != 0) {
+            perror("spawn");
+            return 1;
+        }
+    }
+    end = now();
+    printf("bench! spawn_wait %.0f ns\n", (end - start) / iterations);
+
+    fflush(stdout);
+    sprintf(left, "%ld", iterations);
+    sprintf(since, "%.0f", now());
+    execl(argv[0], argv[0], "x", left, since, NULL);
+    perror("exec");
+    return 1;
+}
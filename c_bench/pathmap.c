@@ -0,0 +1,62 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Include directory search of a compiler: each header is looked up in all the include directories, where it
+ * mostly does not exist. Measures the path mapping of the open and stat messages, run.py runs it with
+ * a realistic mapping table of a build.
+ */
+
+#define DIRS 40
+#define HEADERS 25
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long search(int use_stat) {
+    char path[128];
+    struct stat st;
+    long lookups = 0;
+    int d, h, fd;
+
+    for (h = 0; h < HEADERS; h++) {
+        for (d = 0; d < DIRS; d++) {
+            sprintf(path, "/proj/inc/mod%d/hdr%d.h", d, h);
+            if (use_stat) {
+                stat(path, &st);
+            } else {
+                fd = open(path, O_RDONLY);
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            lookups++;
+        }
+    }
+    return lookups;
+}
+
+int main(void) {
+    static const char *names[] = {"pathmap_open", "pathmap_stat"};
+    int rounds = 20;
+    int use_stat, i;
+    long lookups;
+    double start, end;
+
+    for (use_stat = 0; use_stat < 2; use_stat++) {
+        lookups = 0;
+        start = now();
+        for (i = 0; i < rounds; i++) {
+            lookups += search(use_stat);
+        }
+        end = now();
+        printf("bench! %s %.0f ns\n", names[use_stat], (end - start) / lookups);
+    }
+    return 0;
+}
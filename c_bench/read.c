@@ -0,0 +1,53 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Reading a file in small chunks, like cat does. Mostly measures the cost of the io_read message.
+ */
+
+#define CHUNK 512
+
+static char buf[CHUNK];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    long size = 64L * 1024 * 1024;
+    long reads = 0;
+    long i;
+    int fd;
+    double start, end;
+
+    if (argc > 1) {
+        size = atol(argv[1]);
+    }
+
+    fd = open("read.dat", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    for (i = 0; i < size; i += CHUNK) {
+        write(fd, buf, CHUNK);
+    }
+    close(fd);
+
+    fd = open("read.dat", O_RDONLY);
+    start = now();
+    while (read(fd, buf, CHUNK) > 0) {
+        reads++;
+    }
+    end = now();
+    close(fd);
+    unlink("read.dat");
+
+    printf("bench! read_512 %.0f ns\n", (end - start) / reads);
+    return 0;
+}
@@ -0,0 +1,294 @@
+#!/usr/bin/env python3
+
+import os
+from pathlib import Path, PurePath
+import subprocess
+import shlex
+import argparse
+import json
+import shutil
+import sys
+import time
+
+parse = argparse.ArgumentParser()
+parse.add_argument('bench', default=None, nargs='?')
+parse.add_argument('-d', action='append')
+parse.add_argument('-b', action='store', choices=[16, 32], default=32, type=int)
+parse.add_argument('--json', action='store', type=Path, help='also write the results to this file as JSON')
+
+args = parse.parse_args()
+if args.json:
+    args.json = args.json.absolute()
+
+c_bench = Path(__file__).parent
+os.chdir(c_bench)
+
+qnx = Path(os.environ['QNX_ROOT'])
+slib_spec = shlex.split(os.environ['QNX_SLIB'])
+qine = (c_bench / '../build/qine').absolute()
+qine_client = (c_bench / '../build/qine-client').absolute()
+build = (c_bench / 'build').absolute()
+cc =  '/bin/cc'
+qine_cmd = [qine] + slib_spec + [
+    '-m', f'/,{qnx}', 
+    '-m', f'/t,{Path.cwd()},exec=qnx',
+    '--']
+
+# Mapping table of a build with many include, library and tool directories, for the pathmap benchmark
+pathmap_table = []
+for i in range(40):
+    pathmap_table += ['-m', f'/proj/inc/mod{i},{build}/pathmap/inc/mod{i}']
+for d in ('src', 'lib', 'obj', 'tmp'):
+    pathmap_table += ['-m', f'/proj/{d},{build}/pathmap/{d}']
+pathmap_table += ['-m', f'/tools,{build}/pathmap/tools,exec=host']
+
+# Qine options to compare for a benchmark, all benchmarks run at least in the default configuration
+variants = {
+    'syscall': {
+        'trap': [],
+        'gate': ['--syscall-gate'],
+    },
+    'bounds': {
+        'fast': [],
+        'full': ['--no-fast-msg'],
+    },
+    'exec': {
+        'inproc': [],
+        'reexec': ['--no-inproc-exec'],
+    },
+    'spawn': {
+        'fork': [],
+        'posix_spawn': ['--no-inproc-exec'],
+    },
+    'read': {
+        'fast': [],
+        'full': ['--no-fast-msg'],
+    },
+    'pathmap': {
+        'root_only': [],
+        'maps45': pathmap_table,
+        'maps45_neg': pathmap_table + ['--negative-cache'],
+    },
+    'statstorm': {
+        'root_only': [],
+        'prefix': ['-m', f'/deep,{build}/statstorm/tree'],
+    },
+}
+
+build.mkdir(exist_ok=True)
+
+def print_args(args):
+    print('+ ' + ' '.join([shlex.quote(str(v)) for v in args]))
+
+def exec(args):
+    print_args(args)
+    subprocess.check_call(args)
+
+results = []
+# Detailed results of the startup suite, only in the JSON output
+startup_results = []
+
+def run_bench(bench):
+    os.chdir(c_bench)
+    bench = PurePath(bench).stem
+    bench_dir = build / bench
+    bench_dir.mkdir(exist_ok=True)
+    os.chdir(bench_dir)
+    print(f'----- BENCH {bench} ------')
+
+    if args.b == 32:
+        switch = '-3'
+    else:
+        switch = '-2'
+
+    exec(qine_cmd + [cc, switch, '-Oxt', '-o', f'{bench}', f'../../{bench}.c'])
+
+    extra_args = []
+    for a in args.d or []:
+        extra_args.extend(['-d', a])
+
+    for variant, options in variants.get(bench, {'default': []}).items():
+        run_args = [qine] + slib_spec + options + extra_args + ['--', f'./{bench}']
+        print_args(run_args)
+        out = subprocess.check_output(run_args, stderr=subprocess.STDOUT, encoding='ascii')
+        for l in out.splitlines():
+            print(l)
+            if l.startswith('bench!'):
+                _, name, value, unit = l.split()
+                results.append((name, variant, value, unit))
+
+# Host-side startup latency of a trivial QNX program, started by a fresh qine or forked by a zygote
+startup_runs = 100
+
+def run_startup():
+    os.chdir(build / 'exec')
+    socket = build / 'zygote.sock'
+    zygote_args = [qine] + slib_spec + ['--zygote', socket]
+    print_args(zygote_args)
+    zygote = subprocess.Popen(zygote_args, stderr=subprocess.DEVNULL)
+    try:
+        while not socket.exists():
+            time.sleep(0.01)
+        launchers = {
+            'direct': [qine] + slib_spec + ['--'],
+            'zygote': [qine_client, socket],
+        }
+        for variant, launcher in launchers.items():
+            run_args = launcher + ['./exec', 'c']
+            print_args(run_args)
+            start = time.perf_counter()
+            for _ in range(startup_runs):
+                subprocess.check_call(run_args)
+            end = time.perf_counter()
+            results.append(('startup', variant, f'{(end - start) / startup_runs * 1e9:.0f}', 'ns'))
+    finally:
+        zygote.terminate()
+        zygote.wait()
+
+# Loading of real QNX binaries (those present in QNX_ROOT), without running them
+loader_binaries = [
+    'bin/sh', 'bin/ls', 'usr/bin/make', 'usr/bin/cc',
+    'usr/watcom/10.6/binp/wcc386', 'usr/watcom/10.6/binp/wlink',
+]
+loader_runs = 50
+
+def run_loader():
+    cache = build / 'image_cache'
+    loader_variants = {
+        'default': [],
+        'cache': ['--image-cache', cache],
+    }
+    for binary in loader_binaries:
+        if not (qnx / binary).exists():
+            continue
+        for variant, options in loader_variants.items():
+            run_args = [qine] + slib_spec + options + ['-m', f'/,{qnx}', '--load-only', '--', f'/{binary}']
+            print_args(run_args)
+            # the first run fills the cache
+            subprocess.check_call(run_args)
+            start = time.perf_counter()
+            for _ in range(loader_runs):
+                subprocess.check_call(run_args)
+            end = time.perf_counter()
+            results.append((f'load_{Path(binary).name}', variant, f'{(end - start) / loader_runs * 1e9:.0f}', 'ns'))
+
+# Startup latency of whole qine runs of startup.c, under both Slibs
+startup_cases = {
+    'empty': [],
+    'exec_chain': ['x', '10'],
+    'fork_wait': ['f', '1'],
+    'spawn_true': ['s', '1'],
+}
+startup_suite_runs = 50
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+def count_host_syscalls(run_args):
+    """Host syscalls of the run and its children, if strace is available"""
+    if not shutil.which('strace'):
+        return None
+    out = build / 'startup' / 'strace.txt'
+    subprocess.run(['strace', '-f', '-c', '-o', out] + run_args, check=True, stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL)
+    for l in out.read_text().splitlines():
+        fields = l.split()
+        if fields and fields[-1] == 'total':
+            return int(fields[3])
+    return None
+
+def startup_breakdown(run_args):
+    """Time spent in the startup phases of the top-level qine process, from its stats"""
+    args = run_args[:1] + ['-d', 'stats'] + run_args[1:]
+    proc = subprocess.Popen(args, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, encoding='ascii')
+    _, stderr = proc.communicate()
+    if proc.returncode != 0:
+        raise subprocess.CalledProcessError(proc.returncode, args)
+    # children print their stats too, and may exit first
+    top_pid = f'{proc.pid}:'
+    breakdown = {}
+    for l in stderr.splitlines():
+        if not l.startswith('stats '):
+            continue
+        pid, name, value = l.split()[1:4]
+        if name.startswith('startup.') and pid == top_pid:
+            breakdown[name[len('startup.'):]] = int(value)
+    return breakdown
+
+def run_startup_suite():
+    bench_dir = build / 'startup'
+    bench_dir.mkdir(exist_ok=True)
+    os.chdir(bench_dir)
+    print('----- BENCH startup suite ------')
+    env = dict(os.environ, PATH='/bin:/usr/bin')
+    for bits in (32, 16):
+        if bits == 16 and not any('sys16' in a for a in slib_spec):
+            print('No 16-bit Slib in QNX_SLIB, skipping the 16-bit startup suite')
+            continue
+        binary = f'startup{bits}'
+        try:
+            exec(qine_cmd + [cc, '-3' if bits == 32 else '-2', '-Oxt', '-o', binary, '../../startup.c'])
+        except subprocess.CalledProcessError:
+            print(f'Cannot build the {bits}-bit startup suite, skipping')
+            continue
+        for case, case_args in startup_cases.items():
+            if case == 'spawn_true' and not (qnx / 'bin/true').exists():
+                continue
+            run_args = [qine] + slib_spec + ['-m', f'/,{qnx}', '-m', f'/t,{bench_dir},exec=qnx', '--',
+                f'/t/{binary}'] + case_args
+            print_args(run_args)
+            latencies = []
+            max_rss = 0
+            for _ in range(startup_suite_runs):
+                start = time.perf_counter()
+                proc = subprocess.Popen(run_args, env=env)
+                _, status, rusage = os.wait4(proc.pid, 0)
+                latencies.append(time.perf_counter() - start)
+                proc.returncode = os.waitstatus_to_exitcode(status)
+                if proc.returncode != 0:
+                    raise subprocess.CalledProcessError(proc.returncode, run_args)
+                max_rss = max(max_rss, rusage.ru_maxrss)
+
+            name = f'startup_{case}_{bits}'
+            p50 = percentile(latencies, 50) * 1e9
+            p99 = percentile(latencies, 99) * 1e9
+            results.append((name, 'p50', f'{p50:.0f}', 'ns'))
+            results.append((name, 'p99', f'{p99:.0f}', 'ns'))
+            startup_results.append({
+                'case': case,
+                'bits': bits,
+                'runs': startup_suite_runs,
+                'p50_ns': round(p50),
+                'p99_ns': round(p99),
+                'max_rss_kb': max_rss,
+                'host_syscalls': count_host_syscalls(run_args),
+                'breakdown_ns': startup_breakdown(run_args),
+            })
+
+host_driven = ('loader', 'startup')
+
+if args.bench is None:
+    for t in sorted(Path('.').glob('*.c')):
+        if t.stem not in host_driven:
+            run_bench(t.stem)
+elif args.bench not in host_driven:
+    run_bench(args.bench)
+if args.bench in (None, 'exec'):
+    run_startup()
+if args.bench in (None, 'loader'):
+    run_loader()
+if args.bench in (None, 'startup'):
+    run_startup_suite()
+
+print("----------")
+for name, variant, value, unit in results:
+    print(f'{name:30} {variant:10} {value:>10} {unit}')
+
+if args.json:
+    with open(args.json, 'wt') as f:
+        json.dump({
+            'time': time.time(),
+            'results': [{'name': n, 'variant': v, 'value': float(val), 'unit': u} for n, v, val, u in results],
+            'startup': startup_results,
+        }, f, indent=2)
@@ -0,0 +1,62 @@
+#include <process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Latency of spawning a child that exits immediately and waiting for it, while the parent
+ * keeps a growing amount of touched heap. Copying the parent for the child gets slower with its size.
+ */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench(const char *self, unsigned mbytes, long iterations) {
+    long i;
+    double start, end;
+    char *mem = NULL;
+
+    if (mbytes) {
+        mem = malloc(mbytes * 1024ul * 1024ul);
+        if (!mem) {
+            perror("malloc");
+            return 1;
+        }
+        memset(mem, 1, mbytes * 1024ul * 1024ul);
+    }
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        if (spawnl(P_WAIT, self, self, "c", NULL) != 0) {
+            perror("spawn");
+            return 1;
+        }
+    }
+    end = now();
+    printf("bench! spawn_rss_%uM %.0f ns\n", mbytes, (end - start) / iterations);
+
+    free(mem);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const unsigned sizes[] = {0, 16, 64, 256};
+    long iterations = 100;
+    unsigned i;
+
+    if (argc == 2 && argv[1][0] == 'c') {
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (bench(argv[0], sizes[i], iterations) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
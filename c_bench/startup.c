@@ -0,0 +1,57 @@
+#include <process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Programs for the startup latency suite in run.py, which times whole qine runs from the host:
+ *   startup        empty main
+ *   startup x N    exec chain of depth N
+ *   startup f N    N times fork and wait for the child
+ *   startup s N    N times spawnvp true and wait for it
+ */
+
+int main(int argc, char **argv) {
+    char left[32];
+    long n, i;
+    int status;
+    pid_t pid;
+
+    if (argc < 3) {
+        return 0;
+    }
+
+    n = atol(argv[2]);
+    switch (argv[1][0]) {
+        case 'x':
+            if (n > 0) {
+                sprintf(left, "%ld", n - 1);
+                execl(argv[0], argv[0], "x", left, NULL);
+                perror("exec");
+                return 1;
+            }
+            return 0;
+        case 'f':
+            for (i = 0; i < n; i++) {
+                pid = fork();
+                if (pid == 0) {
+                    _exit(0);
+                }
+                if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+                    perror("fork");
+                    return 1;
+                }
+            }
+            return 0;
+        case 's':
+            for (i = 0; i < n; i++) {
+                if (spawnlp(P_WAIT, "true", "true", NULL) != 0) {
+                    perror("spawn");
+                    return 1;
+                }
+            }
+            return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,80 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Stat storm of a make run: all files of a deep directory tree are stat'ed over and over, a fifth of them
+ * do not exist. The tree is created in tree/ of the current directory and accessed as /deep if run.py maps
+ * it there, otherwise by its absolute path.
+ */
+
+#define DEPTH 8
+#define FILES 50
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void dir_path(char *buf, const char *base) {
+    int d;
+
+    strcpy(buf, base);
+    for (d = 0; d < DEPTH; d++) {
+        sprintf(buf + strlen(buf), "/level%d", d);
+    }
+}
+
+static void create_tree(void) {
+    char path[256];
+    int d, f, fd;
+
+    strcpy(path, "tree");
+    mkdir(path, 0777);
+    for (d = 0; d < DEPTH; d++) {
+        sprintf(path + strlen(path), "/level%d", d);
+        mkdir(path, 0777);
+    }
+    for (f = 0; f < FILES * 4 / 5; f++) {
+        sprintf(path + strlen(path), "/file%d.c", f);
+        fd = open(path, O_WRONLY | O_CREAT, 0666);
+        if (fd >= 0) {
+            close(fd);
+        }
+        *strrchr(path, '/') = 0;
+    }
+}
+
+int main(void) {
+    char base[256], dir[256], path[300];
+    struct stat st;
+    int rounds = 100;
+    int i, f;
+    long stats = 0;
+    double start, end;
+
+    create_tree();
+    if (stat("/deep/level0", &st) == 0) {
+        strcpy(base, "/deep");
+    } else {
+        getcwd(base, sizeof(base) - 8);
+        strcat(base, "/tree");
+    }
+    dir_path(dir, base);
+
+    start = now();
+    for (i = 0; i < rounds; i++) {
+        for (f = 0; f < FILES; f++) {
+            sprintf(path, "%s/file%d.c", dir, f);
+            stat(path, &st);
+            stats++;
+        }
+    }
+    end = now();
+    printf("bench! statstorm %.0f ns\n", (end - start) / stats);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Round-trip cost of a kernel call. We use Yield, which does close to nothing in Qine.
+ *
+ * The call is spelled out as `mov reg, imm; int`, which is the form that --syscall-gate can redirect.
+ */
+#ifdef __386__
+extern unsigned bench_yield(void);
+#pragma aux bench_yield = "mov eax, 0000000Ah" "int 0F2h" value [eax] modify exact [eax];
+#else
+extern unsigned bench_yield(void);
+#pragma aux bench_yield = "mov ax, 000Ah" "push ax" "mov ax, 0000h" "int 0F0h" "pop cx" value [ax] modify exact [ax cx];
+#endif
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    long iterations = 200000;
+    long i;
+    double start, end;
+
+    if (argc > 1) {
+        iterations = atol(argv[1]);
+    }
+
+    /* warm up, the first call of each site goes the slow way */
+    bench_yield();
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        bench_yield();
+    }
+    end = now();
+
+    printf("bench! syscall_yield %.0f ns\n", (end - start) / iterations);
+    return 0;
+}
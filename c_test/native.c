@@ -0,0 +1,38 @@
+#include <process.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* run.py maps /native/test to the host test(1), with -eq replaced by = */
+static void check_tool(const char *msg, int expected, const char *a, const char *op, const char *b) {
+    int r = spawnl(P_WAIT, "/native/test", "test", a, op, b, NULL);
+    if (r == expected) {
+        printf("ok! %s\n", msg);
+    } else {
+        printf("no! %s %d\n", msg, r);
+    }
+}
+
+int main(int argc, char **argv) {
+    int r;
+
+    if (argc > 1 && strcmp(argv[1], "child") == 0) {
+        check_tool("child", 0, "a", "=", "a");
+        return 0;
+    }
+
+    check_tool("equal", 0, "a", "=", "a");
+    check_tool("different", 1, "a", "=", "b");
+    check_tool("replaced", 0, "a", "-eq", "a");
+
+    /* the table is given relative to the directory of the test */
+    chdir("/");
+    check_tool("other directory", 0, "a", "=", "a");
+    r = spawnl(P_WAIT, "/t/build/native/native", "native", "child", NULL);
+    if (r == 0) {
+        printf("ok! spawn child\n");
+    } else {
+        printf("no! spawn child %d\n", r);
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "common.h"
+
+#include <fcntl.h>
+#include <process.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * A path that was looked up while missing must be found once it exists. run.py also runs this with
+ * --negative-cache, where the misses are cached. With the arguments "create FILE" or "rename FROM TO", the child
+ * does that for the parent, so that the parent only learns about it from the host.
+ */
+
+/* Look up the missing path twice, the second lookup is answered from the cache */
+static void miss(const char *msg, const char *path) {
+    struct stat sb;
+    if (stat(path, &sb) == 0 || stat(path, &sb) == 0) {
+        printf("no! %s: exists before\n", msg);
+    }
+}
+
+static void check_found(const char *msg, const char *path) {
+    struct stat sb;
+    int fd;
+    if (stat(path, &sb) < 0) {
+        printf("no! %s: stat\n", msg);
+        return;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("no! %s: open\n", msg);
+        return;
+    }
+    close(fd);
+    printf("ok! %s\n", msg);
+}
+
+static void child(const char *argv0, const char *op, const char *a, const char *b) {
+    int r = spawnl(P_WAIT, argv0, argv0, op, a, b, NULL);
+    if (r != 0) {
+        printf("no! child %s %s: %d\n", op, a, r);
+    }
+}
+
+int main(int argc, char **argv) {
+    int fd;
+
+    if (argc > 2 && strcmp(argv[1], "create") == 0) {
+        touch(argv[2]);
+        return 0;
+    }
+    if (argc > 3 && strcmp(argv[1], "rename") == 0) {
+        return rename(argv[2], argv[3]) == 0 ? 0 : 1;
+    }
+
+    printf("ex! created_by_child\n");
+    printf("ex! own_create\n");
+    printf("ex! own_rename\n");
+    printf("ex! child_rename\n");
+    printf("ex! parent_recreated\n");
+
+    unlink("nc_child.fil");
+    unlink("nc_own.fil");
+    unlink("nc_own.tmp");
+    unlink("nc_ren.fil");
+    unlink("nc_ren.tmp");
+    unlink("nc_cren.fil");
+    unlink("nc_cren.tmp");
+    unlink("nc_par/nc.fil");
+    rmdir("nc_par");
+
+    miss("created_by_child", "nc_child.fil");
+    child(argv[0], "create", "nc_child.fil", NULL);
+    check_found("created_by_child", "nc_child.fil");
+
+    miss("own_create", "nc_own.fil");
+    fd = open("nc_own.fil", O_WRONLY | O_CREAT, 0666);
+    check_ok("own_create open", fd < 0 ? -1 : 0);
+    close(fd);
+    check_found("own_create", "nc_own.fil");
+
+    miss("own_rename", "nc_ren.fil");
+    touch("nc_ren.tmp");
+    check_ok("own_rename rename", rename("nc_ren.tmp", "nc_ren.fil"));
+    check_found("own_rename", "nc_ren.fil");
+
+    miss("child_rename", "nc_cren.fil");
+    touch("nc_cren.tmp");
+    child(argv[0], "rename", "nc_cren.tmp", "nc_cren.fil");
+    check_found("child_rename", "nc_cren.fil");
+
+    check_ok("parent_recreated mkdir", mkdir("nc_par", 0777));
+    miss("parent_recreated", "nc_par/nc.fil");
+    check_ok("parent_recreated rmdir", rmdir("nc_par"));
+    check_ok("parent_recreated mkdir again", mkdir("nc_par", 0777));
+    child(argv[0], "create", "nc_par/nc.fil", NULL);
+    check_found("parent_recreated", "nc_par/nc.fil");
+
+    return 0;
+}
@@ -1,9 +1,55 @@
+#include "common.h"
+
 #include <stdio.h>
+#include <string.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The stat returned with a dirent must be the one of stat(), if it is marked valid */
+static void check_dirent_stat(struct dirent *e, const char *name, int is_link) {
+    struct stat sb;
+    int r;
+
+    if (!(e->d_stat.st_status & _FILE_USED)) {
+        if (is_link) {
+            printf("ok! dirent_stat %s not filled in\n", name);
+        } else {
+            printf("no! dirent_stat %s not filled in\n", name);
+        }
+        return;
+    }
+
+    r = is_link ? lstat(name, &sb) : stat(name, &sb);
+    check_ok("dirent_stat stat", r);
+    if (e->d_stat.st_ino == sb.st_ino && e->d_stat.st_mode == sb.st_mode && e->d_stat.st_size == sb.st_size
+        && e->d_stat.st_nlink == sb.st_nlink && e->d_stat.st_mtime == sb.st_mtime
+        && e->d_stat.st_uid == sb.st_uid && e->d_stat.st_gid == sb.st_gid)
+    {
+        printf("ok! dirent_stat %s\n", name);
+    } else {
+        printf("no! dirent_stat %s mode=o%o/o%o size=%ld/%ld\n", name, e->d_stat.st_mode, sb.st_mode,
+            (long)e->d_stat.st_size, (long)sb.st_size);
+    }
+}
 
 int main(void) {
+    const char *test_file = "test.fil";
+    const char *test_dir = "test.dir";
+    const char *test_link = "test.lnk";
+    int seen = 0;
     DIR *d;
     struct dirent *e;
+
+    printf("ex! dirent_stat test.fil\n");
+    printf("ex! dirent_stat test.dir\n");
+    printf("ex! dirent_stat test.lnk\n");
+
+    touch(test_file);
+    mkdir(test_dir, 0777);
+    unlink(test_link);
+    check_ok("symlink", symlink(test_file, test_link));
+
     printf("opendir\n");
     d = opendir(".");
 
@@ -17,9 +63,25 @@ int main(void) {
 
     while((e = readdir(d))) {
         printf("entry: %s\n", e->d_name);
+        if (strcmp(e->d_name, test_file) == 0) {
+            check_dirent_stat(e, test_file, 0);
+            seen++;
+        } else if (strcmp(e->d_name, test_dir) == 0) {
+            check_dirent_stat(e, test_dir, 0);
+            seen++;
+        } else if (strcmp(e->d_name, test_link) == 0) {
+            check_dirent_stat(e, test_link, 1);
+            seen++;
+        }
     }
 
     closedir(d);
 
+    if (seen == 3) {
+        printf("ok! dirent_seen\n");
+    } else {
+        printf("no! dirent_seen %d\n", seen);
+    }
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * With the argument "tool", a deterministic tool for the result cache: it checks whether output.txt exists,
+ * copies input.txt to it and prints the contents. run.py runs it through the cache, without arguments it only
+ * checks the copy.
+ */
+static int tool(void) {
+    struct stat st;
+    char buf[256];
+    size_t len;
+    FILE *in, *out;
+
+    printf("output %s\n", stat("output.txt", &st) == 0 ? "existed" : "created");
+    in = fopen("input.txt", "r");
+    out = fopen("output.txt", "w");
+    if (!in || !out) {
+        perror("fopen");
+        return 1;
+    }
+    len = fread(buf, 1, sizeof(buf) - 1, in);
+    buf[len] = 0;
+    fwrite(buf, 1, len, out);
+    fclose(in);
+    fclose(out);
+    printf("copied %s\n", buf);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    FILE *f;
+    char buf[16] = {0};
+
+    if (argc > 1 && strcmp(argv[1], "tool") == 0) {
+        return tool();
+    }
+
+    f = fopen("input.txt", "w");
+    fputs("one", f);
+    fclose(f);
+    if (tool() != 0) {
+        printf("no! tool\n");
+        return 0;
+    }
+    f = fopen("output.txt", "r");
+    fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    if (strcmp(buf, "one") == 0) {
+        printf("ok! copy\n");
+    } else {
+        printf("no! copy %s\n", buf);
+    }
+    return 0;
+}
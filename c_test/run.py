@@ -11,6 +11,10 @@ parse = argparse.ArgumentParser()
 parse.add_argument('test', default=None, nargs='?')
 parse.add_argument('-d', action='append')
 parse.add_argument('-b', action='store', choices=[16, 32], default=32, type=int)
+parse.add_argument('-s', '--snapshot', action='store_true',
+    help='also run each test restored from a snapshot and compare it with the cold run')
+parse.add_argument('-i', '--image-cache', action='store_true',
+    help='also run each test with an image cache: filled, used, invalidated and corrupted')
 
 args = parse.parse_args()
 
@@ -29,6 +33,10 @@ qine_cmd = [qine] + slib_spec + [
 
 build.mkdir(exist_ok=True)
 
+# used by native.c, passed relative to the test directory
+(build / 'native_tools.txt').write_text('/native/test,/usr/bin/test,replace=-eq:=\n')
+native_tools_arg = '--native-tools=../native_tools.txt'
+
 class TestResult:
     def __init__(self, name: str, failures) -> None:
         self.name = name
@@ -37,9 +45,132 @@ class TestResult:
 def print_args(args):
     print('+ ' + ' '.join([shlex.quote(str(v)) for v in args]))
 
-def exec(args):
+def exec(args, env=None):
     print_args(args)
-    subprocess.check_call(args)
+    subprocess.check_call(args, env=env)
+
+def run_guest(run_args, log):
+    print_args(run_args)
+    proc = subprocess.Popen(run_args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, encoding='ascii')
+    output = []
+    with open(log, 'wt') as f:
+        for l in proc.stdout:
+            f.write(l)
+            sys.stdout.write(l)
+            output.append(l)
+    return output, proc.wait()
+
+def results(output):
+    return [l.strip() for l in output if l.startswith('ok!') or l.startswith('no!')]
+
+def run_snapshot(test, cold_output):
+    """Restore the test from a snapshot taken with different arguments and environment"""
+    snapshot = Path('snapshot.img').absolute()
+    snapshot.unlink(missing_ok=True)
+    save_env = dict(os.environ, QINE_TEST_SNAPSHOT='save', QINE_TEST_SNAPSHOT_SAVE='1')
+    exec([qine] + slib_spec + [f'--snapshot-save={snapshot}', '--', f'./{test}', 'argument-of-the-snapshot-run'],
+        env=save_env)
+
+    output, r = run_guest([qine] + slib_spec + ['-d', 'stats', f'--snapshot={snapshot}', '--', f'./{test}'],
+        'run_snapshot.log')
+    failures = []
+    if not any('snapshot.restore' in l for l in output):
+        failures.append('no! snapshot not restored')
+    if r != 0:
+        failures.append('no! snapshot retcode')
+    if results(output) != results(cold_output):
+        failures.append('no! snapshot run differs from the cold run')
+    return failures
+
+def stat_value(output, name):
+    """Sum of a -d stats counter over all processes"""
+    total = 0
+    for l in output:
+        parts = l.split()
+        if len(parts) == 4 and parts[0] == 'stats' and parts[2] == name:
+            total += int(parts[3])
+    return total
+
+def run_image_cache(test, cold_output):
+    """Run the test with a new image cache, again from the cache, after touching it and with a truncated entry"""
+    cache = Path('image_cache').absolute()
+    if cache.exists():
+        for e in cache.iterdir():
+            e.unlink()
+    run_args = [qine] + slib_spec + ['-d', 'stats', f'--image-cache={cache}', '--', f'./{test}']
+    failures = []
+
+    def check(step, log, hit, miss):
+        output, r = run_guest(run_args, log)
+        if r != 0:
+            failures.append(f'no! image cache {step}: retcode')
+        if results(output) != results(cold_output):
+            failures.append(f'no! image cache {step}: run differs from the run without cache')
+        if (stat_value(output, 'image_cache.hit') > 0) != hit:
+            failures.append(f'no! image cache {step}: hit expected {hit}')
+        if (stat_value(output, 'image_cache.miss') > 0) != miss:
+            failures.append(f'no! image cache {step}: miss expected {miss}')
+
+    check('fill', 'run_image_cache_fill.log', hit=False, miss=True)
+    # the Slib is loaded from the cache as well, only the executable misses after it changed
+    check('hit', 'run_image_cache_hit.log', hit=True, miss=False)
+    os.utime(test)
+    check('invalidated', 'run_image_cache_touched.log', hit=True, miss=True)
+    for e in cache.iterdir():
+        os.truncate(e, 16)
+    check('truncated', 'run_image_cache_truncated.log', hit=False, miss=True)
+    return failures
+
+def run_result_cache(test):
+    """Run result_cache.c as a cached tool: a miss, a hit, an invalidation by its input and a deleted output"""
+    cache = Path('result_cache').absolute()
+    if cache.exists():
+        for e in cache.iterdir():
+            e.unlink()
+    Path('output.txt').unlink(missing_ok=True)
+    tool = Path(test).absolute()
+    run_args = [qine] + slib_spec + ['-d', 'stats', f'--result-cache={cache},tool={tool}', '--', str(tool), 'tool']
+    failures = []
+
+    def check(step, log, contents, hit):
+        Path('input.txt').write_text(contents)
+        output, r = run_guest(run_args, log)
+        if r != 0:
+            failures.append(f'no! result cache {step}: retcode')
+        if (stat_value(output, 'result_cache.hit') > 0) != hit:
+            failures.append(f'no! result cache {step}: hit expected {hit}')
+        if not hit and stat_value(output, 'result_cache.store') == 0:
+            failures.append(f'no! result cache {step}: not stored')
+        if not Path('output.txt').exists() or Path('output.txt').read_text() != contents:
+            failures.append(f'no! result cache {step}: wrong output.txt')
+        return [l for l in output if l.startswith('output ') or l.startswith('copied ')]
+
+    first_output = check('miss', 'run_result_cache_miss.log', 'one', hit=False)
+    Path('output.txt').unlink()
+    if check('hit', 'run_result_cache_hit.log', 'one', hit=True) != first_output:
+        failures.append('no! result cache hit: stdout differs')
+    check('invalidated', 'run_result_cache_changed.log', 'two', hit=False)
+    # the output existed when the last run was recorded
+    Path('output.txt').unlink()
+    check('output deleted', 'run_result_cache_deleted.log', 'two', hit=True)
+    return failures
+
+def run_negative_cache(test):
+    """Run negative_cache.c with the misses cached, each path must still be found once it exists"""
+    run_args = [qine] + slib_spec + ['-d', 'stats', '--negative-cache', '--', f'./{test}']
+    output, r = run_guest(run_args, 'run_negative_cache.log')
+    failures = [f'{l.strip()} (negative cache)' for l in output if l.startswith('no!')]
+    if r != 0:
+        failures.append('no! negative cache: retcode')
+    if stat_value(output, 'negative_cache.hit') == 0:
+        failures.append('no! negative cache: no lookup was cached')
+    return failures
+
+# checks of a test beyond its plain run
+extra_checks = {
+    'result_cache': run_result_cache,
+    'negative_cache': run_negative_cache,
+}
 
 test_results = []
 
@@ -66,23 +197,22 @@ def run_test(test, single=False):
     for a in args.d or []:
         extra_args.extend(['-d', a])
 
-    failures = []
-    run_args = [qine] + slib_spec + extra_args + ['--', f'./{test}']
-    print_args(run_args)
-    proc = subprocess.Popen(run_args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, encoding='ascii')
-    with open('run.log', 'wt') as f:
-        for l in proc.stdout:
-            f.write(l)
-            sys.stdout.write(l)
-            if l.startswith('no!'):
-                failures.append(l.strip())
-    r = proc.wait()
+    run_args = [qine] + slib_spec + extra_args + [native_tools_arg, '--', f'./{test}']
+    output, r = run_guest(run_args, 'run.log')
+    failures = [l.strip() for l in output if l.startswith('no!')]
     if r != 0:
         failures.append('no! retcode\n')
         if single:
             print(f'Test failed with {r}')
             sys.exit(r)
 
+    if args.snapshot and args.b == 32:
+        failures.extend(run_snapshot(test, output))
+    if args.image_cache:
+        failures.extend(run_image_cache(test, output))
+    if test in extra_checks and args.b == 32:
+        failures.extend(extra_checks[test](test))
+
     test_results.append(TestResult(test, failures))
 
 if args.test is None:
@@ -0,0 +1,74 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/*
+ * Prints what the program got at startup. With run.py -s, the snapshot is taken with different arguments
+ * and environment and the output of the restored run must match the cold run.
+ */
+
+extern char **environ;
+
+static int seen_sig = 0;
+
+static void handler(int signo) {
+    seen_sig = signo;
+}
+
+int main(int argc, char **argv) {
+    int i;
+    char *env;
+    char *mem;
+    char *cwd;
+
+    for (i = 0; i < argc; i++) {
+        printf("ok! argv[%d] %s\n", i, argv[i]);
+    }
+    if (argv[argc] != NULL) {
+        printf("no! argv not terminated\n");
+    }
+
+    env = getenv("QINE_TEST_SNAPSHOT");
+    printf("ok! env %s\n", env ? env : "(unset)");
+    for (i = 0; environ[i]; i++) {
+        if (strncmp(environ[i], "QINE_TEST_SNAPSHOT_SAVE=", 24) == 0) {
+            printf("no! environment of the snapshot run leaked\n");
+        }
+    }
+
+    cwd = getcwd(NULL, 0);
+    if (cwd && strlen(cwd) > 0) {
+        printf("ok! cwd\n");
+    } else {
+        printf("no! cwd\n");
+    }
+
+    check_ok("kill self", kill(getpid(), 0));
+    if (getppid() > 0) {
+        printf("ok! ppid\n");
+    } else {
+        printf("no! ppid\n");
+    }
+
+    mem = malloc(256 * 1024);
+    if (mem) {
+        memset(mem, 0xcc, 256 * 1024);
+        free(mem);
+        printf("ok! malloc\n");
+    } else {
+        printf("no! malloc\n");
+    }
+
+    signal(SIGUSR1, handler);
+    raise(SIGUSR1);
+    if (seen_sig == SIGUSR1) {
+        printf("ok! signal\n");
+    } else {
+        printf("no! signal\n");
+    }
+    return 0;
+}
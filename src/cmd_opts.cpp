@@ -98,6 +98,12 @@ void String::handle(std::string&& v) {
     *m_dst = std::move(v);
 }
 
+StringList::StringList(std::vector<std::string> *dst): m_dst(dst) {}
+StringList::~StringList() {}
+void StringList::handle(std::string&& v) {
+    m_dst->push_back(std::move(v));
+}
+
 template<class T>
 Integer<T>::Integer(T *dst, T min, T max): m_dst(dst), m_min(min), m_max(max) {
 
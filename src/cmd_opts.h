@@ -2,6 +2,7 @@
 
 #include <limits>
 #include <vector>
+#include <string>
 #include <string_view>
 
 #include "types.h"
@@ -52,6 +53,16 @@ private:
     T m_max;
 };
 
+/* Appends each occurrence, for keywords that can be given more than once */
+class StringList: public Value {
+public:
+    StringList(std::vector<std::string> *dst);
+    ~StringList();
+    void handle(std::string&& part) override;
+private:
+    std::vector<std::string> *m_dst;
+};
+
 class Flag: public Value {
 public:
     Flag(bool *dst);
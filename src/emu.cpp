@@ -22,6 +22,7 @@
 #include "process.h"
 #include "segment.h"
 #include "segment_descriptor.h"
+#include "stats.h"
 #include "types.h"
 #include "guest_context.h"
 #include "msg.h"
@@ -29,7 +30,7 @@
 #include <gen_msg/proc.h>
 #include <gen_msg/io.h>
 
-Emu::Emu() {}
+Emu::Emu(): m_fast_msg(true) {}
 
 void Emu::init() {
     m_emulation_stack = Process::current()->allocate_segment();
@@ -91,45 +92,70 @@ qine_no_tls void Emu::handler_segv(int sig, siginfo_t *info, void *uctx_void)
         abort();
     }
 
-    // unblock the signal, for better debugging, to avoid someone inheriting the mask if exec'd
-    // and to sent sigsegvs immediately
-    sigset_t ss;
-    sigemptyset(&ss);
-    sigaddset(&ss, SIGSEGV);
-    sigprocmask(SIG_UNBLOCK, &ss, nullptr);
+    // the fault and the sigreturn
+    Stats::host_syscalls.inc(2);
+
+    // first touch of the time segment, the guest can retry the access
+    if (info->si_code == SEGV_ACCERR && ctx.proc()->m_time.handle_fault(info->si_addr)) {
+        signal_tail(ctx);
+        return;
+    }
+
+    ctx.proc()->snapshot().trap(ctx);
 
     bool handled = false;
 
+    // migrate to LDT and patch the code loading the selector, so that it does not fault next time
     if (ctx.reg_es() == Qnx::MAGIC_PTR_SELECTOR) {
-        // hack: migrate to LDT instead of patching the code
-        ctx.reg_es() = Qnx::MAGIC_PTR_SELECTOR | 4;
-        // Log::dbg("Migrating ES to LDT @ %x\n", ctx.reg_eip());
+        m_magic_patcher.patch(ctx, GuestContext::ES, ctx.proc()->m_bits);
+        ctx.reg_es() = Qnx::MAGIC_PTR_SELECTOR | SegmentDescriptor::SEL_LDT;
         handled = true;
     }
 
     if (ctx.reg_ds() == Qnx::MAGIC_PTR_SELECTOR) {
+        m_magic_patcher.patch(ctx, GuestContext::DS, ctx.proc()->m_bits);
         ctx.reg_ds() = Qnx::MAGIC_PTR_SELECTOR | SegmentDescriptor::SEL_LDT;
-        // Log::dbg("Migrating DS to LDT @ %x\n", ctx.reg_eip());
         handled = true;
     }
 
-    int insn_len;
-    if (matches_syscall(ctx, 0xF2, &insn_len)) {
-        ctx.reg_eip() += insn_len;
-        // note: syscall includes sysreturn which may change eip
-        dispatch_syscall(ctx);
-        handled = true;
-    } else if (matches_syscall(ctx, 0xF1, &insn_len)) {
-        ctx.reg_eip() += insn_len;
-        dispatch_syscall_sem(ctx);
-        handled = true;
-    } else if (matches_syscall(ctx, 0xF0, &insn_len)) {
+    auto site = m_trap_sites.lookup(ctx.reg_cs(), ctx.reg_eip());
+    if (!site) {
+        site = decode_syscall(ctx);
+    }
+
+    if (site) {
+        uint8_t int_nr = site->int_nr;
+        uint8_t insn_len = site->len;
+
+        // once the site proved stable, redirect it so that next time it does not trap
+        if (m_gate.enabled() && insn_len == 2 && site->hits == TrapSites::STABLE_HITS) {
+            if (m_gate.redirect(ctx, int_nr, ctx.proc()->m_bits)) {
+                m_trap_sites.forget(ctx.reg_cs(), ctx.reg_eip());
+            }
+        }
+
         ctx.reg_eip() += insn_len;
-        dispatch_syscall16(ctx);
+        // the first kernel call always traps, the gate only takes over sites that trapped before
+        if (Stats::guest_syscalls.value() == 0) {
+            Stats::first_syscall_ns.inc(Stats::since_start());
+        }
+        Stats::guest_syscalls.inc();
+        switch (int_nr) {
+            case 0xF2:
+                // note: syscall includes sysreturn which may change eip
+                dispatch_syscall(ctx);
+                break;
+            case 0xF1:
+                dispatch_syscall_sem(ctx);
+                break;
+            case 0xF0:
+                dispatch_syscall16(ctx);
+                break;
+        }
+        ctx.proc()->scratch().reset();
         handled = true;
     }
     
-    
     if (!handled) {
         //ctx.dump(stderr, 64);
         //Emu::debug_hook_problem();
@@ -139,25 +165,33 @@ qine_no_tls void Emu::handler_segv(int sig, siginfo_t *info, void *uctx_void)
     signal_tail(ctx);
 }
 
-bool Emu::matches_syscall(GuestContext &ctx, int int_nr, int* insn_len) {
-    *insn_len = 0;
+/* Decode the kernel call at CS:EIP and remember it in the trap site cache */
+TrapSites::Site* Emu::decode_syscall(GuestContext &ctx) {
     try {
         auto eip = ctx.reg_eip();
-        auto b1 = ctx.read<uint8_t>(GuestContext::CS, eip);
+        uint8_t len = 2;
         // prefix
-        if (b1 == 0x66) {
-            eip++;
-            (*insn_len) ++;
-            b1 = ctx.read<uint8_t>(GuestContext::CS, eip);
+        if (ctx.read<uint8_t>(GuestContext::CS, eip) == 0x66) {
+            len++;
         }
 
-        (*insn_len) += 2;
-        return b1 == 0xCD && ctx.read<uint8_t>(GuestContext::CS, eip + 1) == int_nr;
+        auto insn = static_cast<const uint8_t*>(ctx.translate(GuestContext::CS, eip, len));
+        auto op = insn + len - 2;
+        if (op[0] != 0xCD || (op[1] != 0xF0 && op[1] != 0xF1 && op[1] != 0xF2)) {
+            return nullptr;
+        }
+        return m_trap_sites.insert(ctx.reg_cs(), eip, insn, len, op[1]);
     } catch (const SegmentationFault&) {
-        return false;
+        return nullptr;
     }
 }
 
+/* Must be called when a segment is freed or its descriptor changes */
+void Emu::segment_changed(uint16_t sel) {
+    m_trap_sites.invalidate_segment(sel);
+    m_magic_patcher.invalidate_segment(sel);
+}
+
 qine_no_tls void Emu::static_handler_generic(int sig, siginfo_t *info, void *uctx) {
     Process::current()->m_emu.handler_generic(sig, info, uctx);;
 }
@@ -189,6 +223,7 @@ qine_no_tls void Emu::sync_host_sigmask(GuestContext &ctx) {
     // affects some calls, like TC SIGTTOU and tcsetpgrp
     ctx.saved_sigmask() = m_sigmask.map_to_host_sigset();
     sigdelset(&ctx.saved_sigmask(), SIGSEGV);
+    m_host_sigmask = m_sigmask;
     //fprintf(stderr, "setting host sigmask %lx\n", ctx.saved_sigmask().__val[0]);
 }
 
@@ -220,18 +255,25 @@ qine_no_tls void Emu::signal_tail(GuestContext& ctx) {
     auto proc = ctx.proc();
     proc->update_timesel();
 
-    QnxSigset activesig = m_sigpend;
-    activesig.modify(m_sigmask, QnxSigset::empty());
-
     if ((ctx.reg_cs() & SegmentDescriptor::SEL_LDT) == 0) {
         /* We are returning to host code -- do not do anyting special */
+        m_gate.fixup_host_return(ctx);
         return;
     }
 
+    deliver_signals(ctx);
+    ctx.m_ectx->to_cpu();
+}
+
+/* Set up the QNX signal state in the guest context if there is a pending signal */
+void Emu::deliver_signals(GuestContext& ctx) {
+    auto proc = ctx.proc();
+    QnxSigset activesig = m_sigpend;
+    activesig.modify(m_sigmask, QnxSigset::empty());
+
     if (activesig.is_empty()) {
         // return to QNX without activating any signal
         sync_host_sigmask(ctx);
-        ctx.m_ectx->to_cpu();
         return;
     }
 
@@ -289,7 +331,50 @@ qine_no_tls void Emu::signal_tail(GuestContext& ctx) {
     }
     Log::print(Log::SIG, "New mask %x, pending %x\n", 
             m_sigmask.m_value, m_sigpend.m_value);
-    ctx.m_ectx->to_cpu();
+}
+
+qine_no_tls void Emu::static_gate_entry(SyscallGate::Frame *frame) {
+    Process::current()->m_emu.gate_entry(frame);
+}
+
+qine_no_tls void Emu::gate_entry(SyscallGate::Frame *frame) {
+    m_tls_fixup.restore();
+
+    // now we have normal C environment
+    assert(!m_in_gate);
+    m_in_gate = true;
+    // load_context only fills the registers
+    ucontext_t uctx = {};
+    ExtraContext ectx;
+    auto ctx = GuestContext(&uctx, &ectx);
+    auto proc = ctx.proc();
+    SyscallGate::load_context(*frame, ctx, proc->m_bits);
+
+    Stats::guest_syscalls.inc();
+    switch (frame->int_nr) {
+        case 0xF2:
+            dispatch_syscall(ctx);
+            break;
+        case 0xF1:
+            dispatch_syscall_sem(ctx);
+            break;
+        case 0xF0:
+            dispatch_syscall16(ctx);
+            break;
+    }
+    proc->scratch().reset();
+
+    /* Same as signal_tail, but there is no sigreturn to apply the mask and the gate loads the segments */
+    proc->update_timesel();
+    QnxSigset applied = m_host_sigmask;
+    deliver_signals(ctx);
+    if (applied.m_value != m_host_sigmask.m_value) {
+        sigprocmask(SIG_SETMASK, &ctx.saved_sigmask(), nullptr);
+        Stats::host_syscalls.inc();
+    }
+
+    SyscallGate::store_context(ctx, *frame);
+    m_in_gate = false;
 }
 
 void Emu::syscall_sigreturn(GuestContext &ctx)
@@ -396,6 +481,11 @@ void Emu::syscall_sendfdmx(GuestContext &ctx)
     GuestPtr send_data = ctx.reg_ebx();
     GuestPtr recv_data = ctx.reg_esi();
 
+    if (m_fast_msg && proc->handle_msg_fast(send_parts, FarPointer(ds, send_data), recv_parts, FarPointer(ds, recv_data))) {
+        ctx.set_syscall_ok();
+        return;
+    }
+
     Msg msg(proc, send_parts, FarPointer(ds, send_data),  recv_parts, FarPointer(ds, recv_data), B32);
     MsgContext info;
     info.m_ctx = &ctx;
@@ -405,7 +495,9 @@ void Emu::syscall_sendfdmx(GuestContext &ctx)
     info.m_fd = fd;
 
     proc->handle_msg(info);
-    ctx.set_syscall_ok();
+    if (!info.m_consumed) {
+        ctx.set_syscall_ok();
+    }
 }
 
 void Emu::syscall_receivmx(GuestContext &ctx)
@@ -444,7 +536,9 @@ void Emu::syscall_sendmx(GuestContext &ctx)
     info.m_pid = pid;
 
     proc->handle_msg(info);
-    ctx.set_syscall_ok();
+    if (!info.m_consumed) {
+        ctx.set_syscall_ok();
+    }
 }
 
 void Emu::syscall_kill(GuestContext &ctx)
@@ -545,7 +639,9 @@ void Emu::syscall16_sendfdmx(GuestContext &ctx)
     info.m_fd = fd;
 
     proc->handle_msg(info);
-    ctx.set_syscall_ok();
+    if (!info.m_consumed) {
+        ctx.set_syscall_ok();
+    }
 }
 
 void Emu::syscall16_receivmx(GuestContext &ctx)
@@ -585,7 +681,9 @@ void Emu::syscall16_sendmx(GuestContext &ctx)
     info.m_pid = pid;
 
     proc->handle_msg(info);
-    ctx.set_syscall_ok();
+    if (!info.m_consumed) {
+        ctx.set_syscall_ok();
+    }
 }
 
 void Emu::syscall16_sigreturn(GuestContext &ctx)
@@ -631,9 +729,16 @@ qine_no_tls void Emu::static_handler_user(int sig, siginfo_t *info, void *uctx)
     ectx.from_cpu();
     auto sig_ctx = reinterpret_cast<ucontext_t*>(uctx);
     GuestContext ctx(sig_ctx, &ectx);
-    auto proc = Process::current();
     ctx.clear_64bit_state();
+    load_startup_context(ctx);
+
+    Log::print(Log::LOADER, "Entering emulation\n");
 
+    ectx.to_cpu();
+}
+
+void Emu::load_startup_context(GuestContext& ctx) {
+    auto proc = Process::current();
     #define SYNC(x) ctx.reg_##x() = proc->m_startup_context.reg_##x()
     SYNC(eip);
     SYNC(cs);
@@ -652,10 +757,25 @@ qine_no_tls void Emu::static_handler_user(int sig, siginfo_t *info, void *uctx)
     SYNC(esi);
     SYNC(edi);
     #undef SYNC
+}
 
-    Log::print(Log::LOADER, "Entering emulation\n");
-
-    ectx.to_cpu();
+void Emu::reset_signals_for_exec() {
+    /* Like execve: caught signals revert to the default action, ignored stay ignored and pending stay pending */
+    for (int qnx_sig = Qnx::QSIGMIN; qnx_sig <= Qnx::QSIGMAX; qnx_sig++) {
+        int host_sig = QnxSigset::map_sig_qnx_to_host(qnx_sig);
+        if (host_sig == -1 || host_sig == SIGSEGV) {
+            continue;
+        }
+        struct sigaction sa;
+        if (sigaction(host_sig, nullptr, &sa) != 0) {
+            continue;
+        }
+        if ((sa.sa_flags & SA_SIGINFO) && sa.sa_sigaction == static_handler_generic) {
+            sa = {};
+            sa.sa_handler = SIG_DFL;
+            sigaction(host_sig, &sa, nullptr);
+        }
+    }
 }
 
 void Emu::enter_emu() {
@@ -663,7 +783,9 @@ void Emu::enter_emu() {
 
     struct sigaction sa = {0};
     sa.sa_sigaction = Emu::static_handler_segv;
-    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    /* SIGSEGV is not blocked in the handler, so that we do not need to unblock it on each trap (for better
+     * debugging, to avoid someone inheriting the mask if exec'd and to get nested sigsegvs immediately) */
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
     sigemptyset(&sa.sa_mask);
     if (sigaction(SIGSEGV, &sa, nullptr) == -1){
         throw std::runtime_error(strerror(errno));
@@ -673,6 +795,11 @@ void Emu::enter_emu() {
     sigset_t current;
     sigprocmask(SIG_SETMASK, nullptr, &current);
     m_sigmask = QnxSigset::map_sigmask_host_to_qnx(current);
+    m_host_sigmask = m_sigmask;
+
+    if (m_gate.enabled()) {
+        m_gate.install(&Emu::static_gate_entry);
+    }
 
     /* We abuse the signal mechanism for a context switch, so that we do not need to use any other mechanism */
 
@@ -688,6 +815,10 @@ void Emu::enter_emu() {
     raise(SIGUSR1);
 }
 
+void Emu::enable_syscall_gate() {
+    m_gate.enable();
+}
+
 int Emu::signal_sigact(int qnx_sig, FarPointer handler, uint32_t mask)
 {
     if (handler.m_offset == Qnx::QSIG_HOLD) {
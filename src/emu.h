@@ -7,9 +7,12 @@
 #include <sys/ucontext.h>
 
 #include "guest_context.h"
+#include "magic_patcher.h"
 #include "qnx/errno.h"
 #include "qnx/procenv.h"
 #include "qnx_sigset.h"
+#include "syscall_gate.h"
+#include "trap_sites.h"
 
 class Segment;
 class Process;
@@ -21,6 +24,14 @@ public:
     Emu();
     void init();
     void enter_emu();
+    void enable_syscall_gate();
+    bool syscall_gate_enabled() const { return m_gate.enabled(); }
+    void disable_fast_msg() { m_fast_msg = false; }
+    void segment_changed(uint16_t sel);
+    /* Called on in-process exec, the guest signal handlers went away with the old image */
+    void reset_signals_for_exec();
+    /* Make the context continue at the start of the loaded image */
+    static void load_startup_context(GuestContext& ctx);
 
     int signal_sigact(int qnx_sig, FarPointer handler, uint32_t mask);
     void signal_raise(int qnx_sig);
@@ -57,6 +68,7 @@ private:
     void handle_guest_segv(GuestContext &ctx, siginfo_t *info);
     void handler_generic(int sig, siginfo_t *info, void *uctx);
     void signal_tail(GuestContext& ctx);
+    void deliver_signals(GuestContext& ctx);
     void sync_host_sigmask(GuestContext &ctx);
     void kill(GuestContext& ctx, int qnx_signo, int qnx_code);
 
@@ -66,10 +78,21 @@ private:
     static void static_handler_segv(int sig, siginfo_t *info, void *uctx);
     static void static_handler_user(int sig, siginfo_t *info, void *uctx);
     static void static_handler_generic(int sig, siginfo_t *info, void *uctx);
+    static void static_gate_entry(SyscallGate::Frame *frame);
+    void gate_entry(SyscallGate::Frame *frame);
 
-    static bool matches_syscall(GuestContext &ctx, int int_nr, int *insn_len);
+    TrapSites::Site* decode_syscall(GuestContext &ctx);
 
     TlsFixup m_tls_fixup;
+    SyscallGate m_gate;
+    /*
+     * The gate has a single stack. It cannot nest: guest code only runs again once gate_entry has returned,
+     * and the host signal handlers do not enter guest code.
+     */
+    bool m_in_gate = false;
+    TrapSites m_trap_sites;
+    MagicPatcher m_magic_patcher;
+    bool m_fast_msg;
 
     std::shared_ptr<Segment> m_emulation_stack;
 
@@ -79,6 +102,8 @@ private:
      */
     QnxSigset m_sigpend;
     QnxSigset m_sigmask;
+    /* The guest mask as applied to the host when the guest runs, the gate must apply it by itself */
+    QnxSigset m_host_sigmask;
 
     static constexpr int REDLINE = 128;
 };
@@ -1,6 +1,7 @@
 #include "fsutil.h"
 #include "log.h"
 
+#include <fcntl.h>
 #include <system_error>
 #include <unistd.h>
 #include <assert.h>
@@ -9,6 +10,10 @@
 namespace Fsutil {
 
 bool readlink(const char *path, std::string& dst) {
+    return readlinkat(AT_FDCWD, path, dst);
+}
+
+bool readlinkat(int dirfd, const char *path, std::string& dst) {
     dst.clear();
     
     size_t size = 256;
@@ -16,14 +21,14 @@ bool readlink(const char *path, std::string& dst) {
 
     for (;;) {
         dst.resize(size + 1);
-        r = ::readlink(path, dst.data(), dst.size());
+        r = ::readlinkat(dirfd, path, dst.data(), dst.size());
         if (r < 0) {
             return false;
         } else if (r == size + 1) {
             size *= 2;
             continue;
         } else {
-            dst.resize(size);
+            dst.resize(r);
             return true;
         }
     }
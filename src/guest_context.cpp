@@ -9,11 +9,13 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <asm/prctl.h>
+#include <sys/auxv.h>
 #include <sys/syscall.h>
 
 #include "compiler.h"
 #include "guest_context.h"
 #include "process.h"
+#include "stats.h"
 #include "types.h"
 
 GuestContext::GuestContext(ucontext_t *ctx, ExtraContext *ectx): m_ctx(ctx), m_ectx(ectx), m_proc(Process::current()) {
@@ -270,10 +272,15 @@ qine_no_tls void ExtraContext::to_cpu() {
 }
 
 
+#ifndef HWCAP2_FSGSBASE
+#define HWCAP2_FSGSBASE (1 << 1)
+#endif
+
 void TlsFixup::save() {
     #ifdef __amd64__
     int r;
     /* There are optionally some instructions for that*/
+    fsgsbase = getauxval(AT_HWCAP2) & HWCAP2_FSGSBASE;
     r = syscall(SYS_arch_prctl, ARCH_GET_FS, &fsbase);
     if (r < 0)
         throw std::logic_error("arch_prctl failed");
@@ -284,6 +291,12 @@ void TlsFixup::save() {
 }
 qine_no_tls void TlsFixup::restore() {
     #ifdef __amd64__
+    if (fsgsbase) {
+        __asm__ volatile ("wrfsbase %0" :: "r" (fsbase));
+        __asm__ volatile ("wrgsbase %0" :: "r" (gsbase));
+        return;
+    }
+
     int r;
     r = syscall(SYS_arch_prctl, ARCH_SET_FS, fsbase);
     if (r < 0)
@@ -291,5 +304,6 @@ qine_no_tls void TlsFixup::restore() {
     r = syscall(SYS_arch_prctl, ARCH_SET_GS, gsbase);
     if (r < 0)
         throw std::logic_error("arch_prctl failed");
+    Stats::host_syscalls.inc(2);
     #endif
 }
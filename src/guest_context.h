@@ -23,7 +23,10 @@ public:
     SegmentationFault(const char *what): std::runtime_error(what) {}
 };
 
-/* x64 does not restore FS and GS to known values on signal entry, we need to reload them */
+/* 
+ * x64 does not restore FS and GS to known values on signal entry, we need to reload them.
+ * If the CPU and kernel allow it, this is done with wrfsbase/wrgsbase instead of arch_prctl, to save two syscalls per trap.
+ */
 class TlsFixup {
 public:
     void save();
@@ -31,6 +34,7 @@ public:
 private:
     uint64_t fsbase;
     uint64_t gsbase;
+    bool fsgsbase;
 };
 
 /* DS, ES, FS and GS are not stored in ucontext on 64 bit linux, store them here. */
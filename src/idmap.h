@@ -31,6 +31,8 @@ public:
     Id search(Id from, bool used);
     T* operator[](Id i);
     void free(Id i);
+    /* Like free, but also destroys the item */
+    void erase(Id i);
     ~IdMap();
 private:
     /* Internally, Id can  refer to the unallocate places, do not assume the map has grown */
@@ -100,6 +102,13 @@ void IdMap<T>::free(Id i) {
     m_data[i].release();
 }
 
+template <class T>
+void IdMap<T>::erase(Id i) {
+    if (i >= m_data.size())
+        return;
+    m_data[i].reset();
+}
+
 template <class T>
 auto IdMap<T>::search(Id from, bool used) -> Id {
     for (; from < m_data.size(); from++) { 
@@ -0,0 +1,159 @@
+#include "image_cache.h"
+
+#include <cstddef>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mem_ops.h"
+#include "stats.h"
+#include "types.h"
+#include "util.h"
+
+static Stats::Counter stat_hit("image_cache.hit");
+static Stats::Counter stat_miss("image_cache.miss");
+static Stats::Counter stat_store("image_cache.store");
+
+struct ImageCache::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t region_count;
+    uint32_t patch_count;
+};
+
+static constexpr uint32_t CACHE_MAGIC = 0x31434951; /* QIC1 */
+
+void ImageCache::set_directory(const char *dir) {
+    m_dir = dir;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        throw ConfigurationError(std_printf("Cannot create image cache directory %s: %s", dir, strerror(errno)));
+    }
+}
+
+void ImageCache::fill_key(const struct stat& st, Header *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = CACHE_MAGIC;
+    hdr->version = LOADER_VERSION;
+    hdr->dev = st.st_dev;
+    hdr->ino = st.st_ino;
+    hdr->size = st.st_size;
+    hdr->mtime_sec = st.st_mtim.tv_sec;
+    hdr->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+std::string ImageCache::entry_path(const struct stat& st) const {
+    return std_printf("%s/%lx-%lx.img", m_dir.c_str(), static_cast<unsigned long>(st.st_dev),
+        static_cast<unsigned long>(st.st_ino));
+}
+
+static bool read_at(int fd, void *dst, size_t size, off_t offset) {
+    return pread(fd, dst, size, offset) == static_cast<ssize_t>(size);
+}
+
+bool ImageCache::lookup(int lmf_fd, Entry *out) {
+    struct stat st;
+    if (fstat(lmf_fd, &st) != 0) {
+        stat_miss.inc();
+        return false;
+    }
+
+    UniqueFd fd(open(entry_path(st).c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd.valid()) {
+        stat_miss.inc();
+        return false;
+    }
+
+    Header expected, hdr;
+    fill_key(st, &expected);
+    if (!read_at(fd.get(), &hdr, sizeof(hdr), 0)
+        || memcmp(&hdr, &expected, offsetof(Header, region_count)) != 0) {
+        Log::print(Log::LOADER, "image cache: stale entry\n");
+        stat_miss.inc();
+        return false;
+    }
+
+    struct stat cache_st;
+    if (fstat(fd.get(), &cache_st) != 0) {
+        stat_miss.inc();
+        return false;
+    }
+    out->regions.resize(hdr.region_count);
+    out->patches.resize(hdr.patch_count);
+    off_t pos = sizeof(hdr);
+    size_t regions_size = hdr.region_count * sizeof(Region);
+    size_t patches_size = hdr.patch_count * sizeof(Patch);
+    if (pos + regions_size + patches_size > static_cast<size_t>(cache_st.st_size)
+        || !read_at(fd.get(), out->regions.data(), regions_size, pos)
+        || !read_at(fd.get(), out->patches.data(), patches_size, pos + regions_size)) {
+        Log::print(Log::LOADER, "image cache: truncated entry\n");
+        stat_miss.inc();
+        return false;
+    }
+    for (const auto& r: out->regions) {
+        if (r.size && (!MemOps::is_page_aligned(r.file_offset) || r.file_offset + r.size > cache_st.st_size)) {
+            Log::print(Log::LOADER, "image cache: invalid region\n");
+            stat_miss.inc();
+            return false;
+        }
+    }
+
+    out->fd = std::move(fd);
+    stat_hit.inc();
+    return true;
+}
+
+void ImageCache::store(int lmf_fd, std::vector<Region>& regions, const std::vector<const void*>& data,
+    const std::vector<Patch>& patches)
+{
+    struct stat st;
+    if (fstat(lmf_fd, &st) != 0) {
+        return;
+    }
+
+    Header hdr;
+    fill_key(st, &hdr);
+    hdr.region_count = regions.size();
+    hdr.patch_count = patches.size();
+
+    size_t pos = MemOps::align_page_up(sizeof(hdr) + regions.size() * sizeof(Region) + patches.size() * sizeof(Patch));
+    for (auto& r: regions) {
+        r.file_offset = r.size ? pos : 0;
+        pos += r.size;
+    }
+
+    auto path = entry_path(st);
+    auto tmp_path = std_printf("%s.%d", path.c_str(), getpid());
+    UniqueFd fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (!fd.valid()) {
+        Log::print(Log::LOADER, "image cache: cannot create %s: %s\n", tmp_path.c_str(), strerror(errno));
+        return;
+    }
+
+    bool ok = pwrite(fd.get(), &hdr, sizeof(hdr), 0) == sizeof(hdr);
+    off_t meta = sizeof(hdr);
+    size_t regions_size = regions.size() * sizeof(Region);
+    size_t patches_size = patches.size() * sizeof(Patch);
+    ok = ok && pwrite(fd.get(), regions.data(), regions_size, meta) == static_cast<ssize_t>(regions_size);
+    ok = ok && pwrite(fd.get(), patches.data(), patches_size, meta + regions_size) == static_cast<ssize_t>(patches_size);
+    for (size_t i = 0; ok && i < regions.size(); i++) {
+        ok = pwrite(fd.get(), data[i], regions[i].size, regions[i].file_offset) == regions[i].size;
+    }
+    ok = ok && ftruncate(fd.get(), pos) == 0;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        Log::print(Log::LOADER, "image cache: cannot write %s: %s\n", path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return;
+    }
+    Log::print(Log::LOADER, "image cache: stored %s\n", path.c_str());
+    stat_store.inc();
+}
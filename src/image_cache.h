@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "unique_fd.h"
+
+/*
+ * On-disk cache of loaded LMF images, enabled by --image-cache.
+ *
+ * An entry is keyed by the device and inode of the LMF file and validated against its size, mtime and the
+ * loader version. It holds the contents of each loaded segment right after loading and relocation, padded
+ * to pages, so that the next load of the same file can map the segments privately from the entry instead of
+ * parsing the records. Processes running the same binary then share the unmodified pages.
+ *
+ * Relocations depend on the selectors the segments got in the process that created the entry. They are kept
+ * as a patch list and only the ones whose selector differs are rewritten on load.
+ *
+ * Entries are written to a temporary file and renamed, so concurrent loaders see either the old or the new one.
+ */
+class ImageCache {
+public:
+    /* Bump when the contents of loaded images change */
+    static constexpr uint32_t LOADER_VERSION = 1;
+
+    struct Region {
+        /* Page aligned size of the data, 0 if the segment has no loaded pages */
+        uint32_t size;
+        /* Page aligned offset in the entry file */
+        uint32_t file_offset;
+        /* Selector the segment had when the entry was created */
+        uint16_t selector;
+        uint16_t reserved;
+    };
+
+    struct Patch {
+        uint32_t segment;
+        uint32_t offset;
+        /* Index of the segment whose selector goes to segment:offset */
+        uint32_t target;
+    };
+
+    /* Entry opened for loading */
+    struct Entry {
+        UniqueFd fd;
+        std::vector<Region> regions;
+        std::vector<Patch> patches;
+    };
+
+    void set_directory(const char *dir);
+    bool enabled() const { return !m_dir.empty(); }
+
+    /* Find a valid entry for the LMF open as lmf_fd */
+    bool lookup(int lmf_fd, Entry *out);
+    /* Create or replace the entry, data[i] points to regions[i].size bytes. Errors are only logged. */
+    void store(int lmf_fd, std::vector<Region>& regions, const std::vector<const void*>& data,
+        const std::vector<Patch>& patches);
+private:
+    struct Header;
+    static void fill_key(const struct stat& st, Header *hdr);
+    std::string entry_path(const struct stat& st) const;
+
+    std::string m_dir;
+};
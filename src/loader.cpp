@@ -1,15 +1,20 @@
 #include "loader.h"
 
+#include <cerrno>
 #include <cstdint>
 #include <cstring>
 #include <fcntl.h>
 #include <memory>
+#include <new>
 #include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/ucontext.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "process.h"
 #include "segment.h"
@@ -18,6 +23,7 @@
 #include "segment_descriptor.h"
 #include "types.h"
 #include "guest_context.h"
+#include "image_cache.h"
 #include "log.h"
 
 static_assert(sizeof(lmf_header) == 48, "lmf_header size mimsatch");
@@ -43,6 +49,8 @@ struct AbstractLoader {
     virtual void* prepare_segment_load(const lmf_data& ld, size_t file_offset, size_t data_size) = 0;
     virtual void finalize_loading() = 0;
     virtual std::shared_ptr<Segment> get_segment(uint32_t segment) = 0;
+    /* Page aligned range of get_segment(segment) holding the loaded data, available after finalize_segments */
+    virtual void segment_image(uint32_t segment, size_t *offset, size_t *size) = 0;
 
     virtual ~AbstractLoader() {}
 
@@ -68,6 +76,7 @@ struct FlatLoader: public AbstractLoader {
     void *prepare_segment_load(const lmf_data& ld, size_t file_offset, size_t data_size) override;
     void finalize_loading() override;
     std::shared_ptr<Segment> get_segment(uint32_t segment) override;
+    void segment_image(uint32_t segment, size_t *offset, size_t *size) override;
 
     std::vector<FlatSegment> m_segments;
     uint32_t m_segment_pos;
@@ -136,6 +145,11 @@ std::shared_ptr<Segment> FlatLoader::get_segment(uint32_t segment) {
     return m_mem;
 }
 
+void FlatLoader::segment_image(uint32_t segment, size_t *offset, size_t *size) {
+    *offset = m_segments[segment].start;
+    *size = m_segments[segment].size;
+}
+
 void* FlatLoader::prepare_segment_load(const lmf_data& ld, size_t file_offset, size_t data_size) {
     if (ld.segment >= m_segments.size())
         panic("data: invalid segment");
@@ -146,6 +160,8 @@ void* FlatLoader::prepare_segment_load(const lmf_data& ld, size_t file_offset, s
 
 struct LoadedSegment {
     std::shared_ptr<Segment> segment;
+    /* Size before the stack and heap were added */
+    uint32_t image_size;
 };
 
 struct SegmentLoader: public AbstractLoader {
@@ -157,6 +173,7 @@ struct SegmentLoader: public AbstractLoader {
     void *prepare_segment_load(const lmf_data& ld, size_t file_offset, size_t data_size) override;
     void finalize_loading() override;
     std::shared_ptr<Segment> get_segment(uint32_t segment) override;
+    void segment_image(uint32_t segment, size_t *offset, size_t *size) override;
 
     std::vector<LoadedSegment> m_segments;
 };
@@ -179,6 +196,7 @@ void SegmentLoader::alloc_segment(uint32_t id, Access access, uint32_t size) {
     }
     seg->grow_bytes(size);
     m_segments[id].segment = seg;
+    m_segments[id].image_size = size;
     Log::print(Log::LOADER, "segment %d: size=%x, type=%x, linear=%x\n", id, size, access, seg->location());
 }
 
@@ -225,6 +243,11 @@ std::shared_ptr<Segment> SegmentLoader::get_segment(uint32_t seg)
     return m_segments[seg].segment;
 }
 
+void SegmentLoader::segment_image(uint32_t segment, size_t *offset, size_t *size) {
+    *offset = 0;
+    *size = MemOps::align_page_up(m_segments[segment].image_size);
+}
+
 
 #define PTR_AND_VAL(x) reinterpret_cast<char*>(&(x)), (x)
 static void check_value(const char* value, lmf_header_with_record *hdr, uint32_t expected, char *got_addr, uint32_t got) {
@@ -237,17 +260,169 @@ static void check_value(const char* value, lmf_header_with_record *hdr, uint32_t
     }
 }
 
-static void checked_read(const char* operation, int fd, void *dst, size_t size) {
-    int r = read(fd, dst, size);
-    if (r < 0) {
-        perror(operation);
+/*
+ * The whole LMF file mapped read-only. The records are parsed in place, through bounds-checked views.
+ */
+class LmfFile {
+public:
+    explicit LmfFile(int fd);
+    ~LmfFile();
+
+    int fd() const { return m_fd; }
+    /* On a read-only file system, so the pages cannot change under a private mapping */
+    bool immutable() const { return m_immutable; }
+    const char* view(size_t offset, size_t size, const char *what) const;
+    template<class T> T get(size_t offset, const char *what) const {
+        T v;
+        memcpy(&v, view(offset, sizeof(T), what), sizeof(T));
+        return v;
+    }
+private:
+    int m_fd;
+    const char *m_data;
+    size_t m_size;
+    bool m_immutable;
+};
+
+LmfFile::LmfFile(int fd): m_fd(fd), m_data(nullptr), m_size(0), m_immutable(false) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("loader: stat");
         exit(1);
     }
+    m_size = st.st_size;
+    struct statvfs vfs;
+    m_immutable = fstatvfs(fd, &vfs) == 0 && (vfs.f_flag & ST_RDONLY);
+    if (m_size == 0) {
+        return;
+    }
+    void *p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("loader: map");
+        exit(1);
+    }
+    m_data = static_cast<const char*>(p);
+}
+
+LmfFile::~LmfFile() {
+    if (m_data) {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+}
 
-    if (r < size) {
-        fprintf(stderr, "%s: EOF\n", operation);
+const char* LmfFile::view(size_t offset, size_t size, const char *what) const {
+    if (offset > m_size || size > m_size - offset) {
+        fprintf(stderr, "%s: EOF\n", what);
         throw LoaderFormatException("EOF");
     }
+    return m_data + offset;
+}
+
+static bool is_read_only(Access access) {
+    return access == Access::EXEC_ONLY || access == Access::EXEC_READ || access == Access::READ_ONLY;
+}
+
+// A run of fixups, pointing into the mapped file
+struct RelocSpan {
+    const qnx_reloc_item *items;
+    size_t count;
+};
+
+// read individual records and parse the interesting ones, loading the data if they are data segments
+static void load_records(const LmfFile& file, size_t pos, AbstractLoader *loader,
+    const std::vector<Access>& segment_types, std::vector<RelocSpan>& relocs_out)
+{
+    lmf_record rec;
+    rec.rec_type = LMF_HEADER_REC;
+    bool rw_state = true;
+    while (rec.rec_type != LMF_IMAGE_END_REC) {
+        rec = file.get<lmf_record>(pos, "loader: read record");
+        pos += sizeof(rec);
+        const char *body = file.view(pos, rec.data_nbytes, "loader: read record data");
+        // printf("record type=%x, len=%x\n", rec.rec_type, rec.data_nbytes);
+
+        if (rec.rec_type == LMF_FIXUP_REC) {
+            uint32_t relocs = rec.data_nbytes / sizeof(qnx_reloc_item);
+            if (relocs * sizeof(qnx_reloc_item) != rec.data_nbytes)
+                throw LoaderFormatException("Unaligned relocation segment size");
+            relocs_out.push_back(RelocSpan{reinterpret_cast<const qnx_reloc_item*>(body), relocs});
+        } else if (rec.rec_type == LMF_LINEAR_FIXUP_REC) {
+            panic("loader: linear fixup rec unsupported");
+        } else if (rec.rec_type == LMF_RW_END_REC) {
+            // We ignore signature for now
+            rw_state = false;
+        } else if (rec.rec_type == LMF_LOAD_REC) {
+            lmf_data ld;
+            if (rec.data_nbytes < sizeof(ld)) {
+                panic("loader: data: record too short");
+            }
+            memcpy(&ld, body, sizeof(ld));
+            
+            uint32_t data_size = rec.data_nbytes - sizeof(ld);
+            size_t offset = pos + sizeof(ld);
+            Log::print(Log::LOADER, "load data: segment=0x%x, offset=0x%x, file=0x%zx, size=0x%x\n", ld.segment, ld.offset, offset, data_size);
+            char *dst = static_cast<char*>(loader->prepare_segment_load(ld, offset, data_size));
+
+            /*
+             * Whole pages of read-only segments can come straight from the file, if they line up. Only if the file
+             * cannot change: a private mapping shows a rewrite of the tool in place, and faults after a truncate.
+             */
+            size_t mapped = MemOps::align_page_down(data_size);
+            auto dst_addr = reinterpret_cast<uintptr_t>(dst);
+            if (mapped && file.immutable() && is_read_only(segment_types[ld.segment])
+                && MemOps::is_page_aligned(offset) && MemOps::is_page_aligned(dst_addr))
+            {
+                Log::print(Log::LOADER, "load data: mapped 0x%zx bytes from the file\n", mapped);
+                auto seg = loader->get_segment(ld.segment);
+                seg->map_file(PROT_READ | PROT_WRITE | PROT_EXEC, dst_addr - seg->location(), mapped, file.fd(), offset);
+            } else {
+                mapped = 0;
+            }
+            memcpy(dst + mapped, body + sizeof(ld) + mapped, data_size - mapped);
+        } else {
+            // Log::dbg("Unsupported record: %x\n", rec.rec_type);
+        }
+        pos += rec.data_nbytes;
+    }
+}
+
+// Map the segment images from a cache entry. Returns false (leaving the segments empty) if the entry does not match
+// the layout or cannot be mapped.
+static bool map_cached(AbstractLoader *loader, const ImageCache::Entry& cached, uint32_t segment_count) {
+    if (cached.regions.size() != segment_count) {
+        return false;
+    }
+    for (uint32_t si = 0; si < segment_count; si++) {
+        size_t offset, size;
+        loader->segment_image(si, &offset, &size);
+        if (cached.regions[si].size != size) {
+            return false;
+        }
+    }
+
+    const int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+    for (uint32_t si = 0; si < segment_count; si++) {
+        size_t offset, size;
+        loader->segment_image(si, &offset, &size);
+        if (!size) {
+            continue;
+        }
+        Log::print(Log::LOADER, "map cached: segment=0x%x, file=0x%x, size=0x%zx\n", si, cached.regions[si].file_offset, size);
+        try {
+            loader->get_segment(si)->map_file(prot, offset, size, cached.fd.get(), cached.regions[si].file_offset);
+        } catch (const std::bad_alloc&) {
+            Log::print(Log::LOADER, "image cache: cannot map the entry: %s\n", strerror(errno));
+            // the records are loaded into zero pages, including the one that failed
+            for (uint32_t ci = 0; ci <= si; ci++) {
+                loader->segment_image(ci, &offset, &size);
+                if (size) {
+                    loader->get_segment(ci)->clear_pages(prot, offset, size);
+                }
+            }
+            return false;
+        }
+    }
+    return true;
 }
 
 // see watcom, https://github.com/open-watcom/open-watcom-v2/blob/893cbe8abcc479e75fe8e1517dd23817b0317ca4/bld/wl/c/loadqnx.c#L95
@@ -256,9 +431,10 @@ static void checked_read(const char* operation, int fd, void *dst, size_t size)
 void loader_load(int fd, LoadInfo *info_out, bool slib) {
     auto proc = Process::current();
 
+    LmfFile file(fd);
+
     // read and check header
-    lmf_header_with_record hdr;
-    checked_read("loader: read header", fd, reinterpret_cast<void*>(&hdr), sizeof(hdr));
+    auto hdr = file.get<lmf_header_with_record>(0, "loader: read header");
 
     if (hdr.record.data_nbytes < sizeof(hdr.header)) {
         panic("loader: declared header size too small");
@@ -302,8 +478,7 @@ void loader_load(int fd, LoadInfo *info_out, bool slib) {
     std::vector<Access> segment_types;
     segment_types.resize(segment_count);
     for (uint32_t si = 0;  si < segment_count; ++si) {
-        uint32_t seg_data;
-        checked_read("loader: read segments", fd, reinterpret_cast<void*>(&seg_data), sizeof(seg_data));
+        auto seg_data = file.get<uint32_t>(sizeof(hdr) + si * sizeof(uint32_t), "loader: read segments");
 
         uint32_t size = seg_data & 0x0FFFFFFFu;
         uint32_t type = seg_data >> 28;
@@ -311,62 +486,16 @@ void loader_load(int fd, LoadInfo *info_out, bool slib) {
         segment_types[si] = Access(type);
     }
 
-    loader->finalize_segments();    
-    
-    // read individual records and parse the interesting ones, loading the data if they are data segments
-    lmf_record rec;
-    rec.rec_type = LMF_HEADER_REC;
-    bool rw_state = true;
-    std::vector<qnx_reloc_item> reloc_buf;
-    while (rec.rec_type != LMF_IMAGE_END_REC) {
-        checked_read("loader: read record", fd, reinterpret_cast<void*>(&rec), sizeof(rec));
-        // printf("record type=%x, len=%x\n", rec.rec_type, rec.data_nbytes);
-
-        bool need_skip = true;
-        if (rec.rec_type == LMF_FIXUP_REC) {
-            uint32_t relocs = rec.data_nbytes / sizeof(qnx_reloc_item);
-            if (relocs * sizeof(qnx_reloc_item) != rec.data_nbytes)
-                throw LoaderFormatException("Unaligned relocation segment size");
-            
-            size_t reloc_buf_offset = reloc_buf.size();
-            reloc_buf.resize(relocs + reloc_buf_offset);
-            checked_read("loader: load relocs", fd, &reloc_buf[reloc_buf_offset], relocs * sizeof(qnx_reloc_item));
-            need_skip = false;
-        } else if (rec.rec_type == LMF_LINEAR_FIXUP_REC) {
-            panic("loader: linear fixup rec unsupported");
-        } else if (rec.rec_type == LMF_RW_END_REC) {
-            // We ignore signature for now
-            rw_state = false;
-        } else if (rec.rec_type == LMF_LOAD_REC) {
-            lmf_data ld;
-            if (rec.data_nbytes < sizeof(ld)) {
-                panic("loader: data: record too short");
-            }
-            checked_read("loader: read data header", fd, reinterpret_cast<void*>(&ld), sizeof(ld));
-            
-            uint32_t data_size = rec.data_nbytes - sizeof(ld);
-
-            off_t offset = lseek(fd, 0, SEEK_CUR);
-            if (offset < 0) {
-                panic("loader: cannot tell file position\n");
-            }
-            Log::print(Log::LOADER, "load data: segment=0x%x, offset=0x%x, file=0x%lx, size=0x%x\n", ld.segment, ld.offset, offset, data_size);
-            void *dst = loader->prepare_segment_load(ld, offset, data_size);
-            checked_read("loader: load data", fd, dst, data_size);
-            need_skip = false;
-        } else {
-            // Log::dbg("Unsupported record: %x\n", rec.rec_type);
-        }
+    loader->finalize_segments();
 
-        if (need_skip) {
-            if (lseek(fd, rec.data_nbytes, SEEK_CUR) < 0) {
-                perror("loader: skip record");
-                exit(1);
-            }
-        }
+    auto& cache = proc->image_cache();
+    ImageCache::Entry cached;
+    bool from_cache = cache.enabled() && cache.lookup(fd, &cached) && map_cached(loader.get(), cached, segment_count);
+    std::vector<RelocSpan> relocs;
+    if (!from_cache) {
+        load_records(file, sizeof(hdr.record) + hdr.record.data_nbytes, loader.get(), segment_types, relocs);
     }
 
-
     uint16_t cs = 0;
     loader->finalize_loading();
     std::vector<uint16_t> selectors;
@@ -389,46 +518,91 @@ void loader_load(int fd, LoadInfo *info_out, bool slib) {
         // Argv index ignore for now. I guess it would be important for some 16-bit executables.
     }
 
+    info_out->selectors = selectors;
+
+    if (from_cache) {
+        // the cached image is relocated already, fix up only the selectors that came out differently
+        for (const auto& p: cached.patches) {
+            if (p.segment >= segment_count || p.target >= segment_count)
+                throw LoaderFormatException("cached relocation out of range");
+            if (selectors[p.target] == cached.regions[p.target].selector)
+                continue;
+            auto seg = loader->get_segment(p.segment);
+            if (!seg->check_bounds(p.offset, 2))
+                throw LoaderFormatException("cached relocation out of range");
+            *reinterpret_cast<uint16_t*>(seg->pointer(p.offset, 2)) = selectors[p.target];
+        }
+        return;
+    }
+
     // perform relocations we gathered
-    for (auto r: reloc_buf) {
-        auto reloc_what = reinterpret_cast<uint16_t*>(loader->get_segment(r.segment)->pointer(r.reloc_offset, 2));
-        uint16_t segment = ((*reloc_what) & ~0x7u) >> 3;
-        if (segment >= segment_count) {
-            throw LoaderFormatException("relocation out of range");
+    std::vector<ImageCache::Patch> patches;
+    for (const auto& span: relocs) {
+        for (size_t ri = 0; ri < span.count; ri++) {
+            const auto& r = span.items[ri];
+            auto reloc_what = reinterpret_cast<uint16_t*>(loader->get_segment(r.segment)->pointer(r.reloc_offset, 2));
+            uint16_t segment = ((*reloc_what) & ~0x7u) >> 3;
+            if (segment >= segment_count) {
+                throw LoaderFormatException("relocation out of range");
+            }
+            uint16_t relocated_value = selectors[segment];
+            //Log::dbg("reloc %04x:%08x -- %x => %x\n", r.segment, r.reloc_offset, *reloc_what, relocated_value);
+            (*reloc_what) = relocated_value;
+            if (cache.enabled()) {
+                patches.push_back(ImageCache::Patch{r.segment, r.reloc_offset, segment});
+            }
         }
-        uint16_t relocated_value = selectors[segment];
-        //Log::dbg("reloc %04x:%08x -- %x => %x\n", r.segment, r.reloc_offset, *reloc_what, relocated_value);
-        (*reloc_what) = relocated_value;
+    }
+
+    if (cache.enabled()) {
+        std::vector<ImageCache::Region> regions(segment_count);
+        std::vector<const void*> data(segment_count);
+        for (uint32_t si = 0; si < segment_count; si++) {
+            size_t offset, size;
+            loader->segment_image(si, &offset, &size);
+            regions[si] = ImageCache::Region{static_cast<uint32_t>(size), 0, selectors[si], 0};
+            data[si] = size ? loader->get_segment(si)->pointer(offset, size) : nullptr;
+        }
+        cache.store(fd, regions, data, patches);
     }
 }
 
+bool loader_peek(int fd, Bitness *bits_out) {
+    lmf_header_with_record hdr;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        return false;
+    }
+    if (hdr.record.rec_type != LMF_HEADER_REC || hdr.record.data_nbytes < sizeof(hdr.header)
+        || hdr.header.version != QNX_VERSION) {
+        return false;
+    }
+    if (!(hdr.header.cpu == 386 || hdr.header.cpu == 486 || hdr.header.cpu == 286)) {
+        return false;
+    }
+    *bits_out = ((hdr.header.cflags & _TCF_32BIT) == 0) ? B16 : B32;
+    return true;
+}
 
 // if there is shebang, put the interpreter in info_out
 // if any error occurs, it is ok, but the info is not filled in
 void loader_check_interpreter(int fd, InterpreterInfo *interp_out) {
-    // check for shebang
-    char shebang[2];
-    int r = read(fd, reinterpret_cast<void*>(shebang), sizeof(shebang));
-    if (r < 0) {
-        return;
-    } else if (r < sizeof(shebang)) {
-        return;
-    }
-
-    if (!(shebang[0] == '#' && shebang[1] == '!')) {
+    // check for shebang, reading the whole line at once
+    constexpr int shebang_size = 2;
+    constexpr int interp_buf_size = 1024;
+    char buf[shebang_size + interp_buf_size];
+    int r = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (r < shebang_size) {
         return;
     }
 
-    constexpr int interp_buf_size = 1024;
-    std::unique_ptr<char[]> interp_buf(new char[interp_buf_size]);
-    r = read(fd, interp_buf.get(), interp_buf_size - 1);
-    if (r < 0) {
+    if (!(buf[0] == '#' && buf[1] == '!')) {
         return;
     }
-    interp_buf[r] = 0;
+    buf[r] = 0;
+    char *interp_buf = buf + shebang_size;
 
     // skip to the interpreter
-    char *c = interp_buf.get();
+    char *c = interp_buf;
     auto end = [&c] { return *c == 0 || *c == '\n'; };
     while (isspace(*c) && !end())
         c++;
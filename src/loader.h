@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 #include "types.h"
 #include "path_mapper.h"
 
@@ -25,7 +27,11 @@ struct LoadInfo {
     uint32_t heap_start;
     uint32_t stack_low;
     uint32_t stack_size;
+    /* Selectors of all the loaded segments */
+    std::vector<uint16_t> selectors;
 };
 
 void loader_check_interpreter(int fd, InterpreterInfo *interp_out);
-void loader_load(int fd, LoadInfo *info_out, bool slib);
\ No newline at end of file
+void loader_load(int fd, LoadInfo *info_out, bool slib);
+/* Check the LMF header without loading anything. Returns false if the file does not look loadable. */
+bool loader_peek(int fd, Bitness *bits_out);
\ No newline at end of file
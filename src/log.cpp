@@ -58,5 +58,14 @@ Log::Category Log::by_name(const char *name) {
     if (strcmp(name, "fd") == 0) {
         return FD;
     }
+    if (strcmp(name, "gate") == 0) {
+        return GATE;
+    }
+    if (strcmp(name, "stats") == 0) {
+        return STATS;
+    }
+    if (strcmp(name, "patch") == 0) {
+        return PATCH;
+    }
     return Category::INVALID;
 }
\ No newline at end of file
@@ -15,6 +15,9 @@ public:
         MAP,
         FD,
         SIG,
+        GATE,
+        STATS,
+        PATCH,
         DEBUG, // for temporary debugging prints
     };
 
@@ -23,6 +26,8 @@ public:
     static void enable(Category c, bool enabled);
     static Category by_name(const char *name);
 
+    static bool enabled(Category c) { return log_mask(c) & m_enabled; }
+
     /* Call functor F with dst FILE stream if selected log category is enabled */
     template<class F>
     static void if_enabled(Category c, F logf) {
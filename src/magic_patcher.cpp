@@ -0,0 +1,138 @@
+#include "log.h"
+#include "magic_patcher.h"
+#include "qnx/magic.h"
+#include "segment_descriptor.h"
+#include "stats.h"
+#include "util.h"
+
+static Stats::Counter stat_fault("magic_sel.fault");
+static Stats::Counter stat_patched("magic_sel.patched");
+static Stats::Counter stat_unpatchable("magic_sel.unpatchable");
+
+void MagicPatcher::patch(GuestContext& ctx, GuestContext::SegmentRegister sreg, Bitness bits) {
+    stat_fault.inc();
+
+    uint64_t site = key(ctx.reg_cs(), ctx.reg_eip());
+    if (m_unpatchable.count(site)) {
+        return;
+    }
+
+    uint32_t eip = ctx.reg_eip();
+    uint32_t start = eip > WINDOW ? eip - WINDOW : 0;
+    int len = eip - start;
+    uint8_t *code = nullptr;
+    if (len > 0) {
+        try {
+            code = static_cast<uint8_t*>(ctx.translate(GuestContext::CS, start, len));
+        } catch (const SegmentationFault&) {
+        }
+    }
+
+    int imm = code ? find_load(ctx, code, len, sreg, bits) : -1;
+    uint8_t alias = Qnx::MAGIC_PTR_SELECTOR | SegmentDescriptor::SEL_LDT;
+    if (imm < 0 || !write_code(code + imm, &alias, sizeof(alias))) {
+        stat_unpatchable.inc();
+        m_unpatchable.insert(site);
+        return;
+    }
+
+    stat_patched.inc();
+    Log::print(Log::PATCH, "patched magic selector load at %x:%x\n", ctx.reg_cs(), start + imm);
+}
+
+void MagicPatcher::invalidate_segment(uint16_t sel) {
+    auto id = SegmentDescriptor::sel_to_id(sel);
+    for (auto it = m_unpatchable.begin(); it != m_unpatchable.end();) {
+        if (SegmentDescriptor::sel_to_id(static_cast<uint16_t>(*it >> 32)) == id) {
+            it = m_unpatchable.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int MagicPatcher::find_load(GuestContext& ctx, const uint8_t *code, int len, GuestContext::SegmentRegister sreg,
+    Bitness bits)
+{
+    // the load must end at the faulting instruction, try the shortest encodings first
+    for (int i = len - 1; i >= 0; i--) {
+        int reg, opsize;
+        int imm = match_load(code + i, len - i, sreg, bits, &reg, &opsize);
+        if (imm >= 0) {
+            return load_verified(ctx, reg, opsize) ? i + imm : -1;
+        }
+    }
+    return -1;
+}
+
+bool MagicPatcher::load_verified(GuestContext& ctx, int reg, int opsize) {
+    uint32_t mask = opsize == 4 ? 0xFFFFFFFF : 0xFFFF;
+    if (reg < 0) {
+        // the value popped into the segment register is still below the stack pointer
+        try {
+            uint32_t value = 0;
+            ctx.read_data(GuestContext::SS, &value, ctx.reg_esp() - opsize, opsize);
+            return (value & mask) == Qnx::MAGIC_PTR_SELECTOR;
+        } catch (const SegmentationFault&) {
+            return false;
+        }
+    }
+    uint32_t value;
+    switch (reg) {
+        case 0: value = ctx.reg_eax(); break;
+        case 1: value = ctx.reg_ecx(); break;
+        case 2: value = ctx.reg_edx(); break;
+        case 3: value = ctx.reg_ebx(); break;
+        case 4: value = ctx.reg_esp(); break;
+        case 5: value = ctx.reg_ebp(); break;
+        case 6: value = ctx.reg_esi(); break;
+        default: value = ctx.reg_edi(); break;
+    }
+    return (value & mask) == Qnx::MAGIC_PTR_SELECTOR;
+}
+
+int MagicPatcher::match_load(const uint8_t *c, int len, GuestContext::SegmentRegister sreg, Bitness bits,
+    int *reg_out, int *opsize_out)
+{
+    uint8_t pop = sreg == GuestContext::ES ? 0x07 : 0x1F;
+    uint8_t modrm = 0xC0 | ((sreg == GuestContext::ES ? 0 : 3) << 3);
+    int opsize = bits == B32 ? 4 : 2;
+    auto is_magic = [c] (int pos, int size) {
+        return c[pos] == Qnx::MAGIC_PTR_SELECTOR && (size < 2 || c[pos + 1] == 0)
+            && (size < 4 || (c[pos + 2] == 0 && c[pos + 3] == 0));
+    };
+
+    *reg_out = -1;
+    *opsize_out = opsize;
+
+    // push imm8; pop sreg
+    if (len == 3 && c[0] == 0x6A && c[1] == Qnx::MAGIC_PTR_SELECTOR && c[2] == pop) {
+        return 1;
+    }
+
+    // push imm; pop sreg
+    if (len == 2 + opsize && c[0] == 0x68 && is_magic(1, opsize) && c[1 + opsize] == pop) {
+        return 1;
+    }
+
+    // mov reg, imm; mov sreg, reg
+    int p = 0;
+    if (bits == B32 && len >= 1 && c[0] == 0x66) {
+        opsize = 2;
+        p++;
+    }
+    if (len < p + 1 + opsize || c[p] < 0xB8 || c[p] > 0xBF || !is_magic(p + 1, opsize)) {
+        return -1;
+    }
+    int reg = c[p] - 0xB8;
+    int q = p + 1 + opsize;
+    if (q < len && c[q] == 0x66) {
+        q++;
+    }
+    if (q + 2 == len && c[q] == 0x8E && c[q + 1] == (modrm | reg)) {
+        *reg_out = reg;
+        *opsize_out = opsize;
+        return p + 1;
+    }
+    return -1;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_set>
+
+#include "guest_context.h"
+#include "types.h"
+
+/*
+ * Patches the guest code loading the magic selector into ES or DS.
+ *
+ * The magic selector is in GDT, which we cannot populate, so each use of it faults and the emulator migrates the
+ * register to the LDT alias. The accessors reload the selector each time, so the same code would fault again and again.
+ * When a fault happens, we look for the load ending right at the faulting instruction (`push imm; pop sreg` or
+ * `mov reg, imm; mov sreg, reg`) and patch the immediate to the LDT alias. x86 code cannot be decoded backwards,
+ * so the load is also checked against the state it left: the register or the popped stack slot must still hold
+ * the magic selector. Anything else is left to the slow path. Sites where no such load was found are remembered,
+ * so that we do not scan them again.
+ */
+class MagicPatcher {
+public:
+    /* Called when a fault was caused by sreg (ES or DS) holding the magic selector */
+    void patch(GuestContext& ctx, GuestContext::SegmentRegister sreg, Bitness bits);
+    /* Forget the state for the segment with the given selector */
+    void invalidate_segment(uint16_t sel);
+private:
+    static uint64_t key(uint16_t cs, uint32_t eip) {
+        return (static_cast<uint64_t>(cs) << 32) | eip;
+    }
+    /* Returns offset of the immediate to patch within code, or -1 */
+    static int find_load(GuestContext& ctx, const uint8_t *code, int len, GuestContext::SegmentRegister sreg,
+        Bitness bits);
+    /*
+     * Match a load taking exactly len bytes. Returns the offset of the immediate or -1, reg is the general
+     * register it goes through, or -1 for push/pop with opsize.
+     */
+    static int match_load(const uint8_t *code, int len, GuestContext::SegmentRegister sreg, Bitness bits,
+        int *reg, int *opsize);
+    /* Does the guest state show that the load just ran */
+    static bool load_verified(GuestContext& ctx, int reg, int opsize);
+
+    std::unordered_set<uint64_t> m_unpatchable;
+
+    /* How far back we look for the load */
+    static constexpr int WINDOW = 16;
+};
@@ -15,6 +15,7 @@
 #include <sys/wait.h>
 #include <vector>
 #include <mntent.h>
+#include <spawn.h>
 
 #include "fd_filter.h"
 #include "fsutil.h"
@@ -42,6 +43,7 @@
 #include "qnx/types.h"
 #include "qnx/wait.h"
 #include "segment_descriptor.h"
+#include "stats.h"
 #include "types.h"
 #include "log.h"
 #include "qnx/pathconf.h"
@@ -49,6 +51,9 @@
 #include "unique_file.h"
 #include "util.h"
 
+static Stats::Counter stat_native_tool("exec.native_tool");
+static Stats::Counter stat_spawn_fork("spawn.fork");
+static Stats::Counter stat_spawn_fresh("spawn.fresh_qine");
 
 void MainHandler::receive(MsgContext& i) {
     try {
@@ -58,6 +63,29 @@ void MainHandler::receive(MsgContext& i) {
     }
 }
 
+bool MainHandler::receive_fast(Process& proc, FlatMsg& m) {
+    uint16_t type;
+    if (!m.read_request(&type)) {
+        return false;
+    }
+
+    try {
+        switch (type) {
+            case QnxMsg::io::msg_read::TYPE:
+                return fast_io_read(proc, m);
+            case QnxMsg::io::msg_write::TYPE:
+                return fast_io_write(proc, m);
+            case QnxMsg::io::msg_lseek::TYPE:
+                return fast_io_lseek(proc, m);
+            case QnxMsg::io::msg_fstat::TYPE:
+                return fast_io_fstat(proc, m);
+        }
+    } catch(const BadFdException&) {
+        // let the full path report it
+    }
+    return false;
+}
+
 void MainHandler::receive_inner(MsgContext& i) {
     Qnx::MsgHeader hdr;
     i.msg().read_type(&hdr);
@@ -378,6 +406,7 @@ void MainHandler::proc_terminate(MsgContext& i)
     QnxMsg::proc::terminate_request msg;
     i.msg().read_type(&msg);
     //i.ctx().dump(stdout);
+    i.proc().result_cache().finish(msg.m_status);
     exit(msg.m_status);
 }
 
@@ -503,7 +532,7 @@ void MainHandler::proc_fd_setfd(MsgContext &i) {
     i.msg().read_type(&msg);
 
     auto fd = i.proc().fds().get_attached_fd(msg.m_fd);
-    if (fd->m_open) {
+    if (fd->m_open && !fd->m_path_only) {
         int r = fcntl(fd->m_host_fd, F_SETFD, msg.m_flags ? FD_CLOEXEC : 0);
         if (r < 0) {
             i.msg().write_status(Emu::map_errno(errno));
@@ -583,6 +612,7 @@ void MainHandler::proc_segment_realloc(MsgContext& i)
             // TODO: this must be done better, the segment must be aware of its descriptors
             // or have better understanding how it works on QNX
             sd->update_descriptors();
+            i.proc().segment_changed(msg.m_sel);
         }
         reply.m_status = Qnx::QEOK;
         reply.m_sel = msg.m_sel;
@@ -626,6 +656,7 @@ void MainHandler::proc_segment_flags(MsgContext &i) {
     // other flags not handled yet
     sd->change_access(static_cast<Access>(msg.m_flags & Qnx::PMF_ACCESS_MASK));
     sd->update_descriptors();
+    i.proc().segment_changed(msg.m_sel);
     reply.m_flags = msg.m_flags;
     reply.m_sel = msg.m_flags;
     i.msg().write_type(0, &reply);
@@ -753,8 +784,10 @@ void MainHandler::proc_sigtab(MsgContext &i) {
     QnxMsg::proc::signal_request msg;
     i.msg().read_type(&msg);
 
-    auto sigtabv = proc->translate_segmented(FarPointer(i.ctx().reg_ds(), msg.m_offset), sizeof(Qnx::Sigtab));
+    auto sigtab = FarPointer(i.ctx().reg_ds(), msg.m_offset);
+    auto sigtabv = proc->translate_segmented(sigtab, sizeof(Qnx::Sigtab));
     proc->m_sigtab = static_cast<Qnx::Sigtab*>(sigtabv);
+    proc->m_sigtab_guest_pointer = sigtab;
     
     i.msg().write_status(Qnx::QEOK);
 }
@@ -838,6 +871,7 @@ void MainHandler::proc_osinfo(MsgContext &i) {
 void MainHandler::proc_fork(MsgContext &i) {
     QnxMsg::proc::loaded_reply reply;
     clear(&reply);
+    i.proc().result_cache().uncacheable("forks");
 
     pid_t r = fork();
     if (r < 0) {
@@ -846,6 +880,7 @@ void MainHandler::proc_fork(MsgContext &i) {
         if (r == 0) {
             // in child
             i.proc().update_pids_after_fork(getpid());
+            i.proc().m_time.start();
             reply.m_son_pid = 0;
         } else {
             // in parent
@@ -858,17 +893,96 @@ void MainHandler::proc_fork(MsgContext &i) {
     i.msg().write_type(0, &reply);
 }
 
+/*
+ * A parsed exec or spawn request, with the executable and arguments resolved for the host. The strings live on the
+ * scratch arena of the kernel call: with the exec in process, the process lives on and would otherwise allocate
+ * them from the heap on each exec.
+ */
+struct ExecRequest {
+    ExecRequest(ScratchArena& arena): buf(arena), argv(arena), envp(arena), final_argv(arena) {}
+
+    // owns the strings from the message
+    ScratchVector<char> buf;
+    ScratchVector<const char*> argv;
+    ScratchVector<const char*> envp;
+    uint8_t stdfds[10];
+
+    PathInfo mapped_exec;
+    // run final_exec as a host program, for exec=host prefixes and native tools
+    bool host = false;
+    const char *final_exec;
+    // owns the arguments of a native tool
+    std::vector<std::string> native_argv;
+    ScratchVector<const char*> final_argv;
+    // host directory to change to before exec, empty to keep the current one
+    std::string cwd;
+    // FD table for a new qine, see FdMap::export_table
+    UniqueFd fd_table;
+    std::string fd_table_env;
+};
+
+static void pass_fd_table(Process& proc, ExecRequest& req, const uint8_t *redirects, size_t redirect_count) {
+    if (req.host) {
+        return;
+    }
+    req.fd_table = proc.fds().export_table(redirects, redirect_count);
+    if (req.fd_table.valid()) {
+        req.fd_table_env = std_printf("%s=%d", FdMap::TABLE_ENV, req.fd_table.get());
+        req.envp.push_back(req.fd_table_env.c_str());
+    }
+}
+
+/* Can the request be executed by loading the image into this process (or a fork of it) */
+static bool exec_in_process_possible(Process& proc, const ExecRequest& req) {
+    return !req.host && !req.argv.empty() && proc.exec_in_process_possible(req.mapped_exec);
+}
+
+/*
+ * A fork copies the page tables of the whole process, its cost grows with the resident size (about 1.5 ms at
+ * 64 MB and 7 ms at 256 MB, against 0.1 ms when small). Starting a fresh qine costs a posix_spawn and the qine and
+ * Slib startup instead, independent of the size. Above this size, the spawned process is a fresh qine.
+ */
+static constexpr size_t SPAWN_FORK_MAX_RSS = 64 * 1024 * 1024;
+
+static bool fork_is_cheap() {
+    UniqueFile statm(fopen("/proc/self/statm", "re"));
+    unsigned long pages;
+    if (!statm || fscanf(statm.get(), "%*lu %lu", &pages) != 1) {
+        return true;
+    }
+    return pages * MemOps::PAGE_SIZE <= SPAWN_FORK_MAX_RSS;
+}
+
 void MainHandler::proc_spawn(MsgContext &i) {
     QnxMsg::proc::loaded_reply reply;
     clear(&reply);
+    i.proc().result_cache().uncacheable("spawns");
+
+    ExecRequest req(i.proc().scratch());
+    pid_t r;
+    if (!proc_exec_prepare(i, req)) {
+        r = -1;
+    } else if (exec_in_process_possible(i.proc(), req) && fork_is_cheap()) {
+        // the child runs the new image in a copy of this process
+        stat_spawn_fork.inc();
+        r = fork();
+        if (r == 0) {
+            if (proc_exec_common(i, req, true)) {
+                // the child continues in the new image, the reply is for the parent only
+                return;
+            }
+            perror("exec");
+            exit(255);
+        }
+    } else {
+        if (!req.host) {
+            stat_spawn_fresh.inc();
+        }
+        r = proc_spawn_host(i.proc(), req);
+    }
 
-    pid_t r = fork();
-    if (r < 0 ) {
+    if (r < 0) {
         reply.m_status = Emu::map_errno(errno);
-    } else if (r == 0) {
-        proc_exec_common(i);
-        perror("exec");
-        exit(255);
     } else {
         auto pid = i.proc().pids().alloc_child_pid(r);
         reply.m_son_pid = pid->qnx_pid();
@@ -881,20 +995,26 @@ void MainHandler::proc_exec(MsgContext &i) {
     QnxMsg::proc::loaded_reply reply;
     clear(&reply);
 
-    proc_exec_common(i);
+    i.proc().result_cache().uncacheable("execs");
+    ExecRequest req(i.proc().scratch());
+    if (proc_exec_prepare(i, req) && proc_exec_common(i, req, false)) {
+        // nowhere to reply, the old image is gone
+        return;
+    }
     reply.m_status = Emu::map_errno(errno);
     i.msg().write_type(0, &reply);
 }
 
-void MainHandler::proc_exec_common(MsgContext &i) {
+bool MainHandler::proc_exec_prepare(MsgContext &i, ExecRequest& req) {
     QnxMsg::proc::spawn msg;
     i.msg().read_type(&msg);
     MsgStreamReader r(&i.msg(), sizeof(QnxMsg::proc::spawn));
+    memcpy(req.stdfds, msg.m_stdfds, sizeof(req.stdfds));
 
     // copy the arguments from the spawn message into an owned buf and remember offsets into the buf
-    std::vector<char> buf;
-    std::vector<size_t > argvo;
-    std::vector<size_t > envo;
+    auto& buf = req.buf;
+    ScratchVector<size_t> argvo(i.proc().scratch());
+    ScratchVector<size_t> envo(i.proc().scratch());
 
     auto read_string = [&buf, &r]() {
         char c = r.get(); 
@@ -923,8 +1043,8 @@ void MainHandler::proc_exec_common(MsgContext &i) {
 
     // now that the buf is ready and will not be moved, convert offsets into pointers
 
-    std::vector<const char*> argvp;
-    std::vector<const char*> envp;
+    auto& argvp = req.argv;
+    auto& envp = req.envp;
     for (auto o: argvo) {
         argvp.push_back(&buf[o]);
     }
@@ -941,29 +1061,59 @@ void MainHandler::proc_exec_common(MsgContext &i) {
             exec_path++;
     }
 
-    auto mapped_exec = i.proc().path_mapper().map_path_to_host(exec_path);
-    const char* final_exec;
+    req.mapped_exec = i.proc().path_mapper().map_path_to_host(exec_path);
+    const auto& mapped_exec = req.mapped_exec;
 
-    // Theoretically, we should also check the interpreter, format etc. and report any problem
-    // before really exec'ing into qine. But this at least let's path work.
-    if (access(mapped_exec.host_path(), X_OK) < 0) {
-        return;
+    auto& final_argv = req.final_argv;
+    auto tool = i.proc().native_tools().find(mapped_exec.qnx_path());
+    if (tool) {
+        if (access(tool->m_host_path.c_str(), X_OK) < 0) {
+            return false;
+        }
+        req.host = true;
+        req.final_exec = tool->m_host_path.c_str();
+        req.native_argv = NativeTools::rewrite_args(*tool, argvp.size(), argvp.data(), i.proc().path_mapper());
+        for (const auto& a: req.native_argv) {
+            final_argv.push_back(a.c_str());
+        }
+        stat_native_tool.inc();
+        Log::if_enabled(Log::LOADER, [&](FILE *s) {
+            fprintf(s, "native tool: %s ->", mapped_exec.qnx_path());
+            for (const auto& a: req.native_argv) {
+                fprintf(s, " %s", a.c_str());
+            }
+            fprintf(s, "\n");
+        });
+    } else {
+        // Theoretically, we should also check the interpreter, format etc. and report any problem
+        // before really exec'ing into qine. But this at least let's path work.
+        auto& negative = i.proc().negative_cache();
+        if (negative.missing(mapped_exec.host_path())) {
+            errno = ENOENT;
+            return false;
+        }
+        if (faccessat(mapped_exec.host_dirfd(), mapped_exec.host_relpath(), X_OK, 0) < 0) {
+            if (errno == ENOENT) {
+                negative.add(mapped_exec.host_path());
+            }
+            return false;
+        }
+        if (mapped_exec.exec_type() == PathMapper::Exec::HOST) {
+            req.host = true;
+            req.final_exec = mapped_exec.host_path();
+            // just copy argv
+            final_argv = argvp;
+        }
     }
 
-    std::vector<const char*> final_argv;
-    if (mapped_exec.exec_type() == PathMapper::Exec::HOST) {
-        final_exec = mapped_exec.host_path();
-        // just copy argv
-        final_argv = argvp;
-
+    if (req.host) {
         // filter out __CWD and chdir there
         for (auto it = envp.begin(); it != envp.end(); ++it) {
             auto envvar = std::string_view(*it);
             auto cwd_prefix = std::string_view("__CWD=");
             if (starts_with(envvar, "__CWD=")) {
                 std::string cwd(envvar.substr(cwd_prefix.size()));
-                auto mapped = i.proc().path_mapper().map_path_to_host(cwd.c_str());
-                chdir(mapped.host_path());
+                req.cwd = i.proc().path_mapper().map_path_to_host(cwd.c_str()).host_path();
                 it = envp.erase(it);
                 if (it == envp.end())
                     break;
@@ -983,35 +1133,126 @@ void MainHandler::proc_exec_common(MsgContext &i) {
         }
 
         // call qine
-        final_exec = final_argv[0];
+        req.final_exec = final_argv[0];
     }
+    return true;
+}
 
-    envp.push_back(nullptr);
-    final_argv.push_back(nullptr);
+bool MainHandler::proc_exec_common(MsgContext &i, ExecRequest& req, bool forked) {
+    if (exec_in_process_possible(i.proc(), req)) {
+        // past this point the exec cannot fail back to the guest, so the FdMap is redirected as well
+        for (size_t fdi = 0; fdi < 10; fdi++) {
+            uint8_t fd = req.stdfds[fdi];
+            if (fd == 0xFF)
+                continue;
 
-    for (auto o: final_argv) {
-        // printf("Arg: %s\n", o);
-    }
-    for (auto o: envp) {
-         // printf("Env %s\n", o);
-    }
-    // printf("About to exec: %s\n", final_exec);
+            // ASSSUME: fd mapping is identical
+            if (fd != fdi)
+                i.proc().fds().redirect_for_exec(fd, fdi);
 
-    // redirect file descriptors
+            // disable cloexec
+            fcntl(fdi, F_SETFD, 0);
+        }
+        i.proc().exec_in_process(req.mapped_exec, req.argv, req.envp, i.ctx(), forked);
+        // the old image and the message in it are gone
+        i.m_consumed = true;
+        return true;
+    }
+
+    /*
+     * The execve may still fail, with the guest continuing. Only the host FDs are redirected, the new qine
+     * learns the rest from the FD table, and the previous host FDs are kept to restore them on failure.
+     */
+    i.proc().fds().materialize_for_exec(req.stdfds, sizeof(req.stdfds));
+    int saved_fds[10];
+    int saved_flags[10];
     for (size_t fdi = 0; fdi < 10; fdi++) {
-        uint8_t fd = msg.m_stdfds[fdi];
+        uint8_t fd = req.stdfds[fdi];
+        saved_fds[fdi] = -1;
+        saved_flags[fdi] = -1;
         if (fd == 0xFF)
             continue;
-        
-        // ASSSUME: fd mapping is identical
-        if (fd != fdi)
-            dup2(i.map_fd(fd), fdi);
 
-        // disable cloexec
+        saved_flags[fdi] = fcntl(fdi, F_GETFD);
+        if (fd != fdi) {
+            if (saved_flags[fdi] >= 0) {
+                // above the redirected range, so that the later redirections do not overwrite it
+                saved_fds[fdi] = fcntl(fdi, F_DUPFD_CLOEXEC, 10);
+            }
+            dup2(fd, fdi);
+        }
         fcntl(fdi, F_SETFD, 0);
     }
 
-    execve(final_exec, const_cast<char**>(final_argv.data()), const_cast<char**>(envp.data()));
+    UniqueFd saved_cwd;
+    if (!req.cwd.empty()) {
+        saved_cwd = UniqueFd(open(".", O_PATH | O_DIRECTORY | O_CLOEXEC));
+        chdir(req.cwd.c_str());
+    }
+    pass_fd_table(i.proc(), req, req.stdfds, sizeof(req.stdfds));
+    req.envp.push_back(nullptr);
+    req.final_argv.push_back(nullptr);
+    {
+        FdMap::ChildFdLimit limit;
+        execve(req.final_exec, const_cast<char**>(req.final_argv.data()), const_cast<char**>(req.envp.data()));
+    }
+
+    int err = errno;
+    for (size_t fdi = 10; fdi-- > 0; ) {
+        if (saved_fds[fdi] >= 0) {
+            dup2(saved_fds[fdi], fdi);
+            close(saved_fds[fdi]);
+        } else if (saved_flags[fdi] < 0 && req.stdfds[fdi] != 0xFF) {
+            close(fdi);
+        }
+        if (saved_flags[fdi] >= 0) {
+            fcntl(fdi, F_SETFD, saved_flags[fdi]);
+        }
+    }
+    if (saved_cwd.valid()) {
+        fchdir(saved_cwd.get());
+    }
+    errno = err;
+    return false;
+}
+
+pid_t MainHandler::proc_spawn_host(Process& proc, ExecRequest& req) {
+    /*
+     * posix_spawn uses a vfork-style clone, so the cost does not grow with the size of the guest. The fd
+     * redirections and the chdir are done by the child and do not touch our FdMap.
+     */
+    // the child only gets host FDs, also when it is a host program without the FD table
+    proc.fds().materialize_for_exec(req.stdfds, sizeof(req.stdfds));
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int fdi = 0; fdi < 10; fdi++) {
+        uint8_t fd = req.stdfds[fdi];
+        if (fd == 0xFF)
+            continue;
+        // dup2 onto itself just clears the close-on-exec flag
+        posix_spawn_file_actions_adddup2(&actions, fd, fdi);
+    }
+    if (!req.cwd.empty()) {
+        posix_spawn_file_actions_addchdir_np(&actions, req.cwd.c_str());
+    }
+
+    pass_fd_table(proc, req, req.stdfds, sizeof(req.stdfds));
+    req.envp.push_back(nullptr);
+    req.final_argv.push_back(nullptr);
+    pid_t pid;
+    int r;
+    {
+        FdMap::ChildFdLimit limit;
+        r = posix_spawn(&pid, req.final_exec, &actions, nullptr,
+            const_cast<char**>(req.final_argv.data()), const_cast<char**>(req.envp.data()));
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (r != 0) {
+        errno = r;
+        return -1;
+    }
+    return pid;
 }
 
 void MainHandler::proc_timer_create(MsgContext &i) {
@@ -1250,6 +1491,8 @@ void MainHandler::io_open(MsgContext& i) {
     int mapped_oflags = O_RDONLY;
     int oflag = msg.m_open.m_oflag;
     int eflags = msg.m_open.m_eflag;
+    // the handles except for readdir are opened only when needed, see QnxFd::m_path_only
+    bool path_only = false;
     if (msg.m_type == QnxMsg::io::msg_io_open::TYPE) {
         mapped_oflags = map_file_flags_to_host(oflag);
     } else if (msg.m_type == QnxMsg::io::msg_handle::TYPE) {
@@ -1258,26 +1501,58 @@ void MainHandler::io_open(MsgContext& i) {
         } else if (msg.m_open.m_oflag == Qnx::IO_HNDL_CHANGE || msg.m_open.m_oflag == Qnx::IO_HNDL_UTIME) {
             // chown etc.
             mapped_oflags |= O_RDONLY;
+            path_only = true;
         } else {
             mapped_oflags |= O_PATH;
             if (msg.m_open.m_mode & Qnx::QS_IFLNK) 
                 mapped_oflags |= O_NOFOLLOW;
+            path_only = true;
         }
     }
 
     fd->m_path = PathInfo::mk_qnx_path(msg.m_file, true);
     i.proc().path_mapper().map_path_to_host(fd->m_path);
     
-    UniqueFd tmp_fd(::open(fd->m_path.host_path(), mapped_oflags, msg.m_open.m_mode));
-    if (!tmp_fd.valid()) {
+    auto& negative = i.proc().negative_cache();
+    UniqueFd tmp_fd;
+    bool found = false;
+    if (!(mapped_oflags & O_CREAT) && negative.missing(fd->m_path.host_path())) {
+        errno = ENOENT;
+    } else if (path_only) {
+        // the open would fail if the file is not there
+        struct stat sb;
+        found = fstatat(fd->m_path.host_dirfd(), fd->m_path.host_relpath(), &sb,
+            (mapped_oflags & O_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0) == 0;
+    } else {
+        tmp_fd = UniqueFd(::openat(fd->m_path.host_dirfd(), fd->m_path.host_relpath(), mapped_oflags, msg.m_open.m_mode));
+        found = tmp_fd.valid();
+    }
+    if (!found && errno == ENOENT && !(mapped_oflags & O_CREAT)) {
+        negative.add(fd->m_path.host_path());
+    }
+    if (!found) {
+        int saved_errno = errno;
+        i.proc().result_cache().record_open(fd->m_path.host_path(), mapped_oflags, -1);
+        errno = saved_errno;
         i.msg().write_status(Emu::map_errno(errno));
         return;
     }
 
+    if (path_only) {
+        fd->assign_path(mapped_oflags);
+        // the result cache only needs to know that the file exists
+        i.proc().result_cache().record_open(fd->m_path.host_path(), O_PATH, msg.m_open.m_fd);
+        i.msg().write_status(Qnx::QEOK);
+        return;
+    }
     if (!fd->assign_fd(std::move(tmp_fd))) {
         i.msg().write_status(Emu::map_errno(errno));
         return;
     }
+    if (mapped_oflags & O_CREAT) {
+        negative.created(fd->m_path.host_path());
+    }
+    i.proc().result_cache().record_open(fd->m_path.host_path(), mapped_oflags, msg.m_open.m_fd);
     i.msg().write_status(Qnx::QEOK);
 }
 
@@ -1288,7 +1563,7 @@ void MainHandler::io_chdir(MsgContext& i) {
     auto p = i.proc().path_mapper().map_path_to_host(msg.m_file, true);
 
     // TODO: this is not the right check, it allows us to chdir into executables
-    int r = access(p.host_path(), X_OK);
+    int r = faccessat(p.host_dirfd(), p.host_relpath(), X_OK, 0);
     if (r == 0) {
         i.msg().write_status(Qnx::QEOK);
     } else {
@@ -1355,12 +1630,15 @@ void MainHandler::proc_sid_set (MsgContext &i) {
 void MainHandler::io_rename(MsgContext& i) {
     QnxMsg::io::rename_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().uncacheable("renames a file");
 
     auto from_path = i.proc().path_mapper().map_path_to_host(msg.m_from);
     auto to_path = i.proc().path_mapper().map_path_to_host(msg.m_to);
 
-    int r = rename(from_path.host_path(), to_path.host_path());
+    int r = renameat(from_path.host_dirfd(), from_path.host_relpath(), to_path.host_dirfd(), to_path.host_relpath());
     if (r == 0) {
+        // a renamed directory changes what is below it
+        i.proc().negative_cache().clear();
         i.msg().write_status(Qnx::QEOK);
     } else {
         i.msg().write_status(Emu::map_errno(errno));
@@ -1380,10 +1658,16 @@ void MainHandler::io_stat(MsgContext& i) {
     clear(&reply);
     int r;
     
-    if (msg.m_args.m_mode & Qnx::QS_IFLNK) {
-        r = lstat(p.host_path(), &sb);
+    i.proc().result_cache().record_stat(p.host_path());
+    auto& negative = i.proc().negative_cache();
+    if (negative.missing(p.host_path())) {
+        r = -1;
+        errno = ENOENT;
     } else {
-        r = stat(p.host_path(), &sb);
+        r = fstatat(p.host_dirfd(), p.host_relpath(), &sb, (msg.m_args.m_mode & Qnx::QS_IFLNK) ? AT_SYMLINK_NOFOLLOW : 0);
+        if (r < 0 && errno == ENOENT) {
+            negative.add(p.host_path());
+        }
     }
     
     if (r < 0) {
@@ -1396,7 +1680,7 @@ void MainHandler::io_stat(MsgContext& i) {
     if (S_ISLNK(sb.st_mode)) {
         std::string path;
         // return the length of the mapped path, so that readlink and stat are consistent with each other
-        if (Fsutil::readlink(p.host_path(), path)) {
+        if (Fsutil::readlinkat(p.host_dirfd(), p.host_relpath(), path)) {
             if (path.empty() || path[0] == '/') {
                 auto qnx_path = i.proc().path_mapper().map_path_to_qnx(path.c_str());
                 reply.m_stat.m_size = strlen(qnx_path.qnx_path());
@@ -1420,7 +1704,13 @@ void MainHandler::io_fstat(MsgContext& i) {
 
     QnxMsg::io::fstat_reply reply;
     memset(&reply, 0, sizeof(reply));
-    int r = fstat(i.map_fd(msg.m_fd), &sb);
+    auto fd = i.proc().fds().get_open_fd_lazy(msg.m_fd);
+    int r;
+    if (fd->m_path_only) {
+        r = fstatat(fd->m_path.host_dirfd(), fd->m_path.host_relpath(), &sb, fd->path_at_flags());
+    } else {
+        r = fstat(fd->m_host_fd, &sb);
+    }
     if (r < 0) {
         reply.m_status = Emu::map_errno(errno);
         i.msg().write_type(0, &reply);
@@ -1435,6 +1725,7 @@ void MainHandler::io_readdir(MsgContext &i)
 {
     QnxMsg::io::readdir_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().uncacheable("lists a directory");
 
     auto fd = i.proc().fds().get_open_fd(msg.m_fd);
     if (!fd->prepare_dir()) {
@@ -1444,30 +1735,52 @@ void MainHandler::io_readdir(MsgContext &i)
 
     constexpr size_t dirent_size = sizeof(QnxMsg::io::stat) + Qnx::QNAME_MAX_T;
 
-    // for each dirent, empty stat with (st_status & _FILE_USED) == 0
     QnxMsg::io::stat stat;
-    memset(&stat, 0, sizeof(stat));
-
+    struct stat sb;
     char path_buf[Qnx::QNAME_MAX_T];
 
     QnxMsg::io::readdir_reply reply;
     memset(&reply, 0x00, sizeof(reply));
 
+    // the QNX path of the entries, to find the prefix mount points
+    const auto& mapper = i.proc().path_mapper();
+    std::string entry_path;
+    if (fd->m_path.qnx_valid()) {
+        entry_path = fd->m_path.qnx_path();
+        entry_path += '/';
+    }
+    size_t entry_dir_len = entry_path.size();
+
     //i.msg().dump_structure(stdout);
-    errno = 0;
     size_t dst_off = sizeof(reply);
     for (int di = 0; di < msg.m_ndirs; di++) {
-        struct dirent *d = readdir(fd->m_host_dir);
+        auto d = fd->m_dir_reader->next(fd->m_host_fd);
         if (!d) {
-            if (errno == 0) {
-                
+            if (errno == 0 || reply.m_ndirs) {
+                // report the error with the next call
                 break;
             } else {
-                reply.m_status = Emu::map_errno(errno);
+                i.msg().write_status(Emu::map_errno(errno));
                 return;
             }
         }
 
+        /*
+         * Fill in the stat and mark it valid with FILE_USED, so that ls -l or find do not need to stat each
+         * entry. Symlinks are left to a real stat, which reports the length of the mapped target, and so are
+         * the mount points of prefixes, which are not the entry of the host directory. Without the QNX path
+         * of the directory, the mount points are not known.
+         */
+        entry_path.resize(entry_dir_len);
+        entry_path += d->d_name;
+        bool mount_point = entry_dir_len == 0 || mapper.is_qnx_prefix(entry_path.c_str());
+        memset(&stat, 0, sizeof(stat));
+        if (d->d_type != DT_LNK && !mount_point
+            && fstatat(fd->m_host_fd, d->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISLNK(sb.st_mode)) {
+            transfer_stat(stat, sb);
+            stat.m_status = Qnx::FILE_USED;
+        }
+
         // write the dirent (stat + path)
         qine_strlcpy(path_buf, d->d_name, sizeof(path_buf));
         i.msg().write_type(dst_off, &stat);
@@ -1487,7 +1800,10 @@ void MainHandler::io_rewinddir(MsgContext &i) {
         i.msg().write_status(Emu::map_errno(errno));
         return;
     }
-    rewinddir(fd->m_host_dir);
+    if (!fd->m_dir_reader->rewind(fd->m_host_fd)) {
+        i.msg().write_status(Emu::map_errno(errno));
+        return;
+    }
     i.msg().write_status(Qnx::QEOK);
 }
 
@@ -1650,6 +1966,7 @@ void MainHandler::io_close(MsgContext& i) {
     i.msg().read_type(&msg);
 
     auto fd = i.proc().fds().get_open_fd(msg.m_fd);
+    i.proc().result_cache().record_close(msg.m_fd);
     if (!fd->close()) {
         i.msg().write_status(Emu::map_errno(errno));
         return;
@@ -1684,11 +2001,12 @@ void MainHandler::io_read(MsgContext &i) {
     i.msg().read_type(&msg);
 
     auto fd = i.proc().fds().get_open_fd(msg.m_fd);
+    i.proc().result_cache().record_read(msg.m_fd);
     if (fd->m_filter) {
         fd->m_filter->read(i, *fd, msg);
     } else {
         // Log::dbg("Reading from %lx\n", lseek(fd->m_host_fd, 0, SEEK_CUR));
-        std::vector<struct iovec> iov;
+        ScratchVector<struct iovec> iov(i.proc().scratch());
         i.msg().write_iovec(sizeof(msg), msg.m_nbytes, iov);
 
         QnxMsg::io::read_reply reply;
@@ -1709,7 +2027,7 @@ void MainHandler::io_write(MsgContext &i) {
     QnxMsg::io::write_request msg;
     i.msg().read_type(&msg);
 
-    std::vector<struct iovec> iov;
+    ScratchVector<struct iovec> iov(i.proc().scratch());
     i.msg().read_iovec(sizeof(msg), msg.m_nbytes, iov);
 
     QnxMsg::io::write_reply reply;
@@ -1719,12 +2037,115 @@ void MainHandler::io_write(MsgContext &i) {
         reply.m_status = errno;
         reply.m_nbytes = 0;
     } else {
+        i.proc().result_cache().record_write(msg.m_fd, iov.data(), iov.size(), r);
         reply.m_status = Qnx::QEOK;
         reply.m_nbytes = r;
     }
     i.msg().write_type(0, &reply);
 }
 
+/* The fast_io_* variants must behave the same as the io_* handlers */
+
+bool MainHandler::fast_io_read(Process& proc, FlatMsg& m) {
+    QnxMsg::io::read_request msg;
+    QnxMsg::io::read_reply reply;
+    if (!m.read_request(&msg) || !m.reply_fits(sizeof(reply))) {
+        return false;
+    }
+
+    auto fd = proc.fds().get_open_fd(msg.m_fd);
+    if (fd->m_filter) {
+        return false;
+    }
+    iovec iov[FlatMsg::MAX_PARTS];
+    size_t iov_count = m.rcv_iovec(sizeof(msg), msg.m_nbytes, iov);
+    if (!iov_count) {
+        return false;
+    }
+
+    int r = readv(proc.fds().get_host_fd(msg.m_fd), iov, iov_count);
+    reply.m_zero = 0;
+    if (r < 0) {
+        reply.m_status = errno;
+        reply.m_nbytes = 0;
+    } else {
+        reply.m_status = Qnx::QEOK;
+        reply.m_nbytes = r;
+    }
+    m.write_reply(&reply);
+    return true;
+}
+
+bool MainHandler::fast_io_write(Process& proc, FlatMsg& m) {
+    QnxMsg::io::write_request msg;
+    QnxMsg::io::write_reply reply;
+    if (!m.read_request(&msg) || !m.reply_fits(sizeof(reply))) {
+        return false;
+    }
+
+    iovec iov[FlatMsg::MAX_PARTS];
+    size_t iov_count = m.send_iovec(sizeof(msg), msg.m_nbytes, iov);
+    if (!iov_count) {
+        return false;
+    }
+
+    int r = writev(proc.fds().get_host_fd(msg.m_fd), iov, iov_count);
+    reply.m_zero = 0;
+    if (r < 0) {
+        reply.m_status = errno;
+        reply.m_nbytes = 0;
+    } else {
+        reply.m_status = Qnx::QEOK;
+        reply.m_nbytes = r;
+    }
+    m.write_reply(&reply);
+    return true;
+}
+
+bool MainHandler::fast_io_lseek(Process& proc, FlatMsg& m) {
+    QnxMsg::io::lseek_request msg;
+    QnxMsg::io::lseek_reply reply;
+    if (!m.read_request(&msg) || !m.reply_fits(sizeof(reply))) {
+        return false;
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    off_t off = lseek(proc.fds().get_host_fd(msg.m_fd), msg.m_offset, msg.m_whence);
+    if (off == -1) {
+        reply.m_status = Emu::map_errno(errno);
+        reply.m_offset = -1;
+    } else {
+        reply.m_status = Qnx::QEOK;
+        reply.m_offset = off;
+    }
+    m.write_reply(&reply);
+    return true;
+}
+
+bool MainHandler::fast_io_fstat(Process& proc, FlatMsg& m) {
+    QnxMsg::io::fstat_request msg;
+    QnxMsg::io::fstat_reply reply;
+    if (!m.read_request(&msg) || !m.reply_fits(sizeof(reply))) {
+        return false;
+    }
+
+    // stat by handle goes through the full path
+    if (proc.fds().get_open_fd_lazy(msg.m_fd)->m_path_only) {
+        return false;
+    }
+
+    struct stat sb;
+    memset(&reply, 0, sizeof(reply));
+    int r = fstat(proc.fds().get_host_fd(msg.m_fd), &sb);
+    if (r < 0) {
+        reply.m_status = Emu::map_errno(errno);
+    } else {
+        transfer_stat(reply.m_stat, sb);
+    }
+    m.write_reply(&reply);
+    return true;
+}
+
 void MainHandler::io_fcntl_flags(MsgContext &i) {
     QnxMsg::io::fcntl_flags_request msg;
     i.msg().read_type(&msg);
@@ -1796,6 +2217,7 @@ void MainHandler::io_fcntl_flags(MsgContext &i) {
 void MainHandler::io_dup(MsgContext &i) {
     QnxMsg::io::dup_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().uncacheable("duplicates a file descriptor");
 
     auto src_fd = i.proc().fds().get_open_fd(msg.m_src_fd);
     auto dst_fd = i.proc().fds().get_attached_fd(msg.m_dst_fd);
@@ -1882,33 +2304,51 @@ void MainHandler::io_fpathconf(MsgContext &i) {
 void MainHandler::io_chmod(MsgContext &i) {
     QnxMsg::io::chmod_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().record_modify(msg.m_fd, "changes the mode of a file");
 
-    int r = fchmod(i.map_fd(msg.m_fd), msg.m_mode);
+    auto fd = i.proc().fds().get_open_fd_lazy(msg.m_fd);
+    int r;
+    if (fd->m_path_only) {
+        r = fchmodat(fd->m_path.host_dirfd(), fd->m_path.host_relpath(), msg.m_mode, 0);
+    } else {
+        r = fchmod(fd->m_host_fd, msg.m_mode);
+    }
     i.msg().write_status((r == 0) ? Qnx::QEOK : Emu::map_errno(errno));
 }
 
 void MainHandler::io_chown(MsgContext &i) {
     QnxMsg::io::chown_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().uncacheable("changes an owner");
 
-    int r = fchown(i.map_fd(msg.m_fd), msg.m_uid, msg.m_gid);
+    auto fd = i.proc().fds().get_open_fd_lazy(msg.m_fd);
+    int r;
+    if (fd->m_path_only) {
+        r = fchownat(fd->m_path.host_dirfd(), fd->m_path.host_relpath(), msg.m_uid, msg.m_gid, fd->path_at_flags());
+    } else {
+        r = fchown(fd->m_host_fd, msg.m_uid, msg.m_gid);
+    }
     i.msg().write_status((r == 0) ? Qnx::QEOK : Emu::map_errno(errno));
 }
 
 void MainHandler::io_utime(MsgContext &i) {
     QnxMsg::io::utime_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().record_modify(msg.m_fd, "changes the times of a file");
     int r;
 
-    if (msg.m_cur_flag) {
-        r = futimens(i.map_fd(msg.m_fd), NULL);
+    struct timespec ts[2];
+    ts[0].tv_nsec = 0;
+    ts[0].tv_sec = msg.m_actime;
+    ts[1].tv_nsec = 0;
+    ts[1].tv_sec = msg.m_mod;
+    auto times = msg.m_cur_flag ? NULL : ts;
+
+    auto fd = i.proc().fds().get_open_fd_lazy(msg.m_fd);
+    if (fd->m_path_only) {
+        r = utimensat(fd->m_path.host_dirfd(), fd->m_path.host_relpath(), times, fd->path_at_flags());
     } else {
-        struct timespec ts[2];
-        ts[0].tv_nsec = 0;
-        ts[0].tv_sec = msg.m_actime;
-        ts[1].tv_nsec = 0;
-        ts[1].tv_sec = msg.m_mod;
-        r = futimens(msg.m_fd, ts);
+        r = futimens(fd->m_host_fd, times);
     }
 
     i.msg().write_status((r == 0) ? Qnx::QEOK : Emu::map_errno(errno));
@@ -1917,15 +2357,12 @@ void MainHandler::io_utime(MsgContext &i) {
 void MainHandler::fsys_unlink(MsgContext &i) {
     QnxMsg::fsys::unlink_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().uncacheable("removes a file");
 
     auto p = i.proc().path_mapper().map_path_to_host(msg.m_path, true);
 
     int r;
-    if (msg.m_args.m_mode == Qnx::QS_QNX_SPECIAL) {
-        r = rmdir(p.host_path());
-    } else {
-        r = unlink(p.host_path());
-    }
+    r = unlinkat(p.host_dirfd(), p.host_relpath(), msg.m_args.m_mode == Qnx::QS_QNX_SPECIAL ? AT_REMOVEDIR : 0);
 
     if (r == 0) {
         i.msg().write_status(Qnx::QEOK);
@@ -1937,6 +2374,7 @@ void MainHandler::fsys_unlink(MsgContext &i) {
 void MainHandler::fsys_mkspecial(MsgContext &i) {
     QnxMsg::fsys::mkspecial_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().uncacheable("creates a directory or a special file");
     uint16_t mode = msg.m_open.m_mode;
     int r;
 
@@ -1944,7 +2382,8 @@ void MainHandler::fsys_mkspecial(MsgContext &i) {
 
 
     if (S_ISDIR(mode)) {
-        r = mkdir(p.host_path(), mode & ALLPERMS);
+        r = mkdirat(p.host_dirfd(), p.host_relpath(), mode & ALLPERMS);
+        i.proc().negative_cache().created(p.host_path());
         if (r == 0) {
             i.msg().write_status(Qnx::QEOK);
         } else {
@@ -1953,10 +2392,11 @@ void MainHandler::fsys_mkspecial(MsgContext &i) {
     } else if (mode & S_IFLNK) {
         if (Fsutil::is_abs(msg.m_target)) {
             auto tp = i.proc().path_mapper().map_path_to_host(msg.m_target);
-            r = symlink(tp.host_path(), p.host_path());
+            r = symlinkat(tp.host_path(), p.host_dirfd(), p.host_relpath());
         } else {
-            r = symlink(msg.m_target, p.host_path());
+            r = symlinkat(msg.m_target, p.host_dirfd(), p.host_relpath());
         }
+        i.proc().negative_cache().created(p.host_path());
         if (r == 0) {
             i.msg().write_status(Qnx::QEOK);
         } else {
@@ -1970,12 +2410,13 @@ void MainHandler::fsys_mkspecial(MsgContext &i) {
 void MainHandler::fsys_readlink(MsgContext &i) {
     QnxMsg::fsys::readlink_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().uncacheable("reads a symlink");
     QnxMsg::fsys::readlink_reply reply;
     clear(&reply);
 
     auto link_path = i.proc().path_mapper().map_path_to_host(msg.m_path, true);
     std::string target_path_raw;
-    if (!Fsutil::readlink(link_path.host_path(), target_path_raw)) {
+    if (!Fsutil::readlinkat(link_path.host_dirfd(), link_path.host_relpath(), target_path_raw)) {
         i.msg().write_status(Emu::map_errno(errno));
     } else {
         if (!target_path_raw.empty() && target_path_raw[0] == '/') {
@@ -1990,17 +2431,19 @@ void MainHandler::fsys_readlink(MsgContext &i) {
 }
 
 void MainHandler::fsys_link(MsgContext &i) {
-    /* Note: we cannot use linkat without CAP_DAC_READ_SEARCH, which would be ideal*/
+    /* Note: we cannot use linkat with AT_EMPTY_PATH without CAP_DAC_READ_SEARCH, which would be ideal*/
     QnxMsg::fsys::link_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().uncacheable("creates a link");
 
-    auto fd = i.proc().fds().get_open_fd(msg.m_arg.m_fd);
+    auto fd = i.proc().fds().get_open_fd_lazy(msg.m_arg.m_fd);
     i.proc().path_mapper().map_path_to_host(fd->m_path);
 
     auto dst_path = PathInfo::mk_qnx_path(msg.m_new_path);
     i.proc().path_mapper().map_path_to_host(dst_path);
 
-    int r = link(fd->m_path.host_path(), dst_path.host_path());
+    int r = linkat(fd->m_path.host_dirfd(), fd->m_path.host_relpath(), dst_path.host_dirfd(), dst_path.host_relpath(), 0);
+    i.proc().negative_cache().created(dst_path.host_path());
     if (r == 0) {
         i.msg().write_status(Qnx::QEOK);
     } else {
@@ -2016,6 +2459,7 @@ void MainHandler::fsys_sync(MsgContext &i) {
 void MainHandler::fsys_trunc(MsgContext &i) {
     QnxMsg::fsys::trunc_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().record_modify(msg.m_fd, "truncates a file");
     int host_fd = i.map_fd(msg.m_fd);
     // we need to get the truncate offset, so save current pos, seek to destination, and seek back
     // how to do that atomically, I do not know
@@ -2064,6 +2508,7 @@ void MainHandler::fsys_fsync(MsgContext &i) {
 void MainHandler::fsys_pipe(MsgContext &i) {
     QnxMsg::fsys::pipe_request msg;
     i.msg().read_type(&msg);
+    i.proc().result_cache().uncacheable("creates a pipe");
     auto fds = &i.proc().fds();
     QnxFd* qnx_fds[2] = {
         fds->get_attached_fd(msg.m_fd_in),
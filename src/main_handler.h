@@ -18,11 +18,15 @@ namespace QnxMsg::dev {
 
 
 class QnxFd;
+class Process;
+struct ExecRequest;
 
 /* Handles proc messages and passtrough FD messages */
 class MainHandler: public MsgHandler {
 public:
     void receive(MsgContext& msg);
+    /* Handle a hot I/O message without the generic machinery, returns false if receive() must handle it */
+    bool receive_fast(Process& proc, FlatMsg& msg);
 private:
     std::string get_fd_path(int fd);
     uint32_t map_file_flags_to_host(uint32_t flags);
@@ -62,7 +66,12 @@ private:
     void proc_fork(MsgContext &i);
     void proc_spawn(MsgContext &i);
     void proc_exec(MsgContext &i);
-    void proc_exec_common(MsgContext &i);
+    /* Parse the spawn message and resolve the executable. Returns false with errno set if it cannot be run. */
+    bool proc_exec_prepare(MsgContext &i, ExecRequest& req);
+    /* Returns true if the exec happened within this process and i.ctx() now runs the new image */
+    bool proc_exec_common(MsgContext &i, ExecRequest& req, bool forked);
+    /* Start the request in a new host process without copying this one, returns the host pid or -1 */
+    pid_t proc_spawn_host(Process& proc, ExecRequest& req);
     void proc_timer_create(MsgContext &i);
     void proc_timer_settime(MsgContext &i);
     void proc_timer_alarm(MsgContext &i);
@@ -106,6 +115,11 @@ private:
 
     void transfer_stat(QnxMsg::io::stat& dst, struct stat& src);
 
+    bool fast_io_read(Process& proc, FlatMsg& m);
+    bool fast_io_write(Process& proc, FlatMsg& m);
+    bool fast_io_lseek(Process& proc, FlatMsg& m);
+    bool fast_io_fstat(Process& proc, FlatMsg& m);
+
     void dev_fdinfo(MsgContext &i);
     void dev_info(MsgContext &i);
     // errno if false
@@ -12,203 +12,177 @@
 #include "types.h"
 
 Msg::Msg(Process* proc, size_t send_parts, FarPointer send, size_t rcv_parts, FarPointer rcv, Bitness bits):
-    m_proc(proc), 
-    m_rcv_parts(rcv_parts),
-    m_send_parts(send_parts)
+    m_proc(proc)
 {
     if (bits == B32) {
-        m_send = reinterpret_cast<Qnx::mxfer_entry*>(
+        resolve_chunks(send_parts, reinterpret_cast<Qnx::mxfer_entry*>(
             proc->translate_segmented(send, sizeof(Qnx::mxfer_entry) * send_parts, RwOp::READ)
-        );
+        ), RwOp::READ, m_send);
 
-        m_rcv = reinterpret_cast<Qnx::mxfer_entry*>(
-            proc->translate_segmented(rcv, sizeof(Qnx::mxfer_entry) * rcv_parts, RwOp::WRITE)
-        );
+        resolve_chunks(rcv_parts, reinterpret_cast<Qnx::mxfer_entry*>(
+            proc->translate_segmented(rcv, sizeof(Qnx::mxfer_entry) * rcv_parts, RwOp::READ)
+        ), RwOp::WRITE, m_rcv);
     } else {
-        translate_mxfer_entries(send_parts, 
-            reinterpret_cast<Qnx::mxfer_entry16*>(
-                proc->translate_segmented(send, sizeof(Qnx::mxfer_entry16) * send_parts, RwOp::READ)
-            ),
-            m_send_translated_entries
-        );
-        m_send = m_send_translated_entries.data();
-
-        translate_mxfer_entries(rcv_parts, 
-            reinterpret_cast<Qnx::mxfer_entry16*>(
-                proc->translate_segmented(rcv, sizeof(Qnx::mxfer_entry16) * rcv_parts, RwOp::READ)
-            ),
-            m_rcv_translated_entries
-        );
-        m_rcv = m_rcv_translated_entries.data();
+        resolve_chunks16(send_parts, reinterpret_cast<Qnx::mxfer_entry16*>(
+            proc->translate_segmented(send, sizeof(Qnx::mxfer_entry16) * send_parts, RwOp::READ)
+        ), RwOp::READ, m_send);
+
+        resolve_chunks16(rcv_parts, reinterpret_cast<Qnx::mxfer_entry16*>(
+            proc->translate_segmented(rcv, sizeof(Qnx::mxfer_entry16) * rcv_parts, RwOp::READ)
+        ), RwOp::WRITE, m_rcv);
         //dump_structure(stderr);
     }
 }
 
-void Msg::translate_mxfer_entries(size_t n, const Qnx::mxfer_entry16 src[], std::vector<Qnx::mxfer_entry>& dst) {
-    for (size_t i = 0; i < n; i++) {
-        const auto& src_entry = src[i];
-        Qnx::mxfer_entry dst_entry = {
-            .mxfer_off = src_entry.mxfer_off,
-            .mxfer_seg = src_entry.mxfer_seg,
-            .mxfer_zero = 0,
-            .mxfer_len = src_entry.mxfer_len,
-        };
-        dst.push_back(dst_entry);
+void Msg::resolve_chunks(size_t parts, const Qnx::mxfer_entry src[], RwOp op, Chunks& dst) {
+    for (size_t i = 0; i < parts; i++) {
+        add_chunk(src[i].mxfer_seg, src[i].mxfer_off, src[i].mxfer_len, op, dst);
     }
 }
 
-Msg::~Msg() {
-
+void Msg::resolve_chunks16(size_t parts, const Qnx::mxfer_entry16 src[], RwOp op, Chunks& dst) {
+    for (size_t i = 0; i < parts; i++) {
+        add_chunk(src[i].mxfer_seg, src[i].mxfer_off, src[i].mxfer_len, op, dst);
+    }
 }
 
-void Msg::dump_send(FILE *f) {
-    auto i = iterate_send();
-
-    for (;;) {
-        auto s = i.next(1);
-        if (s.is_empty())
-            break;
-        fprintf(f, "%02X ", *static_cast<uint8_t*>(m_proc->translate_segmented(s.m_ptr)));
+void Msg::add_chunk(uint16_t seg, uint32_t off, uint32_t len, RwOp op, Chunks& dst) {
+    if (len == 0) {
+        return;
     }
 
-    int rs = 0;
-    for (size_t i = 0; i < m_rcv_parts; i++)
-        rs += m_rcv[i].mxfer_len;
-    fprintf(f, ", reply size %d\n", rs);
+    Chunk c;
+    c.offset = dst.empty() ? 0 : dst.back().offset + dst.back().len;
+    c.len = len;
+    c.ptr = FarPointer(seg, off);
+    try {
+        c.host = static_cast<uint8_t*>(m_proc->translate_segmented(c.ptr, len, op));
+    } catch (const SegmentationFault&) {
+        c.host = nullptr;
+    }
+    dst.push_back(c);
 }
 
-void Msg::dump_structure(FILE *f) {
-    size_t start;
+void Msg::Chunks::push_back(const Chunk& c) {
+    if (m_size < INLINE && m_heap.empty()) {
+        m_inline[m_size++] = c;
+        return;
+    }
+    if (m_heap.empty()) {
+        m_heap.assign(m_inline, m_inline + m_size);
+    }
+    m_heap.push_back(c);
+    m_size++;
+}
 
-    start  = 0;
-    for (size_t i = 0; i < m_send_parts; i++) {
-        auto r = &m_send[i];
-        printf("snd: %04zx - %04zx -> %04x:%08x\n", start, start + r->mxfer_len, r->mxfer_seg, r->mxfer_off);
-        start += r->mxfer_len;
+auto Msg::find_chunk(const Chunks& chunks, size_t offset) -> const Chunk* {
+    // the chunks are sorted and non-empty, most messages have just a few of them
+    const Chunk *it;
+    if (chunks.size() <= LINEAR_SEARCH) {
+        it = chunks.begin();
+        while (it != chunks.end() && offset >= it->offset + it->len) {
+            ++it;
+        }
+        return it;
     }
 
-    start = 0;
-    for (size_t i = 0; i < m_rcv_parts; i++) {
-        auto r = &m_rcv[i];
-        printf("rcv: %04zx - %04zx -> %04x:%08x\n", start, start + r->mxfer_len, r->mxfer_seg, r->mxfer_off);
-        start += r->mxfer_len;
+    it = std::upper_bound(chunks.begin(), chunks.end(), offset, [](size_t o, const Chunk& c) {
+        return o < c.offset;
+    });
+    if (it == chunks.begin()) {
+        return chunks.end();
     }
+    --it;
+    return offset < it->offset + it->len ? it : chunks.end();
 }
 
-auto Msg::iterate_send() -> Iterator{
-    return Iterator(m_send, m_send_parts);
-}
-auto Msg::iterate_receive() -> Iterator {
-    return Iterator(m_rcv, m_rcv_parts);
+uint8_t* Msg::span(const Chunks& chunks, RwOp op, size_t offset, size_t *len) {
+    auto it = find_chunk(chunks, offset);
+    if (it == chunks.end()) {
+        *len = 0;
+        return nullptr;
+    }
+    return chunk_host(*it, op, offset - it->offset, it->len - (offset - it->offset), len);
 }
 
-Msg::Iterator::Iterator(Qnx::mxfer_entry *chunks, size_t chunk_count):
-    m_chunks(chunks), m_chunk_count(chunk_count),
-    m_i(0), m_offset_of_chunk(0), m_offset(0)
-{   
+uint8_t* Msg::chunk_host(const Chunk& c, RwOp op, size_t in_chunk, size_t size, size_t *len) {
+    *len = std::min(c.len - in_chunk, size);
+    if (c.host) {
+        return c.host + in_chunk;
+    }
+    auto ptr = FarPointer(c.ptr.m_segment, c.ptr.m_offset + in_chunk);
+    return static_cast<uint8_t*>(m_proc->translate_segmented(ptr, *len, op));
 }
 
-FarSlice Msg::Iterator::next(size_t size)
-{
-    normalize();
-    if (m_i == m_chunk_count)
-        return FarSlice(FarPointer::null(), 0);
-    
-    Qnx::mxfer_entry *c = &m_chunks[m_i];
-    size_t to_read = c->mxfer_len - m_offset;
-    if (to_read > size) {
-        to_read = size;
+template<class F> size_t Msg::for_each_span(const Chunks& chunks, RwOp op, size_t offset, size_t size, F fn) {
+    auto it = find_chunk(chunks, offset);
+    size_t done = 0;
+    for (; it != chunks.end() && done < size; ++it) {
+        size_t len;
+        uint8_t *host = chunk_host(*it, op, offset + done - it->offset, size - done, &len);
+        fn(host, len);
+        done += len;
     }
+    return done;
+}
+
+Msg::~Msg() {
 
-    FarSlice slice(FarPointer(c->mxfer_seg, c->mxfer_off + m_offset), to_read);
-    m_offset += to_read;
-    // printf("-- %lx %lx %lx\n", m_i, m_offset_of_chunk, m_offset);
-    return slice;
 }
 
-void Msg::Iterator::normalize() {
-    Qnx::mxfer_entry *c = &m_chunks[m_i];
-    while (m_i < m_chunk_count && m_offset >= c->mxfer_len) {
-        m_offset_of_chunk += m_offset;
-        m_offset = 0;
-        m_i++;
-        c++;
+void Msg::dump_send(FILE *f) {
+    for (const auto& c: m_send) {
+        for (size_t i = 0; i < c.len; i++) {
+            auto ptr = FarPointer(c.ptr.m_segment, c.ptr.m_offset + i);
+            fprintf(f, "%02X ", *static_cast<uint8_t*>(m_proc->translate_segmented(ptr)));
+        }
     }
-}
 
-bool Msg::Iterator::eof() {
-    normalize();
-    return m_i == m_chunk_count;
+    int rs = 0;
+    for (const auto& c: m_rcv)
+        rs += c.len;
+    fprintf(f, ", reply size %d\n", rs);
 }
 
-size_t Msg::Iterator::msg_offset() const {
-    return m_offset_of_chunk + m_offset;
-}
+void Msg::dump_structure(FILE *f) {
+    for (const auto& c: m_send) {
+        printf("snd: %04zx - %04zx -> %04x:%08x\n", c.offset, c.offset + c.len, c.ptr.m_segment, c.ptr.m_offset);
+    }
 
-void Msg::Iterator::skip_to(size_t dst_offset) {
-    FarSlice s;
-    do {
-        size_t remaining = dst_offset - msg_offset();
-        s = next(remaining);
-    } while(!s.is_empty());
+    for (const auto& c: m_rcv) {
+        printf("rcv: %04zx - %04zx -> %04x:%08x\n", c.offset, c.offset + c.len, c.ptr.m_segment, c.ptr.m_offset);
+    }
 }
 
 void Msg::read(void *dstv, size_t msg_offset, size_t size) {
     // QNX does not actually transfer message lengths, they must be implied or part of the message
     // We copy this in the API and send back garbage for overreads
-    auto i = iterate_send();
     uint8_t *dst = static_cast<uint8_t*>(dstv);
-    i.skip_to(msg_offset);
-
-    while (size) {
-        auto slice = i.next(size);
-        if (slice.is_empty())
-            break;
-        auto src = m_proc->translate_segmented(slice.m_ptr, slice.m_size, RwOp::READ);
-        memcpy(dst, src, slice.m_size);
-        dst += slice.m_size;
-        size -= slice.m_size;
-    }
+    size_t done = for_each_span(m_send, RwOp::READ, msg_offset, size, [&dst](uint8_t *src, size_t len) {
+        memcpy(dst, src, len);
+        dst += len;
+    });
 
-    memset(dst, 0xCC, size);
+    memset(dst, 0xCC, size - done);
 }
 
 void Msg::read_written(void *dstv, size_t msg_offset, size_t size) {
-    auto i = iterate_receive();
     uint8_t *dst = static_cast<uint8_t*>(dstv);
-    i.skip_to(msg_offset);
-
-    while (size) {
-        auto slice = i.next(size);
-        if (slice.is_empty())
-            break;
-        auto src = m_proc->translate_segmented(slice.m_ptr, slice.m_size, RwOp::READ);
-        memcpy(dst, src, slice.m_size);
-        dst += slice.m_size;
-        size -= slice.m_size;
-    }
+    size_t done = for_each_span(m_rcv, RwOp::READ, msg_offset, size, [&dst](uint8_t *src, size_t len) {
+        memcpy(dst, src, len);
+        dst += len;
+    });
 
-    memset(dst, 0xCC, size);
+    memset(dst, 0xCC, size - done);
 }
 
 size_t Msg::write(size_t msg_offset, const void *srcv, size_t size)
 {
-    size_t orig_size = size;
-    auto i = iterate_receive();
     const uint8_t *src = static_cast<const uint8_t*>(srcv);
-    i.skip_to(msg_offset);
-
-    while (size) {
-        auto slice = i.next(size);
-        if (slice.is_empty())
-            break;
-        auto dst = m_proc->translate_segmented(slice.m_ptr, slice.m_size, RwOp::WRITE);
-        mempcpy(dst, src, slice.m_size);
-        src += slice.m_size;
-        size -= slice.m_size;
-    }
-
-    return orig_size - size;
+    return for_each_span(m_rcv, RwOp::WRITE, msg_offset, size, [&src](uint8_t *dst, size_t len) {
+        memcpy(dst, src, len);
+        src += len;
+    });
 }
 
 void Msg::write_status(uint16_t status) {
@@ -216,24 +190,15 @@ void Msg::write_status(uint16_t status) {
 }
 
 static const uint8_t garbage_read[256] = {'X'};
-static const uint8_t garbage_write[256] = {0};
 
-void Msg::common_iovec(Iterator i, RwOp op, size_t offset, size_t size, std::vector<iovec>& dst)
+void Msg::common_iovec(const Chunks& chunks, RwOp op, size_t offset, size_t size, ScratchVector<iovec>& dst)
 {
-    i.skip_to(offset);
-
-    while (size != 0) {
-        auto slice = i.next(size);
-        if (slice.is_empty())
-            break;
-        auto ptr = m_proc->translate_segmented(slice.m_ptr, slice.m_size, op);
+    size -= for_each_span(chunks, op, offset, size, [&dst](uint8_t *ptr, size_t len) {
         struct iovec vec;
         vec.iov_base = ptr;
-        vec.iov_len = slice.m_size;
+        vec.iov_len = len;
         dst.push_back(vec);
-
-        size -= slice.m_size;
-    }
+    });
 
     while (size != 0) {
         struct iovec vec;
@@ -244,19 +209,68 @@ void Msg::common_iovec(Iterator i, RwOp op, size_t offset, size_t size, std::vec
     }
 }
 
-void Msg::read_iovec(size_t offset, size_t size, std::vector<iovec>& dst) {
-    common_iovec(iterate_send(), RwOp::READ, offset, size, dst);
+void Msg::read_iovec(size_t offset, size_t size, ScratchVector<iovec>& dst) {
+    common_iovec(m_send, RwOp::READ, offset, size, dst);
 }
 
-void Msg::write_iovec(size_t offset, size_t size, std::vector<iovec>& dst) {
-    common_iovec(iterate_receive(), RwOp::WRITE, offset, size, dst);
+void Msg::write_iovec(size_t offset, size_t size, ScratchVector<iovec>& dst) {
+    common_iovec(m_rcv, RwOp::WRITE, offset, size, dst);
 }
 
-void MsgStreamReader::get_more() {
-    auto slice = m_it.next();
-    if (slice.is_empty()) {
-        return;
+bool FlatMsg::resolve(Process *proc, size_t send_parts, FarPointer send, size_t rcv_parts, FarPointer rcv) {
+    m_send_parts = send_parts;
+    m_rcv_parts = rcv_parts;
+    return resolve_parts(proc, send_parts, send, RwOp::READ, m_send)
+        && resolve_parts(proc, rcv_parts, rcv, RwOp::WRITE, m_rcv);
+}
+
+bool FlatMsg::resolve_parts(Process *proc, size_t parts, FarPointer ptr, RwOp op, iovec dst[MAX_PARTS]) {
+    if (parts == 0 || parts > MAX_PARTS) {
+        return false;
+    }
+
+    auto entries = reinterpret_cast<Qnx::mxfer_entry*>(
+        proc->translate_segmented(ptr, sizeof(Qnx::mxfer_entry) * parts, RwOp::READ)
+    );
+    for (size_t i = 0; i < parts; i++) {
+        const auto& e = entries[i];
+        dst[i].iov_base = proc->translate_segmented(FarPointer(e.mxfer_seg, e.mxfer_off), e.mxfer_len, op);
+        dst[i].iov_len = e.mxfer_len;
+    }
+    return true;
+}
+
+size_t FlatMsg::send_iovec(size_t offset, size_t size, iovec dst[MAX_PARTS]) const {
+    return common_iovec(m_send, m_send_parts, offset, size, dst);
+}
+
+size_t FlatMsg::rcv_iovec(size_t offset, size_t size, iovec dst[MAX_PARTS]) const {
+    return common_iovec(m_rcv, m_rcv_parts, offset, size, dst);
+}
+
+size_t FlatMsg::common_iovec(const iovec parts[MAX_PARTS], size_t count, size_t offset, size_t size, iovec dst[MAX_PARTS]) {
+    size_t n = 0;
+    for (size_t i = 0; i < count && size; i++) {
+        if (offset >= parts[i].iov_len) {
+            offset -= parts[i].iov_len;
+            continue;
+        }
+        size_t len = std::min(parts[i].iov_len - offset, size);
+        dst[n].iov_base = static_cast<uint8_t*>(parts[i].iov_base) + offset;
+        dst[n].iov_len = len;
+        n++;
+        size -= len;
+        offset = 0;
+    }
+
+    // the full path would pad the rest, leave that to it
+    if (size) {
+        return 0;
     }
-    m_buf = static_cast<const uint8_t*>(m_msg->m_proc->translate_segmented(slice.m_ptr, slice.m_size, RwOp::READ));
-    m_ready = slice.m_size;
-}
\ No newline at end of file
+    return n;
+}
+
+void MsgStreamReader::get_more() {
+    m_buf = m_msg->span(m_msg->m_send, RwOp::READ, m_offset, &m_ready);
+    m_offset += m_ready;
+}
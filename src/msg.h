@@ -2,19 +2,20 @@
 
 #include <bits/types/FILE.h>
 #include <cassert>
+#include <cstring>
 #include <cstdint>
 #include <stddef.h>
 #include <limits>
+#include <sys/uio.h>
 #include <vector>
 
 #include "guest_context.h"
+#include "scratch_arena.h"
 #include "emu.h"
 #include "msg/meta.h"
 #include "types.h"
 #include "qnx/types.h"
 
-struct iovec;
-
 class MsgStreamReader;
 
 /* 
@@ -41,67 +42,107 @@ public:
     void write_status(uint16_t status);
 
     /** Get IOVEC for writing into the message */
-    void write_iovec(size_t offset, size_t size, std::vector<iovec>& dst);
+    void write_iovec(size_t offset, size_t size, ScratchVector<iovec>& dst);
     /** Get IOVEC for reading from the message */
-    void read_iovec(size_t offset, size_t size, std::vector<iovec>& dst);
+    void read_iovec(size_t offset, size_t size, ScratchVector<iovec>& dst);
 
     void dump_send(FILE *f);
     void dump_structure(FILE *f);
 private:
-    void translate_mxfer_entries(size_t n, const Qnx::mxfer_entry16 src[], std::vector<Qnx::mxfer_entry>& dst);
+    /* 
+     * One part of the message, resolved to host memory when the message is created. If the part could not be
+     * translated as a whole (e.g. it is larger than the segment and only the start is used), host is null
+     * and each access translates its own slice, reporting the error only if the slice is really invalid.
+     */
+    struct Chunk {
+        /* offset within the message */
+        size_t offset;
+        size_t len;
+        FarPointer ptr;
+        uint8_t *host;
+    };
 
-    // Iterates through chunks, mainting position within chunk
-    class Iterator {
-    friend class Msg;
-    friend class MsgStreamReader;
+    /* Chunk table with inline space for the usual small number of parts, so that messages do not allocate */
+    class Chunks {
     public:
-        static constexpr size_t no_limit = std::numeric_limits<size_t>::max();
-
-        /* 
-        * Return next part of the message and advance the iterator. The returned part will be up to \size,
-        * but may be less depending on chunk. 
-        * 
-        * Only returns zero slice on EOF.
-        */
-        FarSlice next(size_t size = no_limit);
-        bool eof();
-        size_t msg_offset() const;
-        /*
-         * Skip to a given offset or to end if dst_offset is outside of message.
-         */
-        void skip_to(size_t dst_offset);
+        using const_iterator = const Chunk*;
+        void push_back(const Chunk& c);
+        const Chunk* begin() const { return data(); }
+        const Chunk* end() const { return data() + m_size; }
+        bool empty() const { return m_size == 0; }
+        size_t size() const { return m_size; }
+        const Chunk& back() const { return data()[m_size - 1]; }
     private:
-        Iterator(Qnx::mxfer_entry *chunks, size_t chunk_count);
-        // skip empty or iterated-through segments
-        void normalize();
-        
-        Qnx::mxfer_entry *m_chunks;
-        size_t m_chunk_count;
-        
-        // the current chunk
-        size_t m_i;
-        // and the offset of that chunk within the message
-        size_t m_offset_of_chunk;
-        // offset within the chunk
-        size_t m_offset;
+        const Chunk* data() const { return m_heap.empty() ? m_inline : m_heap.data(); }
+
+        static constexpr size_t INLINE = 4;
+        Chunk m_inline[INLINE];
+        std::vector<Chunk> m_heap;
+        size_t m_size = 0;
     };
 
-    Iterator iterate_send();
-    Iterator iterate_receive();
-    void common_iovec(Iterator it, RwOp op, size_t offset, size_t size, std::vector<iovec>& dst);
+    void resolve_chunks(size_t parts, const Qnx::mxfer_entry src[], RwOp op, Chunks& dst);
+    void resolve_chunks16(size_t parts, const Qnx::mxfer_entry16 src[], RwOp op, Chunks& dst);
+    void add_chunk(uint16_t seg, uint32_t off, uint32_t len, RwOp op, Chunks& dst);
+
+    static const Chunk* find_chunk(const Chunks& chunks, size_t offset);
+    static constexpr size_t LINEAR_SEARCH = 8;
+    /* Contiguous span at offset, up to the end of its chunk */
+    uint8_t* span(const Chunks& chunks, RwOp op, size_t offset, size_t *len);
+    uint8_t* chunk_host(const Chunk& c, RwOp op, size_t in_chunk, size_t size, size_t *len);
+    /* Call fn(host_ptr, size) for each contiguous span of [offset, offset + size). Returns the size covered. */
+    template<class F> size_t for_each_span(const Chunks& chunks, RwOp op, size_t offset, size_t size, F fn);
+    void common_iovec(const Chunks& chunks, RwOp op, size_t offset, size_t size, ScratchVector<iovec>& dst);
 
     Process *m_proc;
+    Chunks m_send;
+    Chunks m_rcv;
+};
 
-    size_t m_rcv_parts;
-    Qnx::mxfer_entry* m_rcv;
+/*
+ * A message with few parts in each direction, all resolved to host memory and bounds checked up front.
+ *
+ * Used by the fast path for hot I/O messages, which do not need the generality of Msg. The message
+ * must carry the whole request and the whole reply header in its first part.
+ */
+class FlatMsg {
+public:
+    static constexpr size_t MAX_PARTS = 2;
 
-    std::vector<Qnx::mxfer_entry> m_rcv_translated_entries;
+    /* Returns false if the message is not simple enough */
+    bool resolve(Process *proc, size_t send_parts, FarPointer send, size_t rcv_parts, FarPointer rcv);
+
+    /* Copy of the request, false if the first part is too small */
+    template<class T> bool read_request(T *dst) const;
+    template<class T> void write_reply(const T *src);
+    bool reply_fits(size_t size) const { return m_rcv[0].iov_len >= size; }
+
+    /* Get IOVEC for the payload after offset, returns number of entries or 0 if the message is too short */
+    size_t send_iovec(size_t offset, size_t size, iovec dst[MAX_PARTS]) const;
+    size_t rcv_iovec(size_t offset, size_t size, iovec dst[MAX_PARTS]) const;
+private:
+    static bool resolve_parts(Process *proc, size_t parts, FarPointer ptr, RwOp op, iovec dst[MAX_PARTS]);
+    static size_t common_iovec(const iovec parts[MAX_PARTS], size_t count, size_t offset, size_t size, iovec dst[MAX_PARTS]);
 
     size_t m_send_parts;
-    Qnx::mxfer_entry* m_send;
-    std::vector<Qnx::mxfer_entry> m_send_translated_entries;
+    iovec m_send[MAX_PARTS];
+    size_t m_rcv_parts;
+    iovec m_rcv[MAX_PARTS];
 };
 
+template<class T> bool FlatMsg::read_request(T *dst) const {
+    if (m_send[0].iov_len < sizeof(T)) {
+        return false;
+    }
+    memcpy(dst, m_send[0].iov_base, sizeof(T));
+    return true;
+}
+
+template<class T> void FlatMsg::write_reply(const T *src) {
+    assert(reply_fits(sizeof(T)));
+    memcpy(m_rcv[0].iov_base, src, sizeof(T));
+}
+
 /* Allows reading message byte-by-byte */
 class MsgStreamReader {
 public:
@@ -110,16 +151,15 @@ public:
 private:
     void get_more();
     Msg *m_msg;
-    Msg::Iterator m_it;
+    size_t m_offset;
     size_t m_ready;
     const uint8_t *m_buf;
 };
 
 MsgStreamReader::MsgStreamReader(Msg *msg, size_t skip): 
-    m_msg(msg), m_it(msg->m_send, msg->m_send_parts),
+    m_msg(msg), m_offset(skip),
     m_ready(0), m_buf(nullptr)
 {
-    m_it.skip_to(skip);
 }
 
 char MsgStreamReader::get(char fallback) {
@@ -21,6 +21,8 @@ public:
     int map_fd(Qnx::fd_t qnx_fd);
 
     bool m_via_fd;
+    /* The handler replaced the image (exec in process), the message is in unmapped memory and gets no reply */
+    bool m_consumed = false;
     /* fd or pid*/
     union {
         Qnx::pid_t m_pid;
@@ -0,0 +1,110 @@
+#include "native_tools.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cmd_opts.h"
+#include "path_mapper.h"
+#include "types.h"
+#include "unique_file.h"
+#include "util.h"
+
+void NativeTools::load(const char *path) {
+    UniqueFile f(fopen(path, "re"));
+    if (!f) {
+        throw ConfigurationError(std_printf("Cannot open native tool table %s: %s", path, strerror(errno)));
+    }
+
+    char *line = nullptr;
+    size_t line_size = 0;
+    ssize_t len;
+    int lineno = 0;
+    try {
+        while ((len = getline(&line, &line_size, f.get())) >= 0) {
+            lineno++;
+            std::string_view l(line, len);
+            while (!l.empty() && isspace(l.back()))
+                l.remove_suffix(1);
+            while (!l.empty() && isspace(l.front()))
+                l.remove_prefix(1);
+            if (l.empty() || l.front() == '#')
+                continue;
+            add(l);
+        }
+    } catch (const ConfigurationError& e) {
+        free(line);
+        throw ConfigurationError(std_printf("%s:%d: %s", path, lineno, e.m_msg.c_str()));
+    }
+    free(line);
+}
+
+void NativeTools::add(std::string_view line) {
+    Tool t;
+    std::vector<std::string> replace;
+    CommandOptions::parse(line, {
+        .core = {
+            new CommandOptions::String(&t.m_qnx_path),
+            new CommandOptions::String(&t.m_host_path),
+        },
+        .kwargs {
+            new CommandOptions::KwArg<CommandOptions::Flag>("paths", &t.m_paths),
+            new CommandOptions::KwArg<CommandOptions::StringList>("arg", &t.m_args),
+            new CommandOptions::KwArg<CommandOptions::StringList>("replace", &replace),
+        }
+    });
+
+    for (const auto& r: replace) {
+        auto sep = r.find(':');
+        if (sep == r.npos || sep == 0) {
+            throw ConfigurationError("replace expects FROM:TO");
+        }
+        t.m_replace.emplace_back(r.substr(0, sep), r.substr(sep + 1));
+    }
+
+    t.m_qnx_path = PathInfo::mk_qnx_path(t.m_qnx_path.c_str()).qnx_path();
+    if (t.m_qnx_path.empty() || t.m_qnx_path[0] != '/') {
+        throw ConfigurationError("QNX path of a native tool must be absolute");
+    }
+    std::string key = t.m_qnx_path;
+    if (!m_tools.emplace(std::move(key), std::move(t)).second) {
+        throw ConfigurationError("duplicate native tool");
+    }
+}
+
+const NativeTools::Tool* NativeTools::find(const char *qnx_path) const {
+    if (m_tools.empty())
+        return nullptr;
+    auto it = m_tools.find(qnx_path);
+    return it == m_tools.end() ? nullptr : &it->second;
+}
+
+std::vector<std::string> NativeTools::rewrite_args(const Tool& tool, size_t argc, const char* const* argv,
+    PathMapper& mapper)
+{
+    std::vector<std::string> r;
+    if (argc > 0) {
+        r.push_back(argv[0]);
+    } else {
+        r.push_back(tool.m_host_path);
+    }
+    r.insert(r.end(), tool.m_args.begin(), tool.m_args.end());
+
+    for (size_t i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        for (const auto& [from, to]: tool.m_replace) {
+            if (arg == from) {
+                arg = to;
+                break;
+            }
+        }
+        if (arg.empty() && strlen(argv[i]) > 0)
+            continue;
+        if (tool.m_paths && arg[0] == '/') {
+            arg = mapper.map_path_to_host(arg.c_str()).host_path();
+        }
+        r.push_back(std::move(arg));
+    }
+    return r;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class PathMapper;
+
+/*
+ * Table of QNX executables that are replaced by host programs, loaded by --native-tools=FILE.
+ *
+ * Each non-empty line that does not start with '#' has the same form as a --map argument:
+ *   qnx_path,host_command[,paths][,arg=ARG]...[,replace=FROM:TO]...
+ *
+ * When a QNX program spawns or execs qnx_path, host_command is run directly instead of loading the LMF.
+ * The arguments are passed as given, except that:
+ *  - each arg=ARG is inserted before them, in order,
+ *  - an argument equal to FROM is replaced by TO, or dropped if TO is empty,
+ *  - with paths, the arguments that are absolute QNX paths are mapped to host paths.
+ * The host program runs in the host directory of the QNX current directory, like for exec=host prefixes.
+ */
+class NativeTools {
+public:
+    struct Tool {
+        std::string m_qnx_path;
+        std::string m_host_path;
+        bool m_paths = false;
+        std::vector<std::string> m_args;
+        std::vector<std::pair<std::string, std::string>> m_replace;
+    };
+
+    void load(const char *path);
+
+    /* Returns the tool for the normalized QNX path, or null */
+    const Tool* find(const char *qnx_path) const;
+    /* Arguments for the host program, argv[0] is kept */
+    static std::vector<std::string> rewrite_args(const Tool& tool, size_t argc, const char* const* argv,
+        PathMapper& mapper);
+private:
+    void add(std::string_view line);
+
+    std::unordered_map<std::string, Tool> m_tools;
+};
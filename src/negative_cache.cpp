@@ -0,0 +1,152 @@
+#include "negative_cache.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "qnx_fd.h"
+#include "stats.h"
+
+static Stats::Counter stat_lookup("negative_cache.lookup");
+static Stats::Counter stat_hit("negative_cache.hit", &stat_lookup);
+static Stats::Counter stat_insert("negative_cache.insert");
+static Stats::Counter stat_invalidate("negative_cache.invalidate");
+
+static constexpr uint32_t WATCH_MASK = IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+bool NegativeCache::missing_slow(const char *host_path) {
+    stat_lookup.inc();
+    if (m_missing.empty()) {
+        return false;
+    }
+    drain();
+    if (m_missing.find(host_path) == m_missing.end()) {
+        return false;
+    }
+    stat_hit.inc();
+    return true;
+}
+
+void NegativeCache::add_slow(const char *host_path) {
+    const char *slash = strrchr(host_path, '/');
+    if (host_path[0] != '/' || !slash[1] || !strcmp(slash + 1, ".") || !strcmp(slash + 1, "..")) {
+        return;
+    }
+    std::string path(host_path);
+    if (m_missing.count(path)) {
+        return;
+    }
+    if (m_missing.size() >= MAX_ENTRIES) {
+        clear();
+    }
+
+    if (!m_inotify.valid()) {
+        UniqueFd fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+        if (fd.valid()) {
+            m_inotify = FdMap::move_internal(std::move(fd));
+        }
+        if (!m_inotify.valid()) {
+            Log::print(Log::MAP, "negative cache disabled: %s\n", strerror(errno));
+            m_enabled = false;
+            return;
+        }
+    }
+    std::string parent = slash == host_path ? "/" : path.substr(0, slash - host_path);
+    int wd = inotify_add_watch(m_inotify.get(), parent.c_str(), WATCH_MASK);
+    if (wd < 0) {
+        return;
+    }
+    // the watch only reports what happens from now on, the path may have been created since the lookup failed
+    struct stat st;
+    if (fstatat(AT_FDCWD, host_path, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
+        return;
+    }
+    m_missing.emplace(path, wd);
+    m_dirs[wd].m_names[slash + 1].push_back(std::move(path));
+    stat_insert.inc();
+}
+
+void NegativeCache::remove(const std::string& host_path) {
+    auto it = m_missing.find(host_path);
+    if (it == m_missing.end()) {
+        return;
+    }
+    auto dir = m_dirs.find(it->second);
+    if (dir != m_dirs.end()) {
+        auto name = dir->second.m_names.find(host_path.substr(host_path.rfind('/') + 1));
+        if (name != dir->second.m_names.end()) {
+            auto& paths = name->second;
+            paths.erase(std::find(paths.begin(), paths.end(), host_path));
+            if (paths.empty()) {
+                dir->second.m_names.erase(name);
+            }
+        }
+    }
+    m_missing.erase(it);
+    stat_invalidate.inc();
+}
+
+void NegativeCache::drop_dir(int wd) {
+    auto dir = m_dirs.find(wd);
+    if (dir == m_dirs.end()) {
+        return;
+    }
+    for (const auto& name: dir->second.m_names) {
+        for (const auto& path: name.second) {
+            m_missing.erase(path);
+            stat_invalidate.inc();
+        }
+    }
+    m_dirs.erase(dir);
+}
+
+void NegativeCache::drain() {
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t r;
+    while ((r = read(m_inotify.get(), buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + r; ) {
+            auto ev = reinterpret_cast<const struct inotify_event*>(p);
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                Log::print(Log::MAP, "negative cache: inotify queue overflow\n");
+                clear();
+                return;
+            }
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                auto dir = m_dirs.find(ev->wd);
+                if (dir == m_dirs.end()) {
+                    continue;
+                }
+                auto name = dir->second.m_names.find(ev->name);
+                if (name == dir->second.m_names.end()) {
+                    continue;
+                }
+                for (const auto& path: name->second) {
+                    m_missing.erase(path);
+                    stat_invalidate.inc();
+                }
+                dir->second.m_names.erase(name);
+            }
+            if (ev->mask & IN_MOVE_SELF) {
+                // the paths now lead elsewhere, the events of the directory are of no use
+                inotify_rm_watch(m_inotify.get(), ev->wd);
+            }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+                drop_dir(ev->wd);
+            }
+        }
+    }
+}
+
+void NegativeCache::clear() {
+    stat_invalidate.inc(m_missing.size());
+    m_missing.clear();
+    m_dirs.clear();
+    // closing the instance removes all its watches
+    m_inotify.close();
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "unique_fd.h"
+
+/*
+ * Cache of host paths that do not exist, enabled by --negative-cache. Shells searching PATH and compilers
+ * searching their include directories mostly look up files that are not there, each a full host lookup.
+ *
+ * A path is only cached if its parent directory exists, which is then watched with inotify: a file created in
+ * or moved into it removes the path, a parent that is removed or moved removes all the paths in it, and a queue
+ * overflow drops everything. The own creates of the process also remove the path and its renames drop everything,
+ * but a rename of a directory further up by another process goes unnoticed until the cache is dropped.
+ *
+ * Each process has its own cache, a forked process starts with an empty one.
+ */
+class NegativeCache {
+public:
+    void enable() { m_enabled = true; }
+
+    /* Is host_path known not to exist */
+    inline bool missing(const char *host_path);
+    /* A lookup of host_path failed with ENOENT */
+    inline void add(const char *host_path);
+    /* The process may have created host_path */
+    inline void created(const char *host_path);
+    /* Forget everything, e.g. when a directory was renamed. A forked process must not share the inotify queue. */
+    void clear();
+private:
+    static constexpr size_t MAX_ENTRIES = 64 * 1024;
+
+    struct Dir {
+        /* Cached paths in the directory, by the name in it */
+        std::unordered_map<std::string, std::vector<std::string>> m_names;
+    };
+
+    bool missing_slow(const char *host_path);
+    void add_slow(const char *host_path);
+    void remove(const std::string& host_path);
+    /* Apply the queued inotify events */
+    void drain();
+    void drop_dir(int wd);
+
+    bool m_enabled = false;
+    UniqueFd m_inotify;
+    /* Path -> watch descriptor of its parent directory */
+    std::unordered_map<std::string, int> m_missing;
+    std::unordered_map<int, Dir> m_dirs;
+};
+
+bool NegativeCache::missing(const char *host_path) {
+    return m_enabled && missing_slow(host_path);
+}
+
+void NegativeCache::add(const char *host_path) {
+    if (m_enabled) {
+        add_slow(host_path);
+    }
+}
+
+void NegativeCache::created(const char *host_path) {
+    if (m_enabled && !m_missing.empty()) {
+        remove(host_path);
+    }
+}
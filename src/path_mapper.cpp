@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <fcntl.h>
 #include <string.h>
 #include <assert.h>
 #include "log.h"
@@ -5,6 +7,11 @@
 #include "types.h"
 #include "fsutil.h"
 #include "cmd_opts.h"
+#include "qnx_fd.h"
+#include "stats.h"
+
+static Stats::Counter stat_cache_hit("path_map.cache_hit");
+static Stats::Counter stat_cache_miss("path_map.cache_miss");
 
 static void pop_path(std::string& dst) {
     while (dst.back() != '/' && !dst.empty()) {
@@ -123,13 +130,134 @@ void PathMapper::add_map(const char *map_cmd_arg) {
     }
 
     if (i.m_qnx_path == "/") {
-        m_root = i;
+        m_root = std::move(i);
     } else {
         if (has_qnx_prefix(i.m_qnx_path.c_str())) {
             throw ConfigurationError("duplicate QNX prefix mapping");
         }
-        m_prefixes.push_back(i);
+        m_prefixes.push_back(std::move(i));
+    }
+    index_prefixes();
+    cache_clear();
+}
+
+PathMapper::Node& PathMapper::Node::insert(std::string_view path) {
+    Node *n = this;
+    size_t pos = 0;
+    while (pos < path.size()) {
+        auto end = path.find('/', pos);
+        if (end == path.npos)
+            end = path.size();
+        auto name = path.substr(pos, end - pos);
+        pos = end + 1;
+        if (name.empty())
+            continue;
+
+        auto it = std::lower_bound(n->m_children.begin(), n->m_children.end(), name,
+            [](const Node& c, std::string_view name) { return c.m_name < name; });
+        if (it == n->m_children.end() || it->m_name != name) {
+            it = n->m_children.insert(it, Node());
+            it->m_name = name;
+        }
+        n = &*it;
     }
+    return *n;
+}
+
+const PathMapper::Node* PathMapper::Node::child(std::string_view name) const {
+    auto it = std::lower_bound(m_children.begin(), m_children.end(), name,
+        [](const Node& c, std::string_view name) { return c.m_name < name; });
+    if (it == m_children.end() || it->m_name != name)
+        return nullptr;
+    return &*it;
+}
+
+template<class F>
+void PathMapper::walk(const Node& tree, const char *path, F f) {
+    // the prefixes are absolute
+    if (*path != '/')
+        return;
+
+    const Node *n = &tree;
+    for (;;) {
+        for (auto i: n->m_prefixes)
+            f(i);
+        while (*path == '/')
+            path++;
+        if (!*path)
+            return;
+        const char *end = strchrnul(path, '/');
+        n = n->child(std::string_view(path, end - path));
+        if (!n)
+            return;
+        path = end;
+    }
+}
+
+bool PathMapper::is_qnx_prefix(const char *path) const {
+    if (*path != '/')
+        return false;
+
+    const Node *n = &m_qnx_tree;
+    for (;;) {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            return n != &m_qnx_tree && !n->m_prefixes.empty();
+        const char *end = strchrnul(path, '/');
+        n = n->child(std::string_view(path, end - path));
+        if (!n)
+            return false;
+        path = end;
+    }
+}
+
+void PathMapper::index_prefixes() {
+    m_qnx_tree = Node();
+    m_host_tree = Node();
+    for (size_t i = 0; i < m_prefixes.size(); i++) {
+        m_qnx_tree.insert(m_prefixes[i].m_qnx_path).m_prefixes.push_back(i);
+        m_host_tree.insert(m_prefixes[i].m_host_path).m_prefixes.push_back(i);
+    }
+}
+
+void PathMapper::open_dirfd(Prefix& pfx) {
+    pfx.m_dirfd_tried = true;
+    UniqueFd fd(open(pfx.m_host_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    if (fd.valid()) {
+        pfx.m_dirfd = FdMap::move_internal(std::move(fd));
+    }
+    Log::if_enabled(Log::MAP, [&](FILE *stream) {
+        fprintf(stream, "Prefix root host:%s fd %d\n", pfx.m_host_path.c_str(), pfx.m_dirfd.get());
+    });
+}
+
+int PathInfo::host_dirfd() const {
+    if (!m_host_valid || !m_prefix || !m_prefix->m_dirfd.valid())
+        return AT_FDCWD;
+    return m_prefix->m_dirfd.get();
+}
+
+const char *PathInfo::host_relpath() const {
+    if (host_dirfd() == AT_FDCWD)
+        return host_path();
+    const char *rel = m_host_path.c_str() + m_prefix->m_host_path.size();
+    while (*rel == '/')
+        rel++;
+    return *rel ? rel : ".";
+}
+
+void PathMapper::cache_clear() {
+    m_cache_index.clear();
+    m_cache.clear();
+}
+
+/* Like Fsutil::path_starts_with, but the prefix must end at a component boundary */
+static bool has_path_prefix(const char *path, const std::string& prefix) {
+    if (prefix == "/")
+        return *path == '/';
+    size_t n = prefix.size();
+    return strncmp(path, prefix.c_str(), n) == 0 && (path[n] == 0 || path[n] == '/');
 }
 bool PathMapper::has_qnx_prefix(const std::string& pfx) {
     if (pfx == "/") {
@@ -150,14 +278,17 @@ void PathMapper::map_path_to_qnx(PathInfo &map) {
         return;
 
     Prefix *pfx = NULL;
-    // find the most general QNX prefix
-    for (auto& c: m_prefixes) {
-        if (Fsutil::path_starts_with(map.host_path(), c.m_host_path.c_str())) {
-            if (!pfx || c.m_qnx_path.length() < pfx->m_qnx_path.length())
-                pfx = &c;
+    // find the most general QNX prefix, the first one given wins the ties
+    size_t pfx_index = 0;
+    walk(m_host_tree, map.host_path(), [&](size_t i) {
+        auto& c = m_prefixes[i];
+        if (!pfx || c.m_qnx_path.length() < pfx->m_qnx_path.length()
+            || (c.m_qnx_path.length() == pfx->m_qnx_path.length() && i < pfx_index)) {
+            pfx = &c;
+            pfx_index = i;
         }
-    }
-    if (Fsutil::path_starts_with(map.host_path(), m_root.m_host_path.c_str())) {
+    });
+    if (has_path_prefix(map.host_path(), m_root.m_host_path)) {
         pfx = &m_root;
     }
 
@@ -205,17 +336,32 @@ void PathMapper::map_path_to_host(PathInfo &map) {
     assert(map.m_qnx_valid);
     Prefix *pfx = &m_root;
 
-    // find the most specific prefix
-    for (auto& c: m_prefixes) {
-        if (Fsutil::path_starts_with(map.qnx_path(), c.m_qnx_path.c_str())) {
-            if (c.m_qnx_path.length() > pfx->m_qnx_path.length())
-                pfx = &c;
+    auto cached = m_cache_index.find(map.m_qnx_path);
+    if (cached != m_cache_index.end()) {
+        stat_cache_hit.inc();
+        m_cache.splice(m_cache.begin(), m_cache, cached->second);
+        pfx = cached->second->m_prefix;
+        map.m_host_path = cached->second->m_host_path;
+    } else {
+        stat_cache_miss.inc();
+        // find the most specific prefix, the deepest one
+        walk(m_qnx_tree, map.qnx_path(), [&](size_t i) {
+            pfx = &m_prefixes[i];
+        });
+        map.m_host_path = Fsutil::change_prefix(pfx->m_qnx_path.c_str(), pfx->m_host_path.c_str(), map.m_qnx_path.c_str());
+
+        m_cache.push_front(CacheEntry{map.m_qnx_path, map.m_host_path, pfx});
+        m_cache_index.emplace(m_cache.front().m_qnx_path, m_cache.begin());
+        if (m_cache.size() > CACHE_SIZE) {
+            m_cache_index.erase(m_cache.back().m_qnx_path);
+            m_cache.pop_back();
         }
     }
 
+    if (!pfx->m_dirfd_tried) {
+        open_dirfd(*pfx);
+    }
     map.m_host_valid = true;
-    map.m_host_path.clear();
-    map.m_host_path = Fsutil::change_prefix(pfx->m_qnx_path.c_str(), pfx->m_host_path.c_str(), map.m_qnx_path.c_str());
     map.m_prefix = pfx;
     Log::if_enabled(Log::MAP, [&](FILE *stream) {
         fprintf(stream, "Mapped qnx:%s -> host:%s (via %s)\n", map.qnx_path(), map.host_path(), pfx->m_qnx_path.c_str());
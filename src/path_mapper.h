@@ -1,11 +1,17 @@
 #pragma once
 
+#include <list>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#include "cpp.h"
+#include "unique_fd.h"
+
 class PathInfo;
 
-class PathMapper {
+class PathMapper: public NoCopy {
 friend class PathInfo;
 public:
     PathMapper();
@@ -27,6 +33,9 @@ public:
     /* Populate the info. May fail. */
     void map_path(PathInfo &map);
 
+    /* Is the normalized QNX path itself mapped by a prefix (other than the root) */
+    bool is_qnx_prefix(const char *path) const;
+
     enum class Exec {
         QNX, HOST
     };
@@ -35,10 +44,46 @@ private:
         std::string m_host_path;
         std::string m_qnx_path;
         Exec m_exec;
+        /* O_PATH handle of m_host_path, opened on the first use */
+        UniqueFd m_dirfd;
+        bool m_dirfd_tried = false;
+    };
+    static void open_dirfd(Prefix& pfx);
+    /*
+     * Component-wise radix tree of the prefixes, one for each direction. The prefixes of a path are the nodes
+     * on its way from the root, so the lookup does not depend on the number of prefixes.
+     */
+    struct Node {
+        std::string m_name;
+        /* Sorted by name */
+        std::vector<Node> m_children;
+        /* Prefixes ending here, indices to m_prefixes */
+        std::vector<size_t> m_prefixes;
+
+        Node& insert(std::string_view path);
+        const Node* child(std::string_view name) const;
+    };
+    /* Calls f(prefix index) for the prefixes of path in the tree, from the shortest one */
+    template<class F> static void walk(const Node& tree, const char *path, F f);
+    void index_prefixes();
+
+    /* Recent QNX to host translations, the front is the most recently used */
+    struct CacheEntry {
+        std::string m_qnx_path;
+        std::string m_host_path;
+        Prefix *m_prefix;
     };
+    static constexpr size_t CACHE_SIZE = 256;
+    void cache_clear();
+
     bool has_qnx_prefix(const std::string& pfx);
     Prefix m_root;
     std::vector<Prefix> m_prefixes;
+    Node m_qnx_tree;
+    Node m_host_tree;
+    std::list<CacheEntry> m_cache;
+    /* Keys point to m_qnx_path of the m_cache entries */
+    std::unordered_map<std::string_view, std::list<CacheEntry>::iterator> m_cache_index;
 };
 
 /* Information about paths. They can either start as host or qnx paths and then be subsequently resolved. */
@@ -55,6 +100,14 @@ public:
     bool qnx_valid() const { return m_qnx_valid; }
     const char *qnx_path() const {return m_qnx_path.c_str(); }
 
+    /*
+     * Directory FD and the path relative to it, for the *at functions. The directory is the host root of the
+     * prefix, so the kernel does not walk the prefix again and a renamed prefix root still works. AT_FDCWD and
+     * the host path if the path was not mapped to the host by a prefix or its root could not be opened.
+     */
+    int host_dirfd() const;
+    const char *host_relpath() const;
+
     bool info_valid() const {return m_prefix; }
     const char* symlink_root() const {return m_prefix->m_host_path.c_str(); }
     PathMapper::Exec exec_type() const {return m_prefix->m_exec;}
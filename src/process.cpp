@@ -31,25 +31,37 @@
 #include "guest_context.h"
 #include "types.h"
 #include "log.h"
+#include "stats.h"
 #include "util.h"
 #include "fsutil.h"
 #include "cmd_opts.h"
 
 Process* Process::m_current = nullptr;
 
+static Stats::Counter stat_msg_fast("msg.fast");
+static Stats::Counter stat_msg_full("msg.full");
+static Stats::Counter stat_exec_in_process("exec.in_process");
+static Stats::Counter stat_create_ns("startup.create_ns");
+static Stats::Counter stat_load_library_ns("startup.load_library_ns");
+static Stats::Counter stat_load_executable_ns("startup.load_executable_ns");
+static Stats::Counter stat_setup_ns("startup.setup_startup_context_ns");
+
 Process::Process(): 
     m_segment_descriptors(1024),
     m_sigtab(nullptr),
+    m_sigtab_guest_pointer(FarPointer::null()),
     m_fds(),
     m_magic_guest_pointer(FarPointer::null()),
     m_slib_entry(0),
-    m_bits(B32)
+    m_bits(B32),
+    m_exec_in_process(true)
 {
 }
 
 Process::~Process() {}
 
 Process* Process::create() {
+    Stats::Timer timer(stat_create_ns);
     assert(!m_current);
     m_current = new Process();
     m_current->initialize();
@@ -60,7 +72,9 @@ void Process::initialize() {
     m_startup_context = GuestContext(&m_startup_context_main, &m_startup_context_extra);
     memset(&m_startup_context_main, 0xcc, sizeof(m_startup_context_main));
     memset(&m_startup_context_extra, 0xcc, sizeof(m_startup_context_extra));
-    m_fds.scan_host_fds(m_current->nid(), 1, 1);
+    if (!m_fds.import_table()) {
+        m_fds.scan_host_fds(m_current->nid(), 1, 1);
+    }
     m_emu.init();
     initialize_pids();
 }
@@ -103,6 +117,7 @@ void Process::initialize_pids() {
 }
 
 void Process::load_library(std::string_view load_arg) {
+    Stats::Timer timer(stat_load_library_ns);
     std::string lib;
     uint32_t entry;
     namespace CO = CommandOptions;
@@ -142,11 +157,13 @@ void Process::load_library(std::string_view load_arg) {
 
     if (slib || slib16) {
         m_slib_entry = entry;
+        m_slib_path = lib;
         m_load_slib = li;
     }
 }
 
 void Process::load_executable(const PathInfo &path) {
+    Stats::Timer timer(stat_load_executable_ns);
     const PathInfo *current_path = &path;
 
     Log::print(Log::LOADER, "loading executable %s\n", path.host_path());
@@ -178,16 +195,105 @@ void Process::load_executable(const PathInfo &path) {
     m_executed_file = path_mapper().map_path_to_qnx(realpath.c_str());
 }
 
+bool Process::exec_loadable(const PathInfo& path) {
+    UniqueFd fd(open(path.host_path(), O_RDONLY | O_CLOEXEC));
+    if (!fd.valid()) {
+        return false;
+    }
+
+    InterpreterInfo interp;
+    loader_check_interpreter(fd.get(), &interp);
+    if (interp.has_interpreter) {
+        path_mapper().map_path_to_host(interp.interpreter);
+        fd = UniqueFd(open(interp.interpreter.host_path(), O_RDONLY | O_CLOEXEC));
+        if (!fd.valid()) {
+            return false;
+        }
+    }
+
+    Bitness bits;
+    return loader_peek(fd.get(), &bits) && bits == m_bits;
+}
+
+void Process::release_image() {
+    auto& sdmap = m_segment_descriptors;
+    auto& slib = m_load_slib.selectors;
+    for (size_t i = 0; (i = sdmap.search(i, true)) != IdMap<SegmentDescriptor>::INVAL; i++) {
+        auto sd = sdmap[i];
+        bool keep = sd->segment() == m_time_segment
+            || std::find(slib.begin(), slib.end(), sd->selector()) != slib.end();
+        if (!keep) {
+            segment_changed(sd->selector());
+            sdmap.erase(i);
+        }
+    }
+
+    m_magic_pointer.reset();
+    m_magic = nullptr;
+    m_magic16 = nullptr;
+    m_sigtab = nullptr;
+    m_sigtab_guest_pointer = FarPointer::null();
+    m_load_exec = LoadInfo();
+    m_interpreter_info = InterpreterInfo();
+    m_emu.reset_signals_for_exec();
+}
+
+bool Process::exec_in_process_possible(const PathInfo& path) {
+    // 16-bit programs are left to a fresh qine, as is anything needing the other Slib
+    return m_exec_in_process && m_bits == B32 && exec_loadable(path);
+}
+
+void Process::exec_in_process(const PathInfo& path, const ScratchVector<const char*>& argv,
+    const ScratchVector<const char*>& env, GuestContext& ctx, bool forked)
+{
+    Log::print(Log::LOADER, "exec in process: %s\n", path.host_path());
+    stat_exec_in_process.inc();
+    if (forked) {
+        update_pids_after_fork(getpid());
+        m_time.start();
+    }
+    m_fds.close_on_exec();
+    release_image();
+
+    clearenv();
+    for (auto e: env) {
+        auto eq = strchr(e, '=');
+        if (eq) {
+            setenv(std::string(e, eq - e).c_str(), eq + 1, 1);
+        }
+    }
+
+    m_result_cache.begin(path, argv.size(), argv.data());
+    try {
+        load_executable(path);
+        setup_startup_context(argv.size(), const_cast<char**>(argv.data()));
+    } catch (const std::exception& e) {
+        // the old image is gone, there is nothing to return to
+        fprintf(stderr, "exec %s: %s\n", path.host_path(), e.what());
+        exit(255);
+    }
+
+    Emu::load_startup_context(ctx);
+}
+
 void Process::update_pids_after_fork(pid_t new_pid) {
     m_parent_pid = m_my_pid;
     m_my_pid = m_pids.alloc_related_pid(new_pid, QnxPid::Type::SELF);
     m_magic->my_pid = pid();
     m_magic->dads_pid = parent_pid();
     m_magic->my_nid = nid();
+    // the child must not consume the inotify events of the parent
+    m_negative_cache.clear();
     // printf("Updated PIDs: parent: qnx=%d host=%d\n", m_parent_pid->qnx_pid(), m_parent_pid->host_pid());
     // printf("Updated PIDs: self: qnx=%d host=%d\n", m_my_pid->qnx_pid(), m_my_pid->host_pid());
 }
 
+void Process::update_pids_for_client(pid_t client) {
+    m_parent_pid = m_pids.alloc_related_pid(client, QnxPid::Type::ROOT_PARENT);
+    m_my_pid = m_pids.alloc_related_pid(getpid(), QnxPid::Type::SELF);
+    m_negative_cache.clear();
+}
+
 Qnx::pid_t Process::pid() const
 {
     return m_my_pid->qnx_pid();
@@ -212,11 +318,17 @@ const std::vector<std::string>& Process::self_call() const {
 
 void Process::enter_emu()
 {
+    m_time.start();
     m_emu.enter_emu();
 }
 
 void* Process::translate_segmented(FarPointer ptr, uint32_t size, RwOp write)
 {
+    void *p = m_selector_cache.translate(ptr.m_segment, ptr.m_offset, size);
+    if (p) {
+        return p;
+    }
+
     auto sd = descriptor_by_selector(ptr.m_segment);
     if (!sd)
         throw SegmentationFault("segment not present");
@@ -224,8 +336,12 @@ void* Process::translate_segmented(FarPointer ptr, uint32_t size, RwOp write)
     if (!sd->segment()->check_bounds(ptr.m_offset, size))
         throw SegmentationFault("address out of segment bounds");
 
-    // TODO: write check not implemented
-    
+    if (sd->segment() == m_time_segment) {
+        // not cached, a forked child arms the segment again
+        m_time.wake();
+    } else {
+        m_selector_cache.fill(ptr.m_segment, *sd);
+    }
     return sd->segment()->pointer(ptr.m_offset, size);
 }
 
@@ -261,9 +377,15 @@ SegmentDescriptor* Process::descriptor_by_selector(uint16_t id) {
 }
 
 void Process::free_segment_descriptor(SegmentDescriptor *sd) {
+    segment_changed(sd->selector());
     m_segment_descriptors.free(sd->id());
 }
 
+void Process::segment_changed(uint16_t sel) {
+    m_selector_cache.invalidate(sel);
+    m_emu.segment_changed(sel);
+}
+
 void Process::set_errno(int v) {
     m_magic->Errno = v;
 }
@@ -275,7 +397,20 @@ void Process::setup_magic(SegmentDescriptor *data_sd, StartupSbrk& alloc)
     alloc.alloc(sizeof(Qnx::Magic));
     m_magic_guest_pointer = data_sd->pointer(alloc.offset());
     m_magic = reinterpret_cast<Qnx::Magic*>(alloc.ptr());
-    
+    create_magic_pointer();
+
+    for (size_t i = 0; i < sizeof(*m_magic) / 4; i++) {
+        // this helps us identify the values we filled out wrong down the line
+        *(reinterpret_cast<uint32_t*>(m_magic) + i) = 0xDEADBE00 + i;
+    }
+
+    m_magic->my_pid = pid();
+    m_magic->dads_pid = parent_pid();
+    m_magic->my_nid = nid();
+}
+
+void Process::create_magic_pointer()
+{
     /* Now create the magical segment that will be pointing to magic */
     m_magic_pointer = allocate_segment();
     m_magic_pointer->reserve(MemOps::PAGE_SIZE);
@@ -287,15 +422,6 @@ void Process::setup_magic(SegmentDescriptor *data_sd, StartupSbrk& alloc)
      * so we will fake it in emu 
      */
     create_segment_descriptor_at(Access::READ_ONLY, m_magic_pointer, B32, SegmentDescriptor::sel_to_id(Qnx::MAGIC_PTR_SELECTOR));
-
-    for (size_t i = 0; i < sizeof(*m_magic) / 4; i++) {
-        // this helps us identify the values we filled out wrong down the line
-        *(reinterpret_cast<uint32_t*>(m_magic) + i) = 0xDEADBE00 + i;
-    }
-
-    m_magic->my_pid = pid();
-    m_magic->dads_pid = parent_pid();
-    m_magic->my_nid = nid();
 }
 
 void Process::setup_magic16(SegmentDescriptor *data_sd, StartupSbrk& alloc)
@@ -328,8 +454,33 @@ void Process::setup_magic16(SegmentDescriptor *data_sd, StartupSbrk& alloc)
     m_magic16->sptrs[Qnx::SPTRS16_SLIB16PTR] = FarPointer16(m_load_slib.cs, m_slib_entry);
 }
 
+bool Process::handle_msg_fast(size_t send_parts, FarPointer send, size_t rcv_parts, FarPointer rcv)
+{
+    // the message logs and the result cache recording are only implemented in the full path
+    if (m_bits != B32 || Log::enabled(Log::MSG) || Log::enabled(Log::MSG_REPLY) || m_result_cache.recording()) {
+        return false;
+    }
+
+    FlatMsg msg;
+    try {
+        if (!msg.resolve(this, send_parts, send, rcv_parts, rcv)) {
+            return false;
+        }
+    } catch (const SegmentationFault&) {
+        // the full path only faults if the bad part is really used
+        return false;
+    }
+
+    if (!m_main_handler.receive_fast(*this, msg)) {
+        return false;
+    }
+    stat_msg_fast.inc();
+    return true;
+}
+
 void Process::handle_msg(MsgContext& m)
 {
+    stat_msg_full.inc();
     auto& msg = m.msg();
     Qnx::MsgHeader hdr;
     msg.read_type(&hdr);
@@ -383,6 +534,9 @@ void Process::handle_msg(MsgContext& m)
 
     // meat of the function
     m_main_handler.receive(m);
+    if (m.m_consumed) {
+        return;
+    }
 
     Log::if_enabled(Log::MSG_REPLY, [&](FILE *s) {
         find_msg();
@@ -403,21 +557,14 @@ void Process::push_pointer_block(const std::vector<GuestPtr>& block) {
 }
 
 void Process::update_timesel() {
-    auto t = reinterpret_cast<Qnx::timesel*>(m_time_segment->pointer(0, sizeof(Qnx::timesel)));
-    Timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
-    t->cnt8254 = 0;
-    t->seconds = now.tv_sec;
-    t->nsec = now.tv_nsec;
-    t->nsec_inc = 0;
-    t->cycles_per_sec = 1000;
-    int64_t cycles = static_cast<int64_t>(t->seconds) * 1000 + static_cast<int64_t>(now.tv_nsec) / 1000 / 1000;
-    t->cycle_lo = cycles;
-    t->cycle_hi = cycles >> 32;
+    if (m_time.refresh_on_syscall()) {
+        m_time.refresh();
+    }
 }
 
 void Process::setup_startup_context(int argc, char **argv)
 {
+    Stats::Timer timer(stat_setup_ns);
     auto& ctx = m_startup_context;
     if (m_load_exec.entry == 0 || m_load_exec.cs == 0 || m_load_exec.ds == 0) {
         throw GuestStateException("Loading incomplete");
@@ -429,30 +576,67 @@ void Process::setup_startup_context(int argc, char **argv)
     ctx.reg_es() = m_load_exec.ds;
     ctx.reg_fs() = m_load_exec.ds;
 
-    ctx.reg_esp() = m_load_exec.stack_low + m_load_exec.stack_size;
-    ctx.reg_edx() = m_load_exec.stack_low;
-    ctx.reg_ebp() = pid();
-
     auto data_sd = descriptor_by_selector(m_load_exec.ss);
     if (!data_sd) {
         throw GuestStateException("Guest does not seem to be loaded properly (no data segment)");
     }
 
-    auto data_seg = data_sd->segment();
-    auto alloc = StartupSbrk(data_seg.get(), m_load_exec.heap_start);
+    auto alloc = StartupSbrk(data_sd->segment().get(), m_load_exec.heap_start);
     if (m_bits == B16) {
         setup_magic16(data_sd, alloc);
     } else {
         setup_magic(data_sd, alloc);
     }
 
-    /* Create time segment so that we do not crash, but we do not fill the time yet */
-    // TODO: make the segment non-accessible and enable signal if some is reading it
+    /* An in-process exec keeps the existing time segment */
+    if (!m_time_segment) {
+        create_time_segment(std::nullopt);
+    }
+
+    setup_startup_args(data_sd, alloc, argc, argv);
+
+    /* Entry points*/
+    if (!slib_loaded() || m_bits == B16) {
+        ctx.reg_cs() = m_load_exec.cs;
+        ctx.reg_eip() = m_load_exec.entry;
+        Log::print(Log::LOADER, "Program start: %x:%x\n", m_load_exec.cs, m_load_exec.entry);
+    } else {
+        ctx.reg_cs() = m_load_slib.cs;
+        ctx.reg_eip() = m_slib_entry;
+        ctx.push_stack(m_load_exec.cs);
+        ctx.push_stack(m_load_exec.entry);
+        Log::print(Log::LOADER, "Slib start: %x:%x\n", m_load_slib.cs, m_slib_entry);
+        Log::print(Log::LOADER, "Program start: %x:%x\n", m_load_exec.cs, m_load_exec.entry);
+    }
+
+    // ctx.dump(stdout);
+
+    // breakpoints
+    //ctx.write<uint8_t>(Context::CS, 0x61e , 0xCC);
+}
+
+/* Create time segment, it is kept up to date by m_time */
+void Process::create_time_segment(std::optional<SegmentId> id) {
     m_time_segment = allocate_segment();
     m_time_segment->reserve(MemOps::PAGE_SIZE);
     m_time_segment->grow_bytes(sizeof(Qnx::timesel));
+    m_time.attach(reinterpret_cast<Qnx::timesel*>(m_time_segment->pointer(0, sizeof(Qnx::timesel))));
+
+    if (id) {
+        m_time_segment_selector = create_segment_descriptor_at(Access::READ_ONLY, m_time_segment, B32, *id)->id();
+    } else {
+        m_time_segment_selector = create_segment_descriptor(Access::READ_ONLY, m_time_segment, B32)->id();
+    }
+}
+
+void Process::setup_startup_args(SegmentDescriptor *data_sd, StartupSbrk& alloc, int argc, char **argv)
+{
+    auto& ctx = m_startup_context;
+    auto data_seg = data_sd->segment();
 
-    m_time_segment_selector =  create_segment_descriptor(Access::READ_ONLY, m_time_segment, B32)->id();
+    ctx.reg_esp() = m_load_exec.stack_low + m_load_exec.stack_size;
+    ctx.reg_edx() = m_load_exec.stack_low;
+    ctx.reg_ebp() = pid();
 
     /* Now create spawn message and the stack environment, that is argc, argv, arge  */
     /* in 32bit mode, the stack is prepared and there are more things passed on stack as "arguments",
@@ -510,14 +694,14 @@ void Process::setup_startup_context(int argc, char **argv)
     const char *env_cwd_key = "__CWD=";
     const char *env_pfx_key = "__PFX=";
 
-    for (char **e = environ; *e; e++) {
+    for (char **e = environ; e && *e; e++) {
         if (starts_with(*e, env_cwd_key))
             env_cwd = *e;
         if (starts_with(*e,  env_pfx_key))
             env_pfx = *e;
     }
 
-    for (char **e = environ; *e; e++) {
+    for (char **e = environ; e && *e; e++) {
         if (starts_with(*e, env_cwd_key))
             continue;
         if (starts_with(*e,  env_pfx_key))
@@ -557,23 +741,6 @@ void Process::setup_startup_context(int argc, char **argv)
         ctx.push_stack(argv_offsets.size());
     }
 
-    /* Entry points*/
-    if (!slib_loaded() || m_bits == B16) {
-        ctx.reg_cs() = m_load_exec.cs;
-        ctx.reg_eip() = m_load_exec.entry;
-        Log::print(Log::LOADER, "Program start: %x:%x\n", m_load_exec.cs, m_load_exec.entry);
-    } else {
-        ctx.reg_cs() = m_load_slib.cs;
-        ctx.reg_eip() = m_slib_entry;
-        auto e = &m_load_exec.entry;
-        if (stack_env) {
-            ctx.push_stack(m_load_exec.cs);
-            ctx.push_stack(m_load_exec.entry);
-        }
-        Log::print(Log::LOADER, "Slib start: %x:%x\n", m_load_slib.cs, m_slib_entry);
-        Log::print(Log::LOADER, "Program start: %x:%x\n", m_load_exec.cs, m_load_exec.entry);
-    }
-
     data_sd->update_descriptors();
 
     /* What we have allocated (curbrk)*/
@@ -588,9 +755,4 @@ void Process::setup_startup_context(int argc, char **argv)
              ctx.reg_ds(), ctx.reg_ebx(), ctx.reg_ecx()
         );
     });
-
-    // ctx.dump(stdout);
-
-    // breakpoints
-    //ctx.write<uint8_t>(Context::CS, 0x61e , 0xCC);
 }
\ No newline at end of file
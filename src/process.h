@@ -16,6 +16,7 @@
 #include "emu.h"
 #include "main_handler.h"
 #include "msg_handler.h"
+#include "native_tools.h"
 #include "path_mapper.h"
 #include "qnx/magic.h"
 #include "qnx/procenv.h"
@@ -24,10 +25,17 @@
 #include "types.h"
 #include "intrusive_list.h"
 #include "idmap.h"
+#include "image_cache.h"
+#include "negative_cache.h"
 #include "qnx_fd.h"
 #include "qnx_pid.h"
+#include "result_cache.h"
 #include "segment_descriptor.h"
+#include "selector_cache.h"
+#include "snapshot.h"
 #include "loader.h"
+#include "scratch_arena.h"
+#include "time_segment.h"
 
 class Segment;
 class MsgContext;
@@ -38,6 +46,7 @@ class Process{
     friend class Emu;
     friend class GuestContext;
     friend class MainHandler;
+    friend class Snapshot;
 public:
     static inline Process* current();
     static Process* create();
@@ -46,6 +55,8 @@ public:
     void initialize_self_call(std::vector<std::string>&& self_call);
 
     void update_pids_after_fork(pid_t new_pid);
+    /* For a zygote child, which pretends to be the child of the client */
+    void update_pids_for_client(pid_t client);
 
     std::shared_ptr<Segment> allocate_segment();
     SegmentDescriptor* create_segment_descriptor(Access access, const std::shared_ptr<Segment>& mem, Bitness bits);
@@ -56,13 +67,20 @@ public:
     FdMap& fds() {return m_fds;}
     PidMap& pids() {return m_pids;}
     PathMapper& path_mapper() {return m_path_mapper;}
+    NativeTools& native_tools() {return m_native_tools;}
 
+    /* Called on each kernel call exit */
     void update_timesel();
+    TimeSegment& time_segment() { return m_time; }
+    /* Short-lived allocations of the current kernel call */
+    ScratchArena& scratch() { return m_scratch; }
 
     void setup_startup_context(int argc, char **argv);
     void enter_emu();
 
     void handle_msg(MsgContext& m);
+    /* Fast path for hot I/O messages. Returns false if the message must go through handle_msg. */
+    bool handle_msg_fast(size_t send_parts, FarPointer send, size_t rcv_parts, FarPointer rcv);
 
     Qnx::pid_t pid() const;
     Qnx::pid_t parent_pid() const;
@@ -72,6 +90,23 @@ public:
     // Path must be resolved in both host & qnx
     void load_executable(const PathInfo& path);
     bool slib_loaded() const { return m_slib_entry != 0; }
+    ImageCache& image_cache() { return m_image_cache; }
+    ResultCache& result_cache() { return m_result_cache; }
+    NegativeCache& negative_cache() { return m_negative_cache; }
+    Snapshot& snapshot() { return m_snapshot; }
+
+    /* Can the executable be loaded into this process, i.e. is it an LMF of the same bitness */
+    bool exec_loadable(const PathInfo& path);
+    void disable_exec_in_process() { m_exec_in_process = false; }
+    /* Would exec_in_process take the executable, as far as can be told without loading it */
+    bool exec_in_process_possible(const PathInfo& path);
+    /*
+     * Replace the running executable with another one inside this host process, keeping the Slib, fds and pids.
+     * Only if exec_in_process_possible. There is no way back: ctx continues in the new image, or the process
+     * exits if it does not load.
+     */
+    void exec_in_process(const PathInfo& path, const ScratchVector<const char*>& argv,
+        const ScratchVector<const char*>& env, GuestContext& ctx, bool forked);
     const std::vector<std::string>& self_call() const;
     const PathInfo& executed_file() const;
     Emu& emu() { return m_emu; }
@@ -87,12 +122,21 @@ private:
 
     SegmentDescriptor* descriptor_by_selector(uint16_t id);
     void free_segment_descriptor(SegmentDescriptor *sd);
+    /* Must be called when a descriptor changes (access, size) */
+    void segment_changed(uint16_t sel);
     void push_pointer_block(const std::vector<GuestPtr>& block);
 
     void setup_magic(SegmentDescriptor *data_sd, StartupSbrk& alloc);
     void setup_magic16(SegmentDescriptor *data_sd, StartupSbrk& alloc);
+    /* Publish m_magic_guest_pointer under the magic selector */
+    void create_magic_pointer();
+    void create_time_segment(std::optional<SegmentId> id);
+    /* The spawn message, arguments and environment after alloc, the stack block and the registers describing them */
+    void setup_startup_args(SegmentDescriptor *data_sd, StartupSbrk& alloc, int argc, char **argv);
     void initialize();
     void initialize_pids();
+    /* Free everything belonging to the executable, keeping the Slib and the time segment */
+    void release_image();
 
     static Process* m_current;
 
@@ -104,17 +148,25 @@ private:
     LoadInfo m_load_exec;
     LoadInfo m_load_slib;
     uint32_t m_slib_entry;
+    std::string m_slib_path;
     Bitness m_bits;
+    bool m_exec_in_process;
+    ImageCache m_image_cache;
+    ResultCache m_result_cache;
+    NegativeCache m_negative_cache;
+    Snapshot m_snapshot;
 
     // memory
     IntrusiveList::List<Segment> m_segments;
     IdMap<SegmentDescriptor> m_segment_descriptors;
+    SelectorCache m_selector_cache;
     
     // "outsourced" components
     Emu m_emu;
     FdMap m_fds;
     MainHandler m_main_handler;
     PathMapper m_path_mapper;
+    NativeTools m_native_tools;
 
     // pids
     PidMap m_pids;
@@ -129,8 +181,11 @@ private:
 
     std::shared_ptr<Segment> m_time_segment;
     SegmentId m_time_segment_selector;
+    TimeSegment m_time;
+    ScratchArena m_scratch;
 
     Qnx::Sigtab *m_sigtab;
+    FarPointer m_sigtab_guest_pointer;
 
     // Self info
     PathInfo m_executed_file;
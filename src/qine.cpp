@@ -9,6 +9,9 @@
 #include "fsutil.h"
 #include "process.h"
 #include "log.h"
+#include "stats.h"
+#include "util.h"
+#include "zygote.h"
 
 static void handle_log_opt(const char *opt) {
     bool enable = true;
@@ -35,11 +38,23 @@ static void handle_help() {
 
 
 int opt_no_slib;
+int opt_load_only;
 
 namespace Opt {
     enum {
         EXEC = 200,
         TERM_EMU,
+        SYSCALL_GATE,
+        TIMESEL_RATE,
+        NO_FAST_MSG,
+        NO_INPROC_EXEC,
+        ZYGOTE,
+        IMAGE_CACHE,
+        SNAPSHOT,
+        SNAPSHOT_SAVE,
+        NATIVE_TOOLS,
+        RESULT_CACHE,
+        NEGATIVE_CACHE,
     };
 }
 
@@ -50,7 +65,19 @@ static struct option cmd_options[] = {
     {"map", required_argument, 0, 'm'},
     {"lib", required_argument, 0, 'l'},
     {"no-slib", no_argument, &opt_no_slib, 1},
+    {"load-only", no_argument, &opt_load_only, 1},
     {"exec", required_argument, 0, Opt::EXEC},
+    {"syscall-gate", no_argument, 0, Opt::SYSCALL_GATE},
+    {"timesel-rate", required_argument, 0, Opt::TIMESEL_RATE},
+    {"no-fast-msg", no_argument, 0, Opt::NO_FAST_MSG},
+    {"no-inproc-exec", no_argument, 0, Opt::NO_INPROC_EXEC},
+    {"zygote", required_argument, 0, Opt::ZYGOTE},
+    {"image-cache", required_argument, 0, Opt::IMAGE_CACHE},
+    {"snapshot", required_argument, 0, Opt::SNAPSHOT},
+    {"snapshot-save", required_argument, 0, Opt::SNAPSHOT_SAVE},
+    {"native-tools", required_argument, 0, Opt::NATIVE_TOOLS},
+    {"result-cache", required_argument, 0, Opt::RESULT_CACHE},
+    {"negative-cache", no_argument, 0, Opt::NEGATIVE_CACHE},
 };
 
 
@@ -62,6 +89,11 @@ int main(int argc, char **argv) {
     // we only want to set debugs settings and maps during init, then do the rest
     std::vector<std::function<void()>> delayed_args;
     std::string opt_exec;
+    std::string opt_zygote;
+    bool opt_term_emu = false;
+    std::string opt_snapshot;
+    std::string opt_snapshot_save;
+    std::vector<std::string> lib_args;
 
     try {
         for (;;) {
@@ -80,6 +112,7 @@ int main(int argc, char **argv) {
                     break;
                 case 'l':
                     delayed_args.push_back([proc, this_optarg] {proc->load_library(this_optarg); });
+                    lib_args.push_back(this_optarg);
                     break;
                 case 'h':
                     handle_help();
@@ -95,8 +128,48 @@ int main(int argc, char **argv) {
                     opt_exec = optarg;
                     break;
                 case Opt::TERM_EMU:
-                    proc->attach_term_emu();
+                    opt_term_emu = true;
                     break;
+                case Opt::SYSCALL_GATE:
+                    proc->emu().enable_syscall_gate();
+                    break;
+                case Opt::NO_FAST_MSG:
+                    proc->emu().disable_fast_msg();
+                    break;
+                case Opt::NO_INPROC_EXEC:
+                    proc->disable_exec_in_process();
+                    break;
+                case Opt::ZYGOTE:
+                    opt_zygote = optarg;
+                    break;
+                case Opt::SNAPSHOT:
+                    opt_snapshot = optarg;
+                    break;
+                case Opt::SNAPSHOT_SAVE:
+                    opt_snapshot_save = optarg;
+                    break;
+                case Opt::NATIVE_TOOLS:
+                    proc->native_tools().load(std::filesystem::absolute(optarg).c_str());
+                    break;
+                case Opt::RESULT_CACHE:
+                    proc->result_cache().configure(optarg);
+                    break;
+                case Opt::NEGATIVE_CACHE:
+                    proc->negative_cache().enable();
+                    break;
+                case Opt::IMAGE_CACHE:
+                    proc->image_cache().set_directory(std::filesystem::absolute(optarg).c_str());
+                    break;
+                case Opt::TIMESEL_RATE: {
+                    char *end;
+                    long rate = strtol(optarg, &end, 10);
+                    if (*end || rate < 0 || rate > 100000) {
+                        fprintf(stderr, "Invalid time segment refresh rate: %s\n", optarg);
+                        exit(1);
+                    }
+                    proc->time_segment().set_rate(rate);
+                    break;
+                }
                 default:
                     fprintf(stderr, "getopt unknown code 0x%x\n", c);
                     exit(1);
@@ -104,12 +177,51 @@ int main(int argc, char **argv) {
         }
 
         proc->initialize_2();
+        Stats::print_at_exit();
 
         /* Remember all the arguments in case Qine needs to exec itself (to run another QNX binary) */
         std::vector<std::string> self_call;
         for (int i = 0; i < optind; i++) {
             if (strcmp(argv[i], "--") == 0)
                 continue;
+            /* the processes forked by the zygote must not become zygotes when they exec qine,
+             * and the snapshots belong to the first program only */
+            bool skip = false;
+            for (auto opt: {"--zygote", "--snapshot", "--snapshot-save"}) {
+                if (strcmp(argv[i], opt) == 0) {
+                    i++;
+                    skip = true;
+                    break;
+                }
+                if (starts_with(argv[i], opt) && argv[i][strlen(opt)] == '=') {
+                    skip = true;
+                    break;
+                }
+            }
+            if (skip)
+                continue;
+            /* the exec'd qine may start in another directory, so relative paths are made absolute */
+            auto absolute_arg = [](const char *opt, std::string value) {
+                // the result cache directory is followed by its options
+                size_t end = strcmp(opt, "--result-cache") == 0 ? value.find(',') : std::string::npos;
+                std::string rest = end == std::string::npos ? "" : value.substr(end);
+                return std::filesystem::absolute(value.substr(0, end)).string() + rest;
+            };
+            for (auto opt: {"--native-tools", "--image-cache", "--result-cache"}) {
+                if (strcmp(argv[i], opt) == 0 && i + 1 < optind) {
+                    self_call.push_back(argv[i++]);
+                    self_call.push_back(absolute_arg(opt, argv[i]));
+                    skip = true;
+                    break;
+                }
+                if (starts_with(argv[i], opt) && argv[i][strlen(opt)] == '=') {
+                    self_call.push_back(std::string(opt) + "=" + absolute_arg(opt, argv[i] + strlen(opt) + 1));
+                    skip = true;
+                    break;
+                }
+            }
+            if (skip)
+                continue;
             self_call.push_back(argv[i]);
         }
         self_call[0] = std::filesystem::absolute(self_call[0]);
@@ -123,6 +235,31 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* The zygote loads the libraries once and then forks a child for each request, which continues below */
+    std::vector<std::string> zygote_args;
+    std::vector<char*> zygote_argv;
+    if (!opt_zygote.empty()) {
+        try {
+            for (auto d: delayed_args)
+                d();
+            delayed_args.clear();
+            Zygote::serve(proc, opt_zygote.c_str(), zygote_args);
+        } catch (const ConfigurationError& e) {
+            fprintf(stderr, "%s\n", e.m_msg.c_str());
+            return 1;
+        }
+        for (auto& a: zygote_args) {
+            zygote_argv.push_back(a.data());
+        }
+        zygote_argv.push_back(nullptr);
+        argc = zygote_args.size();
+        argv = zygote_argv.data();
+    }
+    /* after the zygote, whose children each get the stdio of their client */
+    if (opt_term_emu) {
+        proc->attach_term_emu();
+    }
+
     if (argc == 0 && opt_exec.empty()) {
         fprintf(stderr, "program arguments expected\n");
         return 1;
@@ -138,6 +275,28 @@ int main(int argc, char **argv) {
         Fsutil::realpath(argv[0], abspath);
         exec_path = proc->path_mapper().map_path_to_qnx(abspath.c_str());
     }
+
+    if (!opt_zygote.empty() && !proc->exec_loadable(exec_path)) {
+        /* The zygote only has the 32-bit Slib, let a fresh qine handle the rest (and report the errors) */
+        std::vector<const char*> qine_argv;
+        for (const auto& a: proc->self_call()) {
+            qine_argv.push_back(a.c_str());
+        }
+        qine_argv.push_back("--");
+        for (int i = 0; i < argc; i++) {
+            qine_argv.push_back(argv[i]);
+        }
+        qine_argv.push_back(nullptr);
+        FdMap::ChildFdLimit limit;
+        execv(qine_argv[0], const_cast<char**>(qine_argv.data()));
+        perror("exec qine");
+        return 127;
+    }
+    proc->result_cache().begin(exec_path, argc, argv);
+    if (!opt_snapshot.empty() && proc->snapshot().restore(opt_snapshot.c_str(), exec_path, lib_args, argc, argv)) {
+        proc->enter_emu();
+    }
+
     proc->load_executable(exec_path);
 
     /* loading of libraries*/
@@ -150,7 +309,21 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    /* For benchmarking the loader */
+    if (opt_load_only) {
+        return 0;
+    }
+
     proc->setup_startup_context(argc, argv);
 
+    if (!opt_snapshot_save.empty()) {
+        try {
+            proc->snapshot().arm(opt_snapshot_save.c_str(), exec_path, lib_args);
+        } catch (const ConfigurationError& e) {
+            fprintf(stderr, "%s\n", e.m_msg.c_str());
+            return 1;
+        }
+    }
+
     proc->enter_emu();
 }
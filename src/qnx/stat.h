@@ -21,4 +21,7 @@ namespace Qnx {
     static constexpr int QS_QNX_SPECIAL = 040000;          /*  QNX special type                */
     static constexpr int QS_QNX_MQUEUE = 020000;
 
+    /* st_status */
+    static constexpr int FILE_USED = 0x01;               /*  The stat of a dirent is valid   */
+
 }
\ No newline at end of file
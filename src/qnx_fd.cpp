@@ -2,7 +2,14 @@
 #include "log.h"
 #include "unique_fd.h"
 #include "fd_filter.h"
+#include <climits>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <string.h>
@@ -10,7 +17,7 @@
 #include <unistd.h>
 #include <unordered_map>
 
-FdMap::FdMap(): m_fds(1024*16) {
+FdMap::FdMap(): m_fds(MAX_FDS) {
 }
 
 FdMap::~FdMap() {
@@ -41,6 +48,220 @@ void FdMap::scan_host_fds(Qnx::nid_t nid, Qnx::pid_t pid, Qnx::pid_t vid) {
     closedir(fd_dir);
 }
 
+void FdMap::rescan_host_fd(Qnx::fd_t fd, Qnx::nid_t nid, Qnx::pid_t pid, Qnx::pid_t vid) {
+    m_fds.erase(fd);
+    if (fcntl(fd, F_GETFD) < 0) {
+        return;
+    }
+    auto fdi = m_fds.alloc_exactly_at(fd, [=] (int fd) { return new QnxFd(fd, nid, pid, vid, 0);});
+    fdi->m_open = true;
+    fdi->m_host_fd = fdi->m_fd;
+    Log::print(Log::FD, "rescanned fd %d\n", fd);
+}
+
+std::optional<rlim_t> FdMap::s_child_fd_limit;
+
+UniqueFd FdMap::move_internal(UniqueFd&& fd) {
+    int moved = fcntl(fd.get(), F_DUPFD_CLOEXEC, MAX_FDS);
+    if (moved < 0 && errno == EINVAL) {
+        struct rlimit lim;
+        if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+            if (!s_child_fd_limit) {
+                s_child_fd_limit = lim.rlim_cur;
+            }
+            lim.rlim_cur = lim.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &lim);
+            moved = fcntl(fd.get(), F_DUPFD_CLOEXEC, MAX_FDS);
+        }
+    }
+    if (moved < 0) {
+        Log::print(Log::FD, "cannot move internal fd %d: %s\n", fd.get(), strerror(errno));
+    }
+    fd.close();
+    return UniqueFd(moved);
+}
+
+int FdMap::set_fd_limit(struct rlimit lim) {
+    struct rlimit cur;
+    if (s_child_fd_limit && getrlimit(RLIMIT_NOFILE, &cur) == 0) {
+        // ours stays raised as far as the hard limit allows
+        s_child_fd_limit = lim.rlim_cur;
+        lim.rlim_cur = std::max(lim.rlim_cur, std::min(cur.rlim_cur, lim.rlim_max));
+    }
+    return setrlimit(RLIMIT_NOFILE, &lim);
+}
+
+FdMap::ChildFdLimit::ChildFdLimit(): m_raised(RLIM_INFINITY) {
+    struct rlimit lim;
+    if (s_child_fd_limit && getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur > *s_child_fd_limit) {
+        // the internal FDs above the limit stay valid
+        m_raised = lim.rlim_cur;
+        lim.rlim_cur = *s_child_fd_limit;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+}
+
+FdMap::ChildFdLimit::~ChildFdLimit() {
+    struct rlimit lim;
+    if (m_raised != RLIM_INFINITY && getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = m_raised;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+}
+
+namespace {
+    struct TableHeader {
+        uint32_t magic;
+        uint32_t count;
+    };
+
+    struct TableEntry {
+        int32_t fd;
+        Qnx::nid_t nid;
+        Qnx::mpid_t pid;
+        Qnx::mpid_t vid;
+        uint16_t flags;
+        uint16_t path_len;
+        uint32_t handle;
+        // followed by the QNX path, path_len bytes without the terminator
+    };
+
+    constexpr uint32_t TABLE_MAGIC = 0x31544651; /* QFT1 */
+    // keep the memfd away from the FDs a spawn redirects
+    constexpr int TABLE_MIN_FD = 10;
+}
+
+void FdMap::materialize_for_exec(const uint8_t *redirects, size_t redirect_count) {
+    for (size_t i = 0; (i = m_fds.search(i, true)) != IdMap<QnxFd>::INVAL; i++) {
+        auto fd = m_fds[i];
+        if (fd->m_open && fd->m_path_only && !fd->is_close_on_exec()) {
+            fd->materialize();
+        }
+    }
+    for (size_t to = 0; to < redirect_count; to++) {
+        auto src = redirects[to] == 0xFF ? nullptr : m_fds[redirects[to]];
+        if (src && src->m_open && src->m_path_only) {
+            src->materialize();
+        }
+    }
+}
+
+UniqueFd FdMap::export_table(const uint8_t *redirects, size_t redirect_count) {
+    std::string buf(sizeof(TableHeader), 0);
+    TableHeader hdr{TABLE_MAGIC, 0};
+
+    auto push = [&](int fd, const QnxFd *src, uint16_t flags) {
+        std::string path = src->m_path.qnx_valid() ? src->m_path.qnx_path() : "";
+        TableEntry e{fd, src->m_nid, src->m_pid, src->m_vid, flags, static_cast<uint16_t>(path.size()), src->m_handle};
+        buf.append(reinterpret_cast<const char*>(&e), sizeof(e));
+        buf.append(path);
+        hdr.count++;
+    };
+    auto redirect_of = [&](size_t fd) {
+        return fd < redirect_count ? redirects[fd] : 0xFF;
+    };
+
+    for (size_t i = 0; (i = m_fds.search(i, true)) != IdMap<QnxFd>::INVAL; i++) {
+        auto fd = m_fds[i];
+        if (!fd->m_open || redirect_of(i) != 0xFF) {
+            continue;
+        }
+        if (fd->m_path_only && (fd->is_close_on_exec() || !fd->materialize())) {
+            continue;
+        }
+        int flags = fcntl(fd->m_host_fd, F_GETFD);
+        if (flags < 0 || (flags & FD_CLOEXEC)) {
+            continue;
+        }
+        push(i, fd, fd->m_flags);
+    }
+    for (size_t to = 0; to < redirect_count; to++) {
+        if (redirect_of(to) == 0xFF) {
+            continue;
+        }
+        auto src = m_fds[redirects[to]];
+        // the spawned program gets a real FD
+        if (src && src->m_open && (!src->m_path_only || src->materialize())) {
+            // like redirect_for_exec, the copy does not inherit the flags
+            push(to, src, to == redirects[to] ? src->m_flags : 0);
+        }
+    }
+    memcpy(buf.data(), &hdr, sizeof(hdr));
+
+    UniqueFd memfd(memfd_create("qine-fds", MFD_ALLOW_SEALING | MFD_CLOEXEC));
+    if (!memfd.valid() || write(memfd.get(), buf.data(), buf.size()) != static_cast<ssize_t>(buf.size())
+        || fcntl(memfd.get(), F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        Log::print(Log::FD, "cannot export fd table: %s\n", strerror(errno));
+        return UniqueFd();
+    }
+    UniqueFd inheritable(fcntl(memfd.get(), F_DUPFD, TABLE_MIN_FD));
+    Log::print(Log::FD, "exported %u fds as fd %d\n", hdr.count, inheritable.get());
+    return inheritable;
+}
+
+bool FdMap::import_table() {
+    const char *env = getenv(TABLE_ENV);
+    if (!env) {
+        return false;
+    }
+    // the variable may be stale or forged, only take an open FD that cannot be stdio
+    char *end;
+    errno = 0;
+    long n = strtol(env, &end, 10);
+    bool valid = errno == 0 && end != env && *end == 0 && n >= 3 && n < INT_MAX && fcntl(n, F_GETFD) >= 0;
+    unsetenv(TABLE_ENV);
+    if (!valid) {
+        Log::print(Log::FD, "invalid fd table fd\n");
+        return false;
+    }
+    UniqueFd memfd(n);
+
+    struct stat st;
+    if (fstat(memfd.get(), &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(TableHeader)) {
+        Log::print(Log::FD, "invalid fd table\n");
+        return false;
+    }
+    std::string buf(st.st_size, 0);
+    TableHeader hdr;
+    if (pread(memfd.get(), buf.data(), buf.size(), 0) != st.st_size) {
+        return false;
+    }
+    memcpy(&hdr, buf.data(), sizeof(hdr));
+    if (hdr.magic != TABLE_MAGIC) {
+        Log::print(Log::FD, "invalid fd table\n");
+        return false;
+    }
+
+    size_t pos = sizeof(hdr);
+    for (uint32_t n = 0; n < hdr.count; n++) {
+        TableEntry e;
+        if (pos + sizeof(e) > buf.size()) {
+            break;
+        }
+        memcpy(&e, buf.data() + pos, sizeof(e));
+        pos += sizeof(e);
+        if (pos + e.path_len > buf.size()) {
+            break;
+        }
+        std::string path(buf.data() + pos, e.path_len);
+        pos += e.path_len;
+
+        // the table can only describe FDs we really got
+        if (e.fd == memfd.get() || fcntl(e.fd, F_GETFD) < 0 || m_fds[e.fd]) {
+            continue;
+        }
+        auto fdi = m_fds.alloc_exactly_at(e.fd, [&] (int fd) { return new QnxFd(fd, e.nid, e.pid, e.vid, e.flags);});
+        fdi->m_open = true;
+        fdi->m_host_fd = fdi->m_fd;
+        fdi->m_handle = e.handle;
+        if (!path.empty()) {
+            fdi->m_path = PathInfo::mk_qnx_path(path.c_str(), true);
+        }
+        Log::print(Log::FD, "adopted fd %d (%s)\n", e.fd, path.c_str());
+    }
+    return true;
+}
+
 QnxFd *FdMap::fd_query(Qnx::fd_t start) {
     return m_fds[m_fds.search(start, true)];
 }
@@ -126,9 +347,47 @@ bool FdMap::assign_fds(size_t count, QnxFd** to_fds, UniqueFd *host_fds) {
     return true;
 }
 
+bool FdMap::redirect_for_exec(Qnx::fd_t from, Qnx::fd_t to) {
+    auto src = m_fds[from];
+    if (!src || !src->m_open) {
+        errno = EBADF;
+        return false;
+    }
+    if (src->m_path_only && !src->materialize()) {
+        return false;
+    }
+
+    // the target is replaced, including our state for it (dir, filter)
+    m_fds.erase(to);
+    if (dup2(src->m_host_fd, to) < 0) {
+        return false;
+    }
+
+    auto fd = m_fds.alloc_exactly_at(to, [=] (int fd) { return new QnxFd(fd, src->m_nid, src->m_pid, src->m_vid, 0);});
+    fd->m_open = true;
+    fd->m_host_fd = to;
+    fd->m_path = src->m_path;
+    Log::print(Log::FD, "fd %d redirected to %d for exec\n", from, to);
+    return true;
+}
+
+void FdMap::close_on_exec() {
+    for (size_t i = 0; (i = m_fds.search(i, true)) != IdMap<QnxFd>::INVAL; i++) {
+        auto fd = m_fds[i];
+        if (!fd->m_open) {
+            continue;
+        }
+        int flags = fd->m_path_only ? (fd->is_close_on_exec() ? FD_CLOEXEC : 0) : fcntl(fd->m_host_fd, F_GETFD);
+        if (flags >= 0 && (flags & FD_CLOEXEC)) {
+            Log::print(Log::FD, "fd %d closed on exec\n", fd->m_fd);
+            m_fds.erase(i);
+        }
+    }
+}
+
 QnxFd::QnxFd(Qnx::fd_t fd, Qnx::nid_t nid, Qnx::mpid_t pid, Qnx::mpid_t vid, uint16_t flags)
     :m_fd(fd), m_nid(nid), m_pid(pid), m_vid(vid), m_flags(flags),
-    m_handle(0), m_open(false), m_host_fd(0), m_host_dir(NULL)
+    m_handle(0), m_open(false), m_host_fd(0), m_path_only(false), m_path_only_oflags(0)
 
 {}
 
@@ -168,17 +427,43 @@ bool QnxFd::assign_fd(UniqueFd&& tmp_fd) {
     return true;
 }
 
+void QnxFd::assign_path(int oflags) {
+    assert(!m_open);
+    Log::print(Log::FD, "assigned fd %d path-only\n", m_fd);
+    m_open = true;
+    m_path_only = true;
+    m_path_only_oflags = oflags;
+    m_host_fd = -1;
+}
+
+bool QnxFd::materialize() {
+    assert(m_path_only);
+    UniqueFd tmp_fd(::openat(m_path.host_dirfd(), m_path.host_relpath(), m_path_only_oflags));
+    if (!tmp_fd.valid()) {
+        Log::print(Log::FD, "fd %d cannot open %s: %s\n", m_fd, m_path.host_path(), strerror(errno));
+        return false;
+    }
+    m_open = false;
+    m_path_only = false;
+    if (!assign_fd(std::move(tmp_fd))) {
+        m_open = true;
+        m_path_only = true;
+        return false;
+    }
+    return true;
+}
+
+int QnxFd::path_at_flags() const {
+    return (m_path_only_oflags & O_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0;
+}
+
 bool QnxFd::close() {
     assert(m_open);
     Log::print(Log::FD, "fd %d close\n", m_fd);
-    int r;
-    if (m_host_dir) {
-        r = closedir(m_host_dir);
-    } else {
-        r = ::close(m_host_fd);
-    }
+    int r = m_path_only ? 0 : ::close(m_host_fd);
     m_open = false;
-    m_host_dir = NULL;
+    m_path_only = false;
+    m_dir_reader.reset();
     m_host_fd = -1;
     return r >= 0;
 }
@@ -191,9 +476,41 @@ void QnxFd::check_open() {
 }
 
 bool QnxFd::prepare_dir() {
-    if (!m_host_dir) {
-        m_host_dir = fdopendir(m_host_fd);
-        return m_host_dir != nullptr;
+    if (!m_dir_reader) {
+        struct stat st;
+        if (fstat(m_host_fd, &st) < 0) {
+            return false;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            errno = ENOTDIR;
+            return false;
+        }
+        m_dir_reader = std::make_unique<DirReader>();
     }
     return true;
+}
+
+const struct dirent64 *DirReader::next(int fd) {
+    if (m_pos >= m_end) {
+        if (m_buf.empty()) {
+            m_buf.resize(32 * 1024);
+        }
+        ssize_t r = getdents64(fd, m_buf.data(), m_buf.size());
+        if (r <= 0) {
+            if (r == 0) {
+                errno = 0;
+            }
+            return nullptr;
+        }
+        m_pos = 0;
+        m_end = r;
+    }
+    auto d = reinterpret_cast<const struct dirent64*>(m_buf.data() + m_pos);
+    m_pos += d->d_reclen;
+    return d;
+}
+
+bool DirReader::rewind(int fd) {
+    m_pos = m_end = 0;
+    return lseek(fd, 0, SEEK_SET) == 0;
 }
\ No newline at end of file
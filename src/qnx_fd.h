@@ -6,21 +6,61 @@
 #include "unique_fd.h"
 #include "log.h"
 #include <dirent.h>
+#include <sys/resource.h>
 #include <stdexcept>
+#include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 class QnxFd;
 class FdFilter;
 
+/* Entries of a directory FD, read in bulk with getdents64 */
+class DirReader {
+public:
+    /* Next entry, nullptr at the end (errno 0) or on error */
+    const struct dirent64 *next(int fd);
+    /* errno if false */
+    bool rewind(int fd);
+private:
+    std::vector<char> m_buf;
+    size_t m_pos = 0;
+    size_t m_end = 0;
+};
+
 class BadFdException : public std::exception {};
 
 class FdMap {
   public:
+    /* QNX FD numbers are below this */
+    static constexpr int MAX_FDS = 1024 * 16;
+
     FdMap();
     ~FdMap();
 
     // Create entries for existing host FDs at startup
     void scan_host_fds(Qnx::nid_t nid, Qnx::pid_t pid, Qnx::pid_t vid);
+    // Like scan_host_fds for a single FD whose host FD was replaced, drops our state for the previous one
+    void rescan_host_fd(Qnx::fd_t fd, Qnx::nid_t nid, Qnx::pid_t pid, Qnx::pid_t vid);
+
+    /*
+     * The FD table survives the exec of a new qine in a sealed memfd, whose number is passed in TABLE_ENV.
+     * Unlike scan_host_fds, it keeps the QNX information of the FDs.
+     */
+    static constexpr const char *TABLE_ENV = "QINE_FD_TABLE";
+    /*
+     * Write the table as the exec'd program will see it, i.e. without the close-on-exec FDs and with the
+     * optional redirections (`redirects[to] = from`, 0xFF for none) applied. The memfd is inheritable.
+     */
+    UniqueFd export_table(const uint8_t *redirects, size_t redirect_count);
+    /* Adopt the table from TABLE_ENV (and remove it from the environment), false if there is none */
+    bool import_table();
+    /*
+     * Open the host FDs of the path-only FDs a started program gets: the inherited ones and the sources of the
+     * redirections (as for export_table). Those that cannot be opened are left out, like closed FDs.
+     */
+    void materialize_for_exec(const uint8_t *redirects, size_t redirect_count);
 
     // Corresponds to qnx_fd_attach with owner_pid zero. Throws NoFreeId
     QnxFd *qnx_fd_attach(Qnx::fd_t first_fd, Qnx::nid_t nid, Qnx::mpid_t pid,
@@ -31,8 +71,10 @@ class FdMap {
     /* Get an FD, checking that it is open with host FD, otherwise throw badfd
      */
     inline QnxFd *get_open_fd(Qnx::fd_t fdi);
+    /* Like get_open_fd, but a path-only FD stays without a host FD */
+    inline QnxFd *get_open_fd_lazy(Qnx::fd_t fdi);
     /* get_open_fd() -> host_fd*/
-    inline int get_host_fd(Qnx::fd_t fdi) { return fdi; }
+    inline int get_host_fd(Qnx::fd_t fdi);
     /* Get an FD, otherwise throw badfd */
     inline QnxFd *get_attached_fd(Qnx::fd_t fdi);
     /* Finds a query higher or equal than start */
@@ -48,12 +90,36 @@ class FdMap {
      */
     bool assign_fds(size_t count, QnxFd **to_fds, UniqueFd *host_fds);
 
+    /* Make `to` a copy of `from` for the exec'd program, like dup2. errno if false. */
+    bool redirect_for_exec(Qnx::fd_t from, Qnx::fd_t to);
+    /* Close the close-on-exec FDs, for exec within this process */
+    void close_on_exec();
+
+    /*
+     * Renumber a long-lived qine FD to MAX_FDS or above, where the guest cannot dup2 over it and
+     * scan_host_fds does not see it. Raises the soft FD limit if needed, see ChildFdLimit. Invalid on failure.
+     */
+    static UniqueFd move_internal(UniqueFd&& fd);
+    /* Set the FD limit, as the programs we start see it if move_internal raised the soft limit */
+    static int set_fd_limit(struct rlimit lim);
+
+    /* Lowers the soft FD limit raised by move_internal back for the lifetime, around starting a host program */
+    class ChildFdLimit {
+    public:
+        ChildFdLimit();
+        ~ChildFdLimit();
+    private:
+        rlim_t m_raised;
+    };
+
     // The rest of the function exist on QnxFd
   private:
     IdMap<QnxFd> m_fds;
+    /* Soft FD limit of the programs we start, if move_internal raised ours */
+    static std::optional<rlim_t> s_child_fd_limit;
 };
 
-/* Attached FD. Need not be opened FD. Currently we alwayas have a backing host FD*/
+/* Attached FD. Need not be opened FD. An open FD has a backing host FD, unless it is path-only */
 class QnxFd {
   public:
     QnxFd(Qnx::fd_t fd, Qnx::nid_t nid, Qnx::mpid_t pid, Qnx::mpid_t vid,
@@ -63,6 +129,12 @@ class QnxFd {
     // Assign a host fd (after remaping) and mark open.
     // errno if false
     bool assign_fd(UniqueFd &&host_fd);
+    // Mark open as path-only, m_path must be mapped to the host
+    void assign_path(int oflags);
+    // Open the host FD of a path-only FD, errno if false
+    bool materialize();
+    // Flags for the *at functions on m_path of a path-only FD
+    int path_at_flags() const;
     bool close();
     void check_open();
 
@@ -85,19 +157,42 @@ class QnxFd {
     bool m_open;
     // path can be empty for inherited FDs, use resolve_path
     PathInfo m_path;
-    // same as m_fd
+    // same as m_fd, -1 if path-only
     int m_host_fd;
-    // if readdir was used, we allocate DIR*
-    DIR *m_host_dir;
+    /*
+     * io:handle FDs are mostly used for a single chmod, chown, utime, link or stat and closed. They stay
+     * path-only and are opened with m_path_only_oflags when something needs the host FD.
+     */
+    bool m_path_only;
+    int m_path_only_oflags;
+    // if readdir was used
+    std::unique_ptr<DirReader> m_dir_reader;
     std::unique_ptr<FdFilter> m_filter;
 };
 
 QnxFd *FdMap::get_open_fd(Qnx::fd_t fdi) {
+    auto fd = get_open_fd_lazy(fdi);
+    if (fd->m_path_only && !fd->materialize()) {
+        throw BadFdException();
+    }
+    return fd;
+}
+
+QnxFd *FdMap::get_open_fd_lazy(Qnx::fd_t fdi) {
     auto fd = get_attached_fd(fdi);
     fd->check_open();
     return fd;
 }
 
+int FdMap::get_host_fd(Qnx::fd_t fdi) {
+    auto fd = m_fds[fdi];
+    if (fd && fd->m_path_only) {
+        // on failure, the host call reports EBADF
+        fd->materialize();
+    }
+    return fdi;
+}
+
 QnxFd *FdMap::get_attached_fd(Qnx::fd_t fdi) {
     auto fd = m_fds[fdi];
     if (!fd) {
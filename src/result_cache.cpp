@@ -0,0 +1,484 @@
+#include "result_cache.h"
+
+#include <errno.h>
+#include <filesystem>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cmd_opts.h"
+#include "fsutil.h"
+#include "log.h"
+#include "path_mapper.h"
+#include "process.h"
+#include "sha256.h"
+#include "stats.h"
+#include "types.h"
+#include "unique_fd.h"
+#include "unique_file.h"
+#include "util.h"
+
+static Stats::Counter stat_hit("result_cache.hit");
+static Stats::Counter stat_miss("result_cache.miss");
+static Stats::Counter stat_store("result_cache.store");
+static Stats::Counter stat_uncacheable("result_cache.uncacheable");
+
+/* Larger stdout or stderr is not kept in memory */
+static constexpr size_t MAX_CAPTURE = 64 * 1024 * 1024;
+static constexpr const char *MANIFEST_MAGIC = "qine-result-cache";
+
+/* Copy the whole src to dst, both from offset 0, and optionally hash what was copied */
+static bool copy_fd(int src, int dst, Sha256 *hash = nullptr) {
+    char buf[64 * 1024];
+    off_t offset = 0;
+    ssize_t r;
+    while ((r = pread(src, buf, sizeof(buf), offset)) > 0) {
+        if (pwrite(dst, buf, r, offset) != r) {
+            return false;
+        }
+        if (hash) {
+            hash->update(buf, r);
+        }
+        offset += r;
+    }
+    return r == 0;
+}
+
+/* Create path with the contents of src_fd or data, visible to others only when complete */
+static bool write_atomic(const std::string& path, int src_fd, const std::string *data, uint32_t mode) {
+    std::string tmp = path + ".tmp-XXXXXX";
+    UniqueFd dst(mkostemp(tmp.data(), O_CLOEXEC));
+    if (!dst.valid()) {
+        return false;
+    }
+    bool ok;
+    if (data) {
+        ok = pwrite(dst.get(), data->data(), data->size(), 0) == static_cast<ssize_t>(data->size());
+    } else {
+        ok = copy_fd(src_fd, dst.get());
+    }
+    ok = ok && fchmod(dst.get(), mode) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        int saved = errno;
+        unlink(tmp.c_str());
+        errno = saved;
+    }
+    return ok;
+}
+
+void ResultCache::configure(const char *arg) {
+    std::vector<std::string> tools;
+    CommandOptions::parse(arg, {
+        .core = {
+            new CommandOptions::String(&m_dir),
+        },
+        .kwargs {
+            new CommandOptions::KwArg<CommandOptions::StringList>("tool", &tools),
+            new CommandOptions::KwArg<CommandOptions::StringList>("env", &m_env),
+        }
+    });
+    if (tools.empty()) {
+        throw ConfigurationError("Result cache needs at least one tool");
+    }
+    for (const auto& t: tools) {
+        m_tools.insert(PathInfo::mk_qnx_path(t.c_str()).qnx_path());
+    }
+    // the blobs and manifests are accessed after the guest changed directory
+    m_dir = std::filesystem::absolute(m_dir);
+    if (mkdir(m_dir.c_str(), 0777) != 0 && errno != EEXIST) {
+        throw ConfigurationError(std_printf("Cannot create result cache directory %s: %s", m_dir.c_str(),
+            strerror(errno)));
+    }
+}
+
+void ResultCache::begin(const PathInfo& exec, int argc, const char *const *argv) {
+    // a previous image of this process may have been recording
+    m_recording = false;
+    m_inputs.clear();
+    m_outputs.clear();
+    m_fds.clear();
+    m_stdout.clear();
+    m_stderr.clear();
+
+    if (m_dir.empty() || !m_tools.count(exec.qnx_path())) {
+        return;
+    }
+    if (!invocation_key(exec, argc, argv)) {
+        return;
+    }
+    replay();
+    stat_miss.inc();
+    Log::print(Log::LOADER, "result cache: recording %s\n", m_key.c_str());
+    m_recording = true;
+    m_cacheable = true;
+}
+
+bool ResultCache::invocation_key(const PathInfo& exec, int argc, const char *const *argv) {
+    struct stat st;
+    if (stat(exec.host_path(), &st) != 0) {
+        return false;
+    }
+
+    Sha256 h;
+    h.update_str(std_printf("%s %u", MANIFEST_MAGIC, VERSION).c_str());
+    h.update_str(std_printf("%lx %lx %lx %lx.%09lx", static_cast<unsigned long>(st.st_dev),
+        static_cast<unsigned long>(st.st_ino), static_cast<unsigned long>(st.st_size),
+        static_cast<unsigned long>(st.st_mtim.tv_sec), static_cast<unsigned long>(st.st_mtim.tv_nsec)).c_str());
+    h.update_str(exec.qnx_path());
+
+    auto proc = Process::current();
+    for (const auto& a: proc->self_call()) {
+        h.update_str(a.c_str());
+    }
+    h.update_str("");
+
+    for (int i = 0; i < argc; i++) {
+        h.update_str(argv[i]);
+    }
+    h.update_str("");
+
+    for (const auto& name: m_env) {
+        const char *v = getenv(name.c_str());
+        h.update_str(name.c_str());
+        // distinguishes unset from empty
+        h.update_str(v ? "=" : "");
+        h.update_str(v ? v : "");
+    }
+
+    const char *cwd = getenv("__CWD");
+    if (cwd) {
+        h.update_str(cwd);
+    } else {
+        std::string host_cwd(Fsutil::getcwd());
+        h.update_str(proc->path_mapper().map_path_to_qnx(host_cwd.c_str()).qnx_path());
+    }
+
+    m_key = h.hex_digest();
+    return true;
+}
+
+std::string ResultCache::blob_path(const std::string& hash) const {
+    return m_dir + "/" + hash + ".blob";
+}
+
+std::string ResultCache::manifest_path() const {
+    return m_dir + "/" + m_key + ".manifest";
+}
+
+char ResultCache::path_type(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return '-';
+    }
+    return S_ISDIR(st.st_mode) ? 'd' : 'f';
+}
+
+/*
+ * Manifest format, one record per line, the paths are the rest of the line:
+ *   qine-result-cache VERSION
+ *   status STATUS
+ *   in TYPE HASH|- PATH
+ *   out HASH MODE PATH
+ *   stdout HASH
+ *   stderr HASH
+ */
+void ResultCache::replay() {
+    UniqueFile f(fopen(manifest_path().c_str(), "re"));
+    if (!f) {
+        return;
+    }
+
+    int status = -1;
+    std::vector<Output> outputs;
+    std::string stdout_hash, stderr_hash;
+    bool valid = false;
+
+    char *line = nullptr;
+    size_t line_size = 0;
+    ssize_t len;
+    bool ok = true;
+    while (ok && (len = getline(&line, &line_size, f.get())) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = 0;
+        }
+        char kind[32];
+        char a[80], b[80];
+        int n = 0;
+        if (sscanf(line, "%31s %n", kind, &n) != 1) {
+            ok = false;
+        } else if (strcmp(kind, MANIFEST_MAGIC) == 0) {
+            unsigned version;
+            valid = sscanf(line + n, "%u", &version) == 1 && version == VERSION;
+            ok = valid;
+        } else if (strcmp(kind, "status") == 0) {
+            ok = sscanf(line + n, "%d", &status) == 1;
+        } else if (strcmp(kind, "in") == 0) {
+            int m = 0;
+            ok = sscanf(line + n, "%79s %79s %n", a, b, &m) == 2 && m > 0;
+            if (ok) {
+                const char *path = line + n + m;
+                ok = path_type(path) == a[0];
+                if (ok && strcmp(b, "-") != 0) {
+                    UniqueFd fd(open(path, O_RDONLY | O_CLOEXEC));
+                    std::string hash;
+                    ok = fd.valid() && Sha256::hash_fd(fd.get(), &hash) && hash == b;
+                }
+                if (!ok) {
+                    Log::print(Log::LOADER, "result cache: input %s changed\n", path);
+                }
+            }
+        } else if (strcmp(kind, "out") == 0) {
+            int m = 0;
+            unsigned mode;
+            ok = sscanf(line + n, "%79s %o %n", a, &mode, &m) == 2 && m > 0;
+            if (ok) {
+                outputs.push_back(Output{line + n + m, a, mode});
+            }
+        } else if (strcmp(kind, "stdout") == 0) {
+            ok = sscanf(line + n, "%79s", a) == 1;
+            if (ok) {
+                stdout_hash = a;
+            }
+        } else if (strcmp(kind, "stderr") == 0) {
+            ok = sscanf(line + n, "%79s", a) == 1;
+            if (ok) {
+                stderr_hash = a;
+            }
+        } else {
+            ok = false;
+        }
+    }
+    free(line);
+    if (!ok || !valid || status < 0) {
+        return;
+    }
+
+    /* The inputs are unchanged, so a failure below leaves nothing the tool would not overwrite when it runs */
+    for (const auto& o: outputs) {
+        if (!restore_blob(o.hash, o.path, o.mode)) {
+            Log::print(Log::LOADER, "result cache: cannot restore %s: %s\n", o.path.c_str(), strerror(errno));
+            return;
+        }
+    }
+
+    auto write_blob = [this](const std::string& hash, int dst) {
+        if (hash.empty()) {
+            return;
+        }
+        UniqueFd fd(open(blob_path(hash).c_str(), O_RDONLY | O_CLOEXEC));
+        char buf[64 * 1024];
+        ssize_t r;
+        while (fd.valid() && (r = read(fd.get(), buf, sizeof(buf))) > 0) {
+            // stdout may be a pipe or a terminal, so no pwrite
+            for (ssize_t done = 0, w; done < r; done += w) {
+                w = write(dst, buf + done, r - done);
+                if (w <= 0) {
+                    return;
+                }
+            }
+        }
+    };
+    write_blob(stdout_hash, STDOUT_FILENO);
+    write_blob(stderr_hash, STDERR_FILENO);
+
+    stat_hit.inc();
+    Log::print(Log::LOADER, "result cache: hit %s, status %d\n", m_key.c_str(), status);
+    exit(status);
+}
+
+bool ResultCache::restore_blob(const std::string& hash, const std::string& path, uint32_t mode) {
+    UniqueFd src(open(blob_path(hash).c_str(), O_RDONLY | O_CLOEXEC));
+    return src.valid() && write_atomic(path, src.get(), nullptr, mode);
+}
+
+void ResultCache::mark_uncacheable(const char *reason) {
+    Log::print(Log::LOADER, "result cache: not storing the result, the program %s\n", reason);
+    m_cacheable = false;
+}
+
+ResultCache::Input* ResultCache::find_input(const std::string& path) {
+    for (auto& in: m_inputs) {
+        if (in.path == path) {
+            return &in;
+        }
+    }
+    return nullptr;
+}
+
+void ResultCache::stat_slow(const char *host_path) {
+    if (strchr(host_path, '\n')) {
+        mark_uncacheable("uses a path with a newline");
+        return;
+    }
+    std::string path(host_path);
+    if (m_outputs.count(path) || find_input(path)) {
+        return;
+    }
+    m_inputs.push_back(Input{path, path_type(host_path), ""});
+}
+
+void ResultCache::open_slow(const char *host_path, int oflags, int fd) {
+    if (fd < 0 || (oflags & (O_PATH | O_DIRECTORY))) {
+        stat_slow(host_path);
+        return;
+    }
+    if (strchr(host_path, '\n')) {
+        mark_uncacheable("uses a path with a newline");
+        return;
+    }
+
+    std::string path(host_path);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        mark_uncacheable("opens a special file");
+        return;
+    }
+
+    if ((oflags & O_ACCMODE) != O_RDONLY) {
+        auto in = find_input(path);
+        if (in && !in->hash.empty()) {
+            mark_uncacheable("writes a file it has read");
+            return;
+        }
+        // an empty file and a truncated one both start from nothing
+        if (!(oflags & O_TRUNC) && st.st_size > 0 && !m_outputs.count(path)) {
+            mark_uncacheable("modifies an existing file");
+            return;
+        }
+        // whether the path existed before does not matter, a replay creates or replaces it
+        if (in) {
+            m_inputs.erase(m_inputs.begin() + (in - m_inputs.data()));
+        }
+        m_outputs.insert(path);
+        m_fds[fd] = FdKind::OUTPUT;
+        return;
+    }
+
+    m_fds[fd] = FdKind::INPUT;
+    if (m_outputs.count(path)) {
+        return;
+    }
+    auto in = find_input(path);
+    if (in && !in->hash.empty()) {
+        return;
+    }
+    std::string hash;
+    if (!Sha256::hash_fd(fd, &hash)) {
+        mark_uncacheable("reads a file that cannot be hashed");
+        return;
+    }
+    if (in) {
+        in->type = 'f';
+        in->hash = std::move(hash);
+    } else {
+        m_inputs.push_back(Input{path, 'f', std::move(hash)});
+    }
+}
+
+void ResultCache::read_slow(int fd) {
+    if (!m_fds.count(fd)) {
+        mark_uncacheable("reads from an inherited file descriptor");
+    }
+}
+
+void ResultCache::write_slow(int fd, const struct iovec *iov, size_t iov_count, ssize_t written) {
+    if (m_fds.count(fd)) {
+        return;
+    }
+    if (fd != STDOUT_FILENO && fd != STDERR_FILENO) {
+        mark_uncacheable("writes to an inherited file descriptor");
+        return;
+    }
+    auto& dst = fd == STDOUT_FILENO ? m_stdout : m_stderr;
+    if (dst.size() + written > MAX_CAPTURE) {
+        mark_uncacheable("writes too much output");
+        return;
+    }
+    for (size_t i = 0; i < iov_count && written > 0; i++) {
+        size_t n = std::min(iov[i].iov_len, static_cast<size_t>(written));
+        dst.append(static_cast<const char*>(iov[i].iov_base), n);
+        written -= n;
+    }
+}
+
+bool ResultCache::store_blob(int fd, std::string *hash) {
+    // the blob is hashed from the same reads that copy it, the file may change in between
+    std::string tmp = m_dir + "/blob.tmp-XXXXXX";
+    UniqueFd dst(mkostemp(tmp.data(), O_CLOEXEC));
+    if (!dst.valid()) {
+        return false;
+    }
+    Sha256 h;
+    bool ok = copy_fd(fd, dst.get(), &h);
+    bool renamed = false;
+    if (ok) {
+        *hash = h.hex_digest();
+        auto path = blob_path(*hash);
+        // an existing blob has the same contents
+        if (access(path.c_str(), F_OK) != 0) {
+            ok = fchmod(dst.get(), 0644) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+            renamed = ok;
+        }
+    }
+    if (!renamed) {
+        int saved = errno;
+        unlink(tmp.c_str());
+        errno = saved;
+    }
+    return ok;
+}
+
+bool ResultCache::store_blob(const std::string& hash, const std::string& data) {
+    auto path = blob_path(hash);
+    return access(path.c_str(), F_OK) == 0 || write_atomic(path, -1, &data, 0644);
+}
+
+void ResultCache::finish(int status) {
+    if (!m_recording) {
+        return;
+    }
+    m_recording = false;
+    if (!m_cacheable) {
+        stat_uncacheable.inc();
+        return;
+    }
+
+    std::string manifest = std_printf("%s %u\nstatus %d\n", MANIFEST_MAGIC, VERSION, status);
+    for (const auto& in: m_inputs) {
+        manifest += std_printf("in %c %s %s\n", in.type, in.hash.empty() ? "-" : in.hash.c_str(), in.path.c_str());
+    }
+    for (const auto& path: m_outputs) {
+        UniqueFd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat st;
+        std::string hash;
+        if (!fd.valid() || fstat(fd.get(), &st) != 0 || !store_blob(fd.get(), &hash)) {
+            Log::print(Log::LOADER, "result cache: cannot store %s\n", path.c_str());
+            return;
+        }
+        manifest += std_printf("out %s %o %s\n", hash.c_str(), st.st_mode & 07777, path.c_str());
+    }
+    for (auto [name, data]: {std::pair{"stdout", &m_stdout}, std::pair{"stderr", &m_stderr}}) {
+        if (data->empty()) {
+            continue;
+        }
+        Sha256 h;
+        h.update(*data);
+        auto hash = h.hex_digest();
+        if (!store_blob(hash, *data)) {
+            Log::print(Log::LOADER, "result cache: cannot store %s\n", name);
+            return;
+        }
+        manifest += std_printf("%s %s\n", name, hash.c_str());
+    }
+
+    // the blobs are in place before the manifest that refers to them
+    if (!write_atomic(manifest_path(), -1, &manifest, 0644)) {
+        Log::print(Log::LOADER, "result cache: cannot store the manifest: %s\n", strerror(errno));
+        return;
+    }
+    stat_store.inc();
+    Log::print(Log::LOADER, "result cache: stored %s\n", m_key.c_str());
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class PathInfo;
+
+/*
+ * Cache of the results of deterministic tools, enabled by --result-cache=DIR,tool=QNX_PATH...[,env=NAME]...
+ *
+ * When a listed tool starts, its invocation is hashed: the executable (by inode and mtime), the qine options,
+ * the arguments, the QNX current directory and the environment variables given by env=. If DIR has a manifest
+ * for the invocation and all the files it lists as inputs are unchanged, the outputs, stdout, stderr and the
+ * exit status are restored from DIR and the tool is not run at all.
+ *
+ * Otherwise the run is recorded: the content hash of each file opened for reading, the existence of each path
+ * that was stat'ed or failed to open (unless the program writes it later, a replay creates it either way), the
+ * final contents of the files created or truncated for writing and everything written to stdout and stderr. A run that does anything else with a visible effect or an unknown
+ * input (e.g. reads stdin, spawns, renames or lists a directory) is not stored.
+ *
+ * Contents are stored once per hash and manifests and contents are written to a temporary file and renamed,
+ * so any number of qine processes can share DIR.
+ */
+class ResultCache {
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    void configure(const char *arg);
+
+    /* Called before the program is loaded. Does not return on a cache hit. */
+    void begin(const PathInfo& exec, int argc, const char *const *argv);
+    bool recording() const { return m_recording; }
+    /* Store the result of the recorded run that exits with status */
+    void finish(int status);
+
+    /* Hooks for the message handlers, no-ops when not recording */
+    inline void uncacheable(const char *reason);
+    /* After the guest opens host_path as fd, or fails to if fd < 0 */
+    inline void record_open(const char *host_path, int oflags, int fd);
+    inline void record_stat(const char *host_path);
+    inline void record_read(int fd);
+    inline void record_write(int fd, const struct iovec *iov, size_t iov_count, ssize_t written);
+    inline void record_close(int fd);
+    /* Changes to the files written by the program are fine, the rest is not */
+    inline void record_modify(int fd, const char *reason);
+private:
+    enum class FdKind { INPUT, OUTPUT };
+    struct Input {
+        std::string path;
+        /* '-' missing, 'd' directory, 'f' anything else */
+        char type;
+        /* Empty if only the type was observed */
+        std::string hash;
+    };
+    struct Output {
+        std::string path;
+        std::string hash;
+        uint32_t mode;
+    };
+
+    void mark_uncacheable(const char *reason);
+    void open_slow(const char *host_path, int oflags, int fd);
+    void stat_slow(const char *host_path);
+    void read_slow(int fd);
+    void write_slow(int fd, const struct iovec *iov, size_t iov_count, ssize_t written);
+
+    bool invocation_key(const PathInfo& exec, int argc, const char *const *argv);
+    /* Exits with the stored result if there is one for m_key and its inputs are unchanged */
+    void replay();
+    Input* find_input(const std::string& path);
+    static char path_type(const char *path);
+
+    std::string blob_path(const std::string& hash) const;
+    std::string manifest_path() const;
+    /* Store the contents of fd, returns their hash */
+    bool store_blob(int fd, std::string *hash);
+    bool store_blob(const std::string& hash, const std::string& data);
+    bool restore_blob(const std::string& hash, const std::string& path, uint32_t mode);
+
+    std::string m_dir;
+    std::unordered_set<std::string> m_tools;
+    std::vector<std::string> m_env;
+
+    bool m_recording = false;
+    bool m_cacheable;
+    std::string m_key;
+    std::vector<Input> m_inputs;
+    std::unordered_set<std::string> m_outputs;
+    std::unordered_map<int, FdKind> m_fds;
+    std::string m_stdout;
+    std::string m_stderr;
+};
+
+void ResultCache::uncacheable(const char *reason) {
+    if (m_recording && m_cacheable) {
+        mark_uncacheable(reason);
+    }
+}
+
+void ResultCache::record_open(const char *host_path, int oflags, int fd) {
+    if (m_recording && m_cacheable) {
+        open_slow(host_path, oflags, fd);
+    }
+}
+
+void ResultCache::record_stat(const char *host_path) {
+    if (m_recording && m_cacheable) {
+        stat_slow(host_path);
+    }
+}
+
+void ResultCache::record_read(int fd) {
+    if (m_recording && m_cacheable) {
+        read_slow(fd);
+    }
+}
+
+void ResultCache::record_write(int fd, const struct iovec *iov, size_t iov_count, ssize_t written) {
+    if (m_recording && m_cacheable) {
+        write_slow(fd, iov, iov_count, written);
+    }
+}
+
+void ResultCache::record_modify(int fd, const char *reason) {
+    if (m_recording && m_cacheable) {
+        auto it = m_fds.find(fd);
+        if (it == m_fds.end() || it->second != FdKind::OUTPUT) {
+            mark_uncacheable(reason);
+        }
+    }
+}
+
+void ResultCache::record_close(int fd) {
+    if (m_recording) {
+        m_fds.erase(fd);
+    }
+}
@@ -0,0 +1,30 @@
+#include "mem_ops.h"
+#include "scratch_arena.h"
+
+ScratchArena::ScratchArena(): m_block(0), m_used(0) {
+    next_block(BLOCK_SIZE);
+}
+
+void* ScratchArena::alloc(size_t size, size_t align) {
+    size_t start = MemOps::align_up(m_used, align);
+    while (start + size > m_sizes[m_block]) {
+        if (m_block + 1 == m_blocks.size()) {
+            next_block(std::max(size + align, m_sizes[m_block] * 2));
+        }
+        m_block++;
+        start = 0;
+    }
+    m_used = start + size;
+    return m_blocks[m_block].get() + start;
+}
+
+void ScratchArena::reset() {
+    m_block = 0;
+    m_used = 0;
+}
+
+void ScratchArena::next_block(size_t size) {
+    // new[] of uint8_t is only aligned to the default new alignment, which is fine for anything we store here
+    m_blocks.emplace_back(new uint8_t[size]);
+    m_sizes.push_back(size);
+}
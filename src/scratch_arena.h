@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "cpp.h"
+
+/*
+ * Bump allocator for short-lived data of a single kernel call, e.g. iovecs. Nothing is freed individually,
+ * everything is released at once by reset(), which the emulator calls when the kernel call is done.
+ *
+ * The blocks are kept across resets, so after warming up, the kernel calls do not touch the heap.
+ */
+class ScratchArena {
+public:
+    ScratchArena();
+    void* alloc(size_t size, size_t align);
+    void reset();
+private:
+    NoCopy m_nc;
+
+    void next_block(size_t size);
+
+    std::vector<std::unique_ptr<uint8_t[]>> m_blocks;
+    std::vector<size_t> m_sizes;
+    size_t m_block;
+    size_t m_used;
+
+    static constexpr size_t BLOCK_SIZE = 16 * 1024;
+};
+
+/* STL allocator allocating from ScratchArena */
+template<class T>
+class ScratchAllocator {
+    template<class U> friend class ScratchAllocator;
+public:
+    using value_type = T;
+
+    ScratchAllocator(ScratchArena& arena): m_arena(&arena) {}
+    template<class U> ScratchAllocator(const ScratchAllocator<U>& b): m_arena(b.m_arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(m_arena->alloc(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) {}
+
+    template<class U> bool operator==(const ScratchAllocator<U>& b) const { return m_arena == b.m_arena; }
+    template<class U> bool operator!=(const ScratchAllocator<U>& b) const { return m_arena != b.m_arena; }
+private:
+    ScratchArena *m_arena;
+};
+
+template<class T>
+using ScratchVector = std::vector<T, ScratchAllocator<T>>;
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdint>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -116,8 +117,10 @@ void Segment::grow_paged_internal(int prot, size_t size)
         throw std::bad_alloc();
     }
 
-    for (size_t i = 0; i < size / MemOps::PAGE_SIZE; i++) {
-        m_bitmap.push_back(true);
+    if (!m_valid.empty() && m_valid.back().end == m_paged_size) {
+        m_valid.back().end += size;
+    } else {
+        m_valid.push_back(ValidRange{m_paged_size, m_paged_size + size});
     }
 
     m_paged_size += size;
@@ -131,11 +134,41 @@ void Segment::skip_paged(size_t new_size)
         throw std::bad_alloc();
     }
 
-    for (size_t i = 0; i < new_size / MemOps::PAGE_SIZE; i++) {
-        m_bitmap.push_back(false);
+    m_paged_size += new_size;
+}
+
+void Segment::map_file(int prot, size_t offset, size_t size, int fd, off_t file_offset)
+{
+    assert(MemOps::is_page_aligned(offset) && MemOps::is_page_aligned(size));
+    auto ptr = pointer(offset, size);
+    void *l = mmap(ptr, size, prot, MAP_PRIVATE | MAP_FIXED, fd, file_offset);
+    if (l == MAP_FAILED) {
+        throw std::bad_alloc();
     }
+}
 
-    m_paged_size += new_size;
+void Segment::clear_pages(int prot, size_t offset, size_t size)
+{
+    assert(MemOps::is_page_aligned(offset) && MemOps::is_page_aligned(size));
+    auto ptr = pointer(offset, size);
+    void *l = mmap(ptr, size, prot, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0);
+    if (l == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+}
+
+void Segment::restore(size_t reservation, size_t paged_size, size_t limit_size, const std::vector<ValidRange>& valid,
+    const std::vector<off_t>& file_offsets, int prot, int fd)
+{
+    assert(valid.size() == file_offsets.size());
+    reserve(reservation);
+    for (size_t i = 0; i < valid.size(); i++) {
+        skip_paged(valid[i].start - m_paged_size);
+        grow_paged_internal(prot, valid[i].end - valid[i].start);
+        map_file(prot, valid[i].start, valid[i].end - valid[i].start, fd, file_offsets[i]);
+    }
+    skip_paged(paged_size - m_paged_size);
+    m_limit_size = limit_size;
 }
 
 void Segment::change_access(int prot, size_t offset, size_t size)
@@ -153,15 +186,37 @@ bool Segment::check_bounds(size_t offset, size_t size) const
         return false;
     }
 
-    bool ok = true;
-    // Probe each page from start and the last page too for good measure
-    uint32_t first = MemOps::align_page_down(offset) / MemOps::PAGE_SIZE;
-    uint32_t end = MemOps::align_page_up(offset + size) / MemOps::PAGE_SIZE;
-    //printf("Pointer request for pages %x : %x\n", first, end);
-    for (uint32_t p = first; p < end; p++) {
-        ok &= m_bitmap[p];
+    // All pages touched by the request must be valid
+    size_t first = MemOps::align_page_down(offset);
+    size_t end = MemOps::align_page_up(offset + size);
+    if (first == end) {
+        return true;
+    }
+
+    // The ranges are merged, so the request must fit into the range containing its first page
+    auto range = m_valid.end();
+    if (!m_valid.empty() && m_valid.back().start <= first) {
+        range = m_valid.end() - 1;
+    } else {
+        range = std::upper_bound(m_valid.begin(), m_valid.end(), first, [](size_t v, const ValidRange& r) {
+            return v < r.start;
+        });
+        if (range == m_valid.begin()) {
+            return false;
+        }
+        --range;
+    }
+    return end <= range->end;
+}
+
+void Segment::last_valid_range(size_t *start, size_t *end) const
+{
+    if (m_valid.empty()) {
+        *start = *end = 0;
+    } else {
+        *start = m_valid.back().start;
+        *end = m_valid.back().end;
     }
-    return ok;
 }
 
 void* Segment::pointer(size_t offset, size_t size)
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <vector>
 #include <sys/mman.h>
+#include <sys/types.h>
 #include "cpp.h"
 #include "types.h"
 #include "intrusive_list.h"
@@ -31,8 +32,14 @@ public:
     void grow_bytes(size_t size);
     void grow_bytes_64capped(size_t size);
     void skip_paged(size_t skip);
+    /* Replace already backed pages by a private mapping of a file. Throws bad_alloc, the pages may be gone then. */
+    void map_file(int prot, size_t offset, size_t size, int fd, off_t file_offset);
+    /* Replace already backed pages by zero pages, e.g. to undo map_file */
+    void clear_pages(int prot, size_t offset, size_t size);
 
     bool check_bounds(size_t offset, size_t size) const;
+    /* The last range of pages backed by memory, start == end if there is none */
+    void last_valid_range(size_t *start, size_t *end) const;
     void* pointer(size_t offset, size_t size);
 
     GuestPtr location() const  {
@@ -48,6 +55,17 @@ public:
     void make_shared();
     bool is_shared() const;
     static int map_prot(Access access);
+
+    /* Page-aligned range of pages backed by memory, [start, end) */
+    struct ValidRange {
+        size_t start;
+        size_t end;
+    };
+    const std::vector<ValidRange>& valid_ranges() const { return m_valid; }
+    size_t reserved() const { return m_reserved; }
+    /* Recreate the layout of a saved segment, with the valid ranges privately mapped from fd */
+    void restore(size_t reservation, size_t paged_size, size_t limit_size, const std::vector<ValidRange>& valid,
+        const std::vector<off_t>& file_offsets, int prot, int fd);
 private:
     /* Does not update limit size */
     void grow_paged_internal(int prot, size_t size);
@@ -58,8 +76,12 @@ private:
     size_t m_limit_size;
     size_t m_reserved;
     bool m_shared;
-    // Store bitmap of valid readable areas
-    std::vector<bool> m_bitmap;
+
+    /*
+     * Sorted, adjacent ranges are merged. The segments are usually a skipped prefix followed by a
+     * single valid range, so bounds checks rarely need to look past the last entry.
+     */
+    std::vector<ValidRange> m_valid;
 };
 
 /* Helper class to allocate carve out chunks of memory from data segment, optionally allocatin more heap */
@@ -8,9 +8,10 @@
 #include "mem_ops.h"
 #include "segment_descriptor.h"
 #include "segment.h"
+#include "stats.h"
 
 SegmentDescriptor::SegmentDescriptor(SegmentId id, Access access, const std::shared_ptr<Segment>& seg, Bitness bits)
-    :m_id(id), m_access(access), m_seg(seg), m_bits(bits)
+    :m_id(id), m_access(access), m_seg(seg), m_bits(bits), m_written{}
 {
     update_descriptors();
 }
@@ -42,10 +43,15 @@ void SegmentDescriptor::update_descriptors() {
             ud.read_exec_only = 1;
         }
     }
+    if (m_written.entry_number == m_id && memcmp(&ud, &m_written, sizeof(ud)) == 0) {
+        return;
+    }
     int r = syscall(SYS_modify_ldt, 1, &ud, sizeof(ud));
     if (r != 0) {
         throw std::logic_error(strerror(errno));
     }
+    Stats::host_syscalls.inc();
+    m_written = ud;
 }
 
 void SegmentDescriptor::remove_descriptors() {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <asm/ldt.h>
 #include <cstdint>
 #include <memory>
 #include "types.h"
@@ -26,9 +27,10 @@ public:
     inline FarPointer pointer(uint32_t offset);
     inline void change_access(Access a) { m_access = a;}
     inline Access access() const {return m_access;}
+    inline Bitness bits() const {return m_bits;}
     const std::shared_ptr<Segment> segment() const { return m_seg; }
 
-    /* Call needed if underlying descriptor changes */
+    /* Call needed if underlying descriptor changes. Does nothing if the LDT entry would stay the same. */
     void update_descriptors();
 private:
     // Because only one id can exist at a time to manage the LDT space
@@ -40,6 +42,8 @@ private:
     Access m_access;
     std::shared_ptr<Segment> m_seg;
     Bitness m_bits;
+    /* What is currently in the LDT, to skip redundant modify_ldt calls */
+    struct user_desc m_written;
 };
 
 constexpr uint16_t SegmentDescriptor::mk_sel(SegmentId id){
@@ -0,0 +1,26 @@
+#include "mem_ops.h"
+#include "segment.h"
+#include "segment_descriptor.h"
+#include "selector_cache.h"
+
+void SelectorCache::fill(uint16_t sel, const SegmentDescriptor& sd) {
+    uint16_t id = sel >> 3;
+    if (id >= m_entries.size()) {
+        m_entries.resize(id + 1, Entry{});
+    }
+
+    size_t start, end;
+    sd.segment()->last_valid_range(&start, &end);
+
+    Entry& e = m_entries[id];
+    e.base = sd.segment()->location();
+    e.start = start;
+    e.end = end;
+}
+
+void SelectorCache::invalidate(uint16_t sel) {
+    uint16_t id = sel >> 3;
+    if (id < m_entries.size()) {
+        m_entries[id] = Entry{};
+    }
+}
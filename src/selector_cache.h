@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class SegmentDescriptor;
+
+/*
+ * Flat translation cache for Process::translate_segmented, indexed by selector id.
+ *
+ * Each entry holds the host base of the segment and the range that is known to be backed by memory.
+ * A hit is thus one indexed load and a compare, without going through the descriptor and the segment objects.
+ * Like the slow path, the cache does not check kernel writes against the segment access: the kernel writes
+ * into read-only segments on behalf of the guest (e.g. when loading code).
+ *
+ * Entries are filled on a miss of the slow path. Segments only ever grow, so an entry that is stale
+ * because its segment has grown is merely too conservative and gets refilled on the next miss.
+ * Freeing or changing the descriptor must invalidate the entry.
+ */
+class SelectorCache {
+public:
+    /* Returns nullptr if the access cannot be decided from the cache */
+    inline void* translate(uint16_t sel, uint32_t offset, uint32_t size) const;
+
+    void fill(uint16_t sel, const SegmentDescriptor& sd);
+    void invalidate(uint16_t sel);
+private:
+    struct Entry {
+        /* Linear address of the segment start, segments are mapped below 4G */
+        uint32_t base;
+        /* Offsets [start, end) are backed by memory */
+        uint32_t start;
+        uint32_t end;
+    };
+    static_assert(sizeof(Entry) == 12);
+
+    std::vector<Entry> m_entries;
+};
+
+void* SelectorCache::translate(uint16_t sel, uint32_t offset, uint32_t size) const {
+    uint16_t id = sel >> 3;
+    if (id >= m_entries.size()) {
+        return nullptr;
+    }
+    const Entry& e = m_entries[id];
+    if (offset < e.start || offset >= e.end || size > e.end - offset) {
+        return nullptr;
+    }
+    return reinterpret_cast<void*>(static_cast<uintptr_t>(e.base) + offset);
+}
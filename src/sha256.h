@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/* SHA-256 for content addressing, e.g. in the result cache */
+class Sha256 {
+public:
+    Sha256();
+    void update(const void *data, size_t size);
+    void update(const std::string& s) { update(s.data(), s.size()); }
+    /* Also hashes the terminating null, so that consecutive strings cannot run into each other */
+    void update_str(const char *s);
+    /* Finishes the hash, the object cannot be updated afterwards */
+    std::string hex_digest();
+
+    /* Hash of the contents of fd, read with pread. False on read errors. */
+    static bool hash_fd(int fd, std::string *hex);
+private:
+    void block(const uint8_t *p);
+
+    uint32_t m_state[8];
+    uint64_t m_length;
+    uint8_t m_buf[64];
+    size_t m_buf_used;
+};
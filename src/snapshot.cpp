@@ -0,0 +1,498 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "fsutil.h"
+#include "guest_context.h"
+#include "log.h"
+#include "mem_ops.h"
+#include "process.h"
+#include "qnx/magic.h"
+#include "qnx/procenv.h"
+#include "qnx/signal.h"
+#include "segment.h"
+#include "segment_descriptor.h"
+#include "stats.h"
+#include "types.h"
+#include "unique_fd.h"
+#include "util.h"
+
+static Stats::Counter stat_save("snapshot.save");
+static Stats::Counter stat_restore("snapshot.restore");
+static Stats::Counter stat_stale("snapshot.stale");
+
+struct Snapshot::FileKey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+struct Snapshot::Header {
+    uint32_t magic;
+    uint32_t version;
+    FileKey exec;
+    /* Zeroed if there is no Slib */
+    FileKey slib;
+    uint32_t flags;
+    /* Size of the metadata following the header, the segment data starts at the next page */
+    uint32_t meta_size;
+};
+
+struct Snapshot::Regs {
+    uint32_t eax, ebx, ecx, edx, esi, edi, ebp, esp, eip;
+    uint16_t cs, ss, ds, es, fs, gs;
+};
+
+struct SavedSegment {
+    uint64_t reserved;
+    uint64_t paged_size;
+    uint64_t limit_size;
+    uint32_t prot;
+    uint32_t shared;
+    uint32_t range_count;
+};
+
+struct SavedRange {
+    uint64_t start;
+    uint64_t end;
+    /* Relative to the start of the segment data */
+    uint64_t data_offset;
+};
+
+struct SavedDescriptor {
+    uint16_t id;
+    uint8_t access;
+    uint8_t bits;
+    uint32_t segment;
+};
+
+static constexpr uint32_t SNAPSHOT_MAGIC = 0x314e5351; /* QSN1 */
+static constexpr uint32_t FLAG_SYSCALL_GATE = 1;
+static constexpr uint8_t INSN_HLT = 0xF4;
+/* Bound on what the Slib may leave on the stack below the argument block */
+static constexpr uint32_t MAX_STACK_LEFTOVER = 4096;
+
+/* The metadata is a sequence of plain structures, read back in the order they were written */
+class MetaWriter {
+public:
+    template <class T> void put(const T& v) {
+        m_data.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+    void put_string(const std::string& s) {
+        put<uint32_t>(s.size());
+        m_data.append(s);
+    }
+    const std::string& data() const { return m_data; }
+private:
+    std::string m_data;
+};
+
+class MetaReader {
+public:
+    MetaReader(const std::string& data): m_data(data), m_pos(0), m_ok(true) {}
+
+    template <class T> T get() {
+        T v;
+        memset(&v, 0, sizeof(v));
+        if (sizeof(v) > m_data.size() - m_pos) {
+            m_ok = false;
+            return v;
+        }
+        memcpy(&v, m_data.data() + m_pos, sizeof(v));
+        m_pos += sizeof(v);
+        return v;
+    }
+    std::string get_string() {
+        uint32_t size = get<uint32_t>();
+        if (size > m_data.size() - m_pos) {
+            m_ok = false;
+            return std::string();
+        }
+        auto s = m_data.substr(m_pos, size);
+        m_pos += size;
+        return s;
+    }
+    bool ok() const { return m_ok; }
+private:
+    const std::string& m_data;
+    size_t m_pos;
+    bool m_ok;
+};
+
+static void put_load_info(MetaWriter& out, const LoadInfo& li) {
+    out.put(li.entry);
+    out.put(li.ss);
+    out.put(li.ds);
+    out.put(li.cs);
+    out.put(li.heap_start);
+    out.put(li.stack_low);
+    out.put(li.stack_size);
+    out.put<uint32_t>(li.selectors.size());
+    for (auto sel: li.selectors) {
+        out.put(sel);
+    }
+}
+
+static LoadInfo get_load_info(MetaReader& in) {
+    LoadInfo li;
+    li.bits = B32;
+    li.entry = in.get<uint32_t>();
+    li.ss = in.get<uint16_t>();
+    li.ds = in.get<uint16_t>();
+    li.cs = in.get<uint16_t>();
+    li.heap_start = in.get<uint32_t>();
+    li.stack_low = in.get<uint32_t>();
+    li.stack_size = in.get<uint32_t>();
+    uint32_t count = in.get<uint32_t>();
+    for (uint32_t i = 0; i < count && in.ok(); i++) {
+        li.selectors.push_back(in.get<uint16_t>());
+    }
+    return li;
+}
+
+static std::string join_args(const std::vector<std::string>& args) {
+    std::string r;
+    for (const auto& a: args) {
+        r.append(a);
+        r.push_back('\0');
+    }
+    return r;
+}
+
+static bool read_at(int fd, void *dst, size_t size, off_t offset) {
+    return pread(fd, dst, size, offset) == static_cast<ssize_t>(size);
+}
+
+static bool stale(const char *path, const char *why) {
+    Log::print(Log::LOADER, "snapshot %s not used: %s\n", path, why);
+    stat_stale.inc();
+    return false;
+}
+
+bool Snapshot::file_key(const char *path, FileKey *key) {
+    struct stat st;
+    memset(key, 0, sizeof(*key));
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime_sec = st.st_mtim.tv_sec;
+    key->mtime_nsec = st.st_mtim.tv_nsec;
+    return true;
+}
+
+void Snapshot::arm(const char *path, const PathInfo& exec, const std::vector<std::string>& lib_args) {
+    auto proc = Process::current();
+    if (proc->m_bits != B32) {
+        throw ConfigurationError("Snapshots are supported only for 32-bit programs");
+    }
+    if (proc->m_interpreter_info.has_interpreter) {
+        throw ConfigurationError("Snapshots of interpreted programs are not supported");
+    }
+
+    m_path = path;
+    m_exec_path = exec.host_path();
+    m_lib_args = join_args(lib_args);
+    m_entry_cs = proc->m_load_exec.cs;
+    m_entry = proc->m_load_exec.entry;
+
+    auto& ctx = proc->m_startup_context;
+    m_startup.ebx = ctx.reg_ebx();
+    m_startup.ecx = ctx.reg_ecx();
+    m_startup.edx = ctx.reg_edx();
+    m_startup.edi = ctx.reg_edi();
+    m_startup.ebp = ctx.reg_ebp();
+    /* The Slib returns to the program entry pushed below the argument block */
+    m_startup.esp = ctx.reg_esp() + (proc->slib_loaded() ? 8 : 0);
+
+    /* The guest faults on the privileged instruction at the entry, the original byte is put back when saving */
+    auto entry = static_cast<uint8_t*>(proc->translate_segmented(FarPointer(m_entry_cs, m_entry), 1));
+    m_entry_byte = *entry;
+    *entry = INSN_HLT;
+    m_armed = true;
+}
+
+void Snapshot::save(GuestContext& ctx) {
+    if (ctx.reg_cs() != m_entry_cs || ctx.reg_eip() != m_entry) {
+        return;
+    }
+    auto proc = ctx.proc();
+    m_armed = false;
+    *static_cast<uint8_t*>(proc->translate_segmented(FarPointer(m_entry_cs, m_entry), 1)) = m_entry_byte;
+
+    Header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = VERSION;
+    file_key(m_exec_path.c_str(), &hdr.exec);
+    if (!proc->m_slib_path.empty()) {
+        file_key(proc->m_slib_path.c_str(), &hdr.slib);
+    }
+    hdr.flags = proc->m_emu.syscall_gate_enabled() ? FLAG_SYSCALL_GATE : 0;
+
+    MetaWriter meta;
+    meta.put_string(m_lib_args);
+    meta.put_string(proc->m_slib_path);
+    meta.put(proc->m_slib_entry);
+    put_load_info(meta, proc->m_load_exec);
+    put_load_info(meta, proc->m_load_slib);
+
+    Regs regs = {
+        ctx.reg_eax(), ctx.reg_ebx(), ctx.reg_ecx(), ctx.reg_edx(), ctx.reg_esi(), ctx.reg_edi(), ctx.reg_ebp(),
+        ctx.reg_esp(), ctx.reg_eip(),
+        ctx.reg_cs(), ctx.reg_ss(), ctx.reg_ds(), ctx.reg_es(), ctx.reg_fs(), ctx.reg_gs(),
+    };
+    meta.put(regs);
+    meta.put(m_startup);
+    meta.put(proc->m_magic_guest_pointer);
+    meta.put(proc->m_sigtab_guest_pointer);
+    meta.put<uint16_t>(proc->m_time_segment_selector);
+
+    /* The time and magic pointer segments are recreated on restore */
+    std::vector<Segment*> segments;
+    std::vector<int> prots;
+    std::vector<SavedDescriptor> descriptors;
+    auto& sdmap = proc->m_segment_descriptors;
+    for (size_t i = 0; (i = sdmap.search(i, true)) != IdMap<SegmentDescriptor>::INVAL; i++) {
+        auto sd = sdmap[i];
+        auto seg = sd->segment().get();
+        if (seg == proc->m_time_segment.get() || seg == proc->m_magic_pointer.get()) {
+            continue;
+        }
+        size_t index = std::find(segments.begin(), segments.end(), seg) - segments.begin();
+        if (index == segments.size()) {
+            segments.push_back(seg);
+            prots.push_back(0);
+        }
+        prots[index] |= Segment::map_prot(sd->access());
+        descriptors.push_back(SavedDescriptor{sd->id(), static_cast<uint8_t>(sd->access()),
+            static_cast<uint8_t>(sd->bits()), static_cast<uint32_t>(index)});
+    }
+
+    uint64_t data_size = 0;
+    meta.put<uint32_t>(segments.size());
+    for (size_t i = 0; i < segments.size(); i++) {
+        auto seg = segments[i];
+        auto& ranges = seg->valid_ranges();
+        meta.put(SavedSegment{seg->reserved(), seg->paged_size(), seg->size(), static_cast<uint32_t>(prots[i]),
+            seg->is_shared(), static_cast<uint32_t>(ranges.size())});
+        for (const auto& r: ranges) {
+            meta.put(SavedRange{r.start, r.end, data_size});
+            data_size += r.end - r.start;
+        }
+    }
+    meta.put<uint32_t>(descriptors.size());
+    for (const auto& d: descriptors) {
+        meta.put(d);
+    }
+    hdr.meta_size = meta.data().size();
+
+    auto tmp_path = std_printf("%s.%d", m_path.c_str(), getpid());
+    UniqueFd fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    bool ok = fd.valid();
+    ok = ok && pwrite(fd.get(), &hdr, sizeof(hdr), 0) == sizeof(hdr);
+    ok = ok && pwrite(fd.get(), meta.data().data(), meta.data().size(), sizeof(hdr))
+        == static_cast<ssize_t>(meta.data().size());
+    off_t pos = MemOps::align_page_up(sizeof(hdr) + meta.data().size());
+    for (auto seg: segments) {
+        for (const auto& r: seg->valid_ranges()) {
+            size_t size = r.end - r.start;
+            ok = ok && pwrite(fd.get(), seg->pointer(r.start, size), size, pos) == static_cast<ssize_t>(size);
+            pos += size;
+        }
+    }
+    ok = ok && ftruncate(fd.get(), pos) == 0;
+    if (!ok || rename(tmp_path.c_str(), m_path.c_str()) != 0) {
+        fprintf(stderr, "Cannot save snapshot %s: %s\n", m_path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        exit(1);
+    }
+
+    Log::print(Log::LOADER, "snapshot: saved %s, %zu segments\n", m_path.c_str(), segments.size());
+    stat_save.inc();
+    exit(0);
+}
+
+bool Snapshot::restore(const char *path, const PathInfo& exec, const std::vector<std::string>& lib_args,
+    int argc, char **argv)
+{
+    auto proc = Process::current();
+    UniqueFd fd(open(path, O_RDONLY | O_CLOEXEC));
+    if (!fd.valid()) {
+        return stale(path, strerror(errno));
+    }
+
+    Header hdr;
+    FileKey key;
+    struct stat st;
+    if (fstat(fd.get(), &st) != 0 || !read_at(fd.get(), &hdr, sizeof(hdr), 0)
+        || hdr.magic != SNAPSHOT_MAGIC || hdr.version != VERSION) {
+        return stale(path, "invalid header");
+    }
+    if (!file_key(exec.host_path(), &key) || memcmp(&key, &hdr.exec, sizeof(key)) != 0) {
+        return stale(path, "different executable");
+    }
+    if (static_cast<bool>(hdr.flags & FLAG_SYSCALL_GATE) != proc->m_emu.syscall_gate_enabled()) {
+        return stale(path, "different --syscall-gate");
+    }
+
+    std::string meta(hdr.meta_size, '\0');
+    if (!read_at(fd.get(), meta.data(), meta.size(), sizeof(hdr))) {
+        return stale(path, "truncated");
+    }
+    MetaReader in(meta);
+    if (in.get_string() != join_args(lib_args)) {
+        return stale(path, "different libraries");
+    }
+    auto slib_path = in.get_string();
+    if (!slib_path.empty() && (!file_key(slib_path.c_str(), &key) || memcmp(&key, &hdr.slib, sizeof(key)) != 0)) {
+        return stale(path, "different Slib");
+    }
+    auto slib_entry = in.get<uint32_t>();
+    auto load_exec = get_load_info(in);
+    auto load_slib = get_load_info(in);
+    auto regs = in.get<Regs>();
+    auto startup = in.get<Startup>();
+    auto magic = in.get<FarPointer>();
+    auto sigtab = in.get<FarPointer>();
+    auto time_id = in.get<uint16_t>();
+
+    /* Validate everything before touching the process, so that a bad snapshot can still fall back to loading */
+    struct Restored {
+        SavedSegment info;
+        std::vector<Segment::ValidRange> valid;
+        std::vector<off_t> offsets;
+    };
+    std::vector<Restored> segments(in.get<uint32_t>());
+    off_t data_start = MemOps::align_page_up(sizeof(hdr) + meta.size());
+    for (auto& s: segments) {
+        s.info = in.get<SavedSegment>();
+        bool ok = in.ok() && s.info.paged_size <= s.info.reserved && s.info.limit_size <= s.info.paged_size
+            && MemOps::is_page_aligned(s.info.paged_size);
+        size_t end = 0;
+        for (uint32_t i = 0; ok && i < s.info.range_count; i++) {
+            auto r = in.get<SavedRange>();
+            ok = in.ok() && MemOps::is_page_aligned(r.start) && MemOps::is_page_aligned(r.end)
+                && r.start >= end && r.end > r.start && r.end <= s.info.paged_size
+                && data_start + r.data_offset + (r.end - r.start) <= static_cast<uint64_t>(st.st_size);
+            s.valid.push_back(Segment::ValidRange{r.start, r.end});
+            s.offsets.push_back(data_start + r.data_offset);
+            end = r.end;
+        }
+        if (!ok) {
+            return stale(path, "invalid segment");
+        }
+    }
+    std::vector<SavedDescriptor> descriptors(in.get<uint32_t>());
+    for (auto& d: descriptors) {
+        d = in.get<SavedDescriptor>();
+        if (d.segment >= segments.size() || d.access > static_cast<uint8_t>(Access::EXEC_ONLY) || d.bits > B32) {
+            return stale(path, "invalid descriptor");
+        }
+    }
+    if (!in.ok() || regs.esp > startup.esp || startup.esp - regs.esp > MAX_STACK_LEFTOVER) {
+        return stale(path, "invalid metadata");
+    }
+
+    std::vector<std::shared_ptr<Segment>> segs;
+    for (const auto& s: segments) {
+        auto seg = proc->allocate_segment();
+        seg->restore(s.info.reserved, s.info.paged_size, s.info.limit_size, s.valid, s.offsets, s.info.prot, fd.get());
+        if (s.info.shared) {
+            seg->make_shared();
+        }
+        segs.push_back(seg);
+    }
+    for (const auto& d: descriptors) {
+        proc->create_segment_descriptor_at(static_cast<Access>(d.access), segs[d.segment],
+            static_cast<Bitness>(d.bits), d.id);
+    }
+    proc->create_time_segment(time_id);
+
+    proc->m_bits = B32;
+    proc->m_load_exec = load_exec;
+    proc->m_load_slib = load_slib;
+    proc->m_slib_entry = slib_entry;
+    proc->m_slib_path = slib_path;
+    std::string realpath;
+    if (!Fsutil::realpath(exec.host_path(), realpath)) {
+        throw std::system_error(errno, std::system_category());
+    }
+    proc->m_executed_file = proc->path_mapper().map_path_to_qnx(realpath.c_str());
+
+    proc->m_magic_guest_pointer = magic;
+    proc->create_magic_pointer();
+    proc->m_magic = static_cast<Qnx::Magic*>(proc->translate_segmented(magic, sizeof(Qnx::Magic), RwOp::WRITE));
+    proc->m_magic->my_pid = proc->pid();
+    proc->m_magic->dads_pid = proc->parent_pid();
+    proc->m_magic->my_nid = proc->nid();
+
+    /* The handlers are in the guest memory, but the host signals must be set up again */
+    if (sigtab.m_segment) {
+        proc->m_sigtab = static_cast<Qnx::Sigtab*>(proc->translate_segmented(sigtab, sizeof(Qnx::Sigtab), RwOp::WRITE));
+        proc->m_sigtab_guest_pointer = sigtab;
+        for (int sig = Qnx::QSIGMIN; sig <= Qnx::QSIGMAX; sig++) {
+            auto& act = proc->m_sigtab->actions[sig - 1];
+            if (act.handler_fn != Qnx::QSIG_DFL) {
+                uint16_t flags = act.flags;
+                proc->m_emu.signal_sigact(sig, FarPointer(load_exec.cs, act.handler_fn), act.mask);
+                act.flags = flags;
+            }
+        }
+    }
+
+    /* Whatever the Slib left on the stack below the argument block moves with it */
+    std::vector<uint8_t> leftover(startup.esp - regs.esp);
+    if (!leftover.empty()) {
+        memcpy(leftover.data(), proc->translate_segmented(FarPointer(regs.ss, regs.esp), leftover.size()),
+            leftover.size());
+    }
+
+    auto data_sd = proc->descriptor_by_selector(load_exec.ss);
+    if (!data_sd) {
+        throw GuestStateException("Snapshot does not contain the data segment");
+    }
+    auto& ctx = proc->m_startup_context;
+    ctx.reg_eip() = regs.eip;
+    ctx.reg_cs() = regs.cs;
+    ctx.reg_ss() = regs.ss;
+    ctx.reg_ds() = regs.ds;
+    ctx.reg_es() = regs.es;
+    ctx.reg_fs() = regs.fs;
+    ctx.reg_gs() = regs.gs;
+    auto alloc = StartupSbrk(data_sd->segment().get(), magic.m_offset + sizeof(Qnx::Magic));
+    proc->setup_startup_args(data_sd, alloc, argc, argv);
+
+    /* Registers still holding what the startup put there get the values for this invocation */
+    auto pick = [](uint32_t snapshot, uint32_t saved_startup, uint32_t startup) {
+        return snapshot == saved_startup ? startup : snapshot;
+    };
+    ctx.reg_ebx() = pick(regs.ebx, startup.ebx, ctx.reg_ebx());
+    ctx.reg_ecx() = pick(regs.ecx, startup.ecx, ctx.reg_ecx());
+    ctx.reg_edx() = pick(regs.edx, startup.edx, ctx.reg_edx());
+    ctx.reg_edi() = pick(regs.edi, startup.edi, ctx.reg_edi());
+    ctx.reg_ebp() = pick(regs.ebp, startup.ebp, ctx.reg_ebp());
+    ctx.reg_eax() = regs.eax;
+    ctx.reg_esi() = regs.esi;
+    ctx.reg_esp() -= leftover.size();
+    if (!leftover.empty()) {
+        memcpy(proc->translate_segmented(FarPointer(regs.ss, ctx.reg_esp()), leftover.size(), RwOp::WRITE),
+            leftover.data(), leftover.size());
+    }
+
+    Log::print(Log::LOADER, "snapshot: restored %s, program start: %x:%x\n", path, regs.cs, regs.eip);
+    stat_restore.inc();
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class PathInfo;
+struct GuestContext;
+
+/*
+ * Snapshot of a guest stopped at the entry of the program, after the Slib has initialized.
+ *
+ * With --snapshot-save, qine runs the program up to its entry point, saves the contents and layout of all guest
+ * segments, the LDT layout, the registers and the magic and sigtab locations, and exits. With --snapshot, the
+ * segments are mapped privately from the snapshot instead of loading the executable and the Slib and running
+ * the Slib startup. The spawn message, arguments and environment of the new invocation are then written to the
+ * place they had when the snapshot was taken and the registers that described them are updated.
+ *
+ * The program's C runtime copies the arguments to its own variables, so the snapshot cannot be taken any later.
+ * A snapshot is only used if the executable, the Slib and the options affecting the guest memory are unchanged,
+ * otherwise the program is started normally.
+ */
+class Snapshot {
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    /* Stop the guest at the program entry and save the snapshot to path, for a 32-bit program ready to start */
+    void arm(const char *path, const PathInfo& exec, const std::vector<std::string>& lib_args);
+    /* Called on each guest fault, does not return if the guest reached the snapshot point */
+    inline void trap(GuestContext& ctx);
+
+    /* Restore the snapshot instead of loading the executable. Returns false if it does not fit this invocation. */
+    bool restore(const char *path, const PathInfo& exec, const std::vector<std::string>& lib_args,
+        int argc, char **argv);
+private:
+    struct FileKey;
+    struct Header;
+    struct Regs;
+    /* Registers set up by setup_startup_args */
+    struct Startup {
+        uint32_t ebx, ecx, edx, edi, ebp;
+        /* esp at the argument block */
+        uint32_t esp;
+    };
+
+    void save(GuestContext& ctx);
+    static bool file_key(const char *path, FileKey *key);
+
+    bool m_armed = false;
+    std::string m_path;
+    std::string m_exec_path;
+    std::string m_lib_args;
+    uint16_t m_entry_cs;
+    uint32_t m_entry;
+    uint8_t m_entry_byte;
+    Startup m_startup;
+};
+
+void Snapshot::trap(GuestContext& ctx) {
+    if (m_armed) {
+        save(ctx);
+    }
+}
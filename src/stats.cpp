@@ -0,0 +1,99 @@
+#include <cinttypes>
+#include <new>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "stats.h"
+
+Stats::Counter *Stats::m_head = nullptr;
+Stats::Counter Stats::guest_syscalls("emu.guest_syscalls");
+Stats::Counter Stats::host_syscalls("emu.host_syscalls", &Stats::guest_syscalls);
+#ifdef QINE_COUNT_ALLOCS
+Stats::Counter Stats::heap_allocs("heap.allocs", &Stats::guest_syscalls);
+#endif
+Stats::Counter Stats::first_syscall_ns("startup.first_syscall_ns");
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* Taken during static initialization, close enough to the exec of qine */
+static const uint64_t start_ns = now_ns();
+
+uint64_t Stats::since_start() {
+    return now_ns() - start_ns;
+}
+
+Stats::Timer::Timer(Counter& counter): m_counter(counter), m_start(now_ns()) {}
+
+Stats::Timer::~Timer() {
+    m_counter.inc(now_ns() - m_start);
+}
+
+#ifdef QINE_COUNT_ALLOCS
+/* 
+ * Count the heap allocations, so that we can see when the kernel call paths start allocating. Only the plain
+ * operator new is replaced, the default operator delete frees the memory with free().
+ * Allocations done before the counter is constructed are not counted. Only in builds with QINE_COUNT_ALLOCS,
+ * since every allocation pays for it.
+ */
+static void* counted_alloc(size_t size) noexcept {
+    Stats::heap_allocs.inc();
+    return malloc(size ? size : 1);
+}
+
+void* operator new(size_t size) {
+    void *p = counted_alloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+#endif
+
+Stats::Counter::Counter(const char *name, const Counter *per)
+    :m_name(name), m_per(per), m_value(0), m_next(m_head)
+{
+    m_head = this;
+}
+
+void Stats::print_at_exit() {
+    Log::if_enabled(Log::STATS, [] (FILE*) {
+        atexit([] {
+            Log::if_enabled(Log::STATS, [] (FILE *out) {
+                dump(out);
+            });
+        });
+    });
+}
+
+void Stats::dump(FILE *out) {
+    pid_t pid = getpid();
+    for (Counter *c = m_head; c; c = c->m_next) {
+        if (!c->m_value) {
+            continue;
+        }
+        if (c->m_per && c->m_per->m_value) {
+            fprintf(out, "stats %d: %s %" PRIu64 " (%.2f per %s)\n", pid, c->m_name, c->m_value,
+                static_cast<double>(c->m_value) / c->m_per->m_value, c->m_per->m_name);
+        } else {
+            fprintf(out, "stats %d: %s %" PRIu64 "\n", pid, c->m_name, c->m_value);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <stdio.h>
+
+/*
+ * Named event counters for performance work.
+ *
+ * Counters are defined as statics next to the code that bumps them and register themselves on construction.
+ * They are printed when the process exits, if the `stats` log category is enabled.
+ */
+class Stats {
+public:
+    class Counter {
+        friend class Stats;
+    public:
+        /* If `per` is given, the counter is also printed as a ratio to it */
+        explicit Counter(const char *name, const Counter *per = nullptr);
+        void inc(uint64_t n = 1) { m_value += n; }
+        uint64_t value() const { return m_value; }
+    private:
+        const char *m_name;
+        const Counter *m_per;
+        uint64_t m_value;
+        Counter *m_next;
+    };
+
+    /* Adds the wall time spent in its scope to a counter, in nanoseconds */
+    class Timer {
+    public:
+        explicit Timer(Counter& counter);
+        ~Timer();
+    private:
+        Counter& m_counter;
+        uint64_t m_start;
+    };
+
+    /* Nanoseconds since the process was started */
+    static uint64_t since_start();
+
+    /* Register the exit hook, call once the log categories are set up */
+    static void print_at_exit();
+    static void dump(FILE *out);
+
+    /* Kernel calls done by the guest */
+    static Counter guest_syscalls;
+    /* Host syscalls needed to get in and out of the emulator, not counting the ones implementing the call */
+    static Counter host_syscalls;
+#ifdef QINE_COUNT_ALLOCS
+    /* Calls to operator new */
+    static Counter heap_allocs;
+#endif
+    /* Time from the process start to the first guest kernel call */
+    static Counter first_syscall_ns;
+private:
+    static Counter *m_head;
+};
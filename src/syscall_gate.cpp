@@ -0,0 +1,364 @@
+#include <asm/ldt.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "syscall_gate.h"
+#include "log.h"
+#include "mem_ops.h"
+#include "process.h"
+#include "segment.h"
+#include "segment_descriptor.h"
+#include "util.h"
+
+/*
+ * The gate code template. It is never executed in place, it is copied into a segment below 4GB
+ * (far pointers have only 32-bit offsets) together with the frame, which it addresses RIP-relative.
+ * The numeric offsets must match SyscallGate::Frame.
+ */
+__asm__(R"(
+    .pushsection .rodata.qine_gate, "a"
+    .balign 4096
+    .globl qine_gate_blob_start, qine_gate_blob_end, qine_gate_frame
+    .globl qine_gate_entry_f0, qine_gate_entry_f1, qine_gate_entry_f2
+    .globl qine_gate_prologue_start, qine_gate_prologue_end
+    .globl qine_gate_epilogue_start, qine_gate_epilogue_end
+    .hidden qine_gate_blob_start, qine_gate_blob_end, qine_gate_frame
+    .hidden qine_gate_entry_f0, qine_gate_entry_f1, qine_gate_entry_f2
+    .hidden qine_gate_prologue_start, qine_gate_prologue_end
+    .hidden qine_gate_epilogue_start, qine_gate_epilogue_end
+qine_gate_blob_start:
+qine_gate_prologue_start:
+qine_gate_entry_f2:
+    movl $0xF2, qine_gate_frame+52(%rip)
+    jmp 1f
+qine_gate_entry_f1:
+    movl $0xF1, qine_gate_frame+52(%rip)
+    jmp 1f
+qine_gate_entry_f0:
+    movl $0xF0, qine_gate_frame+52(%rip)
+1:
+    movw %ds, qine_gate_frame+44(%rip)
+    movw %es, qine_gate_frame+46(%rip)
+    movw %fs, qine_gate_frame+48(%rip)
+    movw %gs, qine_gate_frame+50(%rip)
+qine_gate_prologue_end:
+    movw %ss, qine_gate_frame+42(%rip)
+    movl %eax, qine_gate_frame+0(%rip)
+    movl %ecx, qine_gate_frame+4(%rip)
+    movl %edx, qine_gate_frame+8(%rip)
+    movl %ebx, qine_gate_frame+12(%rip)
+    movl %esp, qine_gate_frame+16(%rip)
+    movl %ebp, qine_gate_frame+20(%rip)
+    movl %esi, qine_gate_frame+24(%rip)
+    movl %edi, qine_gate_frame+28(%rip)
+    movq qine_gate_frame+56(%rip), %rsp
+    pushfq
+    popq %rax
+    movl %eax, qine_gate_frame+36(%rip)
+    cld
+    fxsave64 qine_gate_frame+80(%rip)
+    fninit
+    ldmxcsr 2f(%rip)
+    leaq qine_gate_frame(%rip), %rdi
+    callq *qine_gate_frame+64(%rip)
+    fxrstor64 qine_gate_frame+80(%rip)
+    movzwl qine_gate_frame+42(%rip), %eax
+    pushq %rax
+    movl qine_gate_frame+16(%rip), %eax
+    pushq %rax
+    movl qine_gate_frame+36(%rip), %eax
+    pushq %rax
+    movzwl qine_gate_frame+40(%rip), %eax
+    pushq %rax
+    movl qine_gate_frame+32(%rip), %eax
+    pushq %rax
+qine_gate_epilogue_start:
+    movw qine_gate_frame+44(%rip), %ds
+    movw qine_gate_frame+46(%rip), %es
+    movw qine_gate_frame+48(%rip), %fs
+    movw qine_gate_frame+50(%rip), %gs
+    movl qine_gate_frame+0(%rip), %eax
+    movl qine_gate_frame+4(%rip), %ecx
+    movl qine_gate_frame+8(%rip), %edx
+    movl qine_gate_frame+12(%rip), %ebx
+    movl qine_gate_frame+20(%rip), %ebp
+    movl qine_gate_frame+24(%rip), %esi
+    movl qine_gate_frame+28(%rip), %edi
+    iretq
+qine_gate_epilogue_end:
+    .balign 4
+2:
+    .long 0x1f80
+    /* Keep the data away from the code, stores to a page with code being executed are very slow */
+    .balign 4096
+qine_gate_frame:
+    .zero 592
+qine_gate_blob_end:
+    .popsection
+)");
+
+extern "C" {
+    extern const char qine_gate_blob_start[], qine_gate_blob_end[], qine_gate_frame[];
+    extern const char qine_gate_entry_f0[], qine_gate_entry_f1[], qine_gate_entry_f2[];
+    extern const char qine_gate_prologue_start[], qine_gate_prologue_end[];
+    extern const char qine_gate_epilogue_start[], qine_gate_epilogue_end[];
+}
+
+static_assert(offsetof(SyscallGate::Frame, esp) == 16, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, eip) == 32, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, eflags) == 36, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, cs) == 40, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, ss) == 42, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, ds) == 44, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, gs) == 50, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, int_nr) == 52, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, host_rsp) == 56, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, handler) == 64, "gate frame layout mismatch");
+static_assert(offsetof(SyscallGate::Frame, fxsave) == 80, "gate frame layout mismatch");
+static_assert(sizeof(SyscallGate::Frame) == 592, "gate frame layout mismatch");
+
+SyscallGate::SyscallGate():
+    m_enabled(false), m_host_cs(0), m_frame(nullptr), m_stub_pos(0)
+{
+}
+
+SyscallGate::~SyscallGate() {
+}
+
+uint32_t SyscallGate::blob_symbol(const void *sym) const {
+    return static_cast<const char*>(sym) - qine_gate_blob_start;
+}
+
+void SyscallGate::install(Handler handler) {
+    auto proc = Process::current();
+    size_t blob_size = qine_gate_blob_end - qine_gate_blob_start;
+
+    m_segment = proc->allocate_segment();
+    m_segment->reserve(GATE_SIZE);
+    m_segment->grow_paged(PROT_READ | PROT_WRITE | PROT_EXEC, GATE_SIZE);
+    memcpy(m_segment->pointer(0, blob_size), qine_gate_blob_start, blob_size);
+    // stubs go to their own pages, away from the frame
+    m_stub_pos = MemOps::align_page_up(blob_size);
+
+    size_t stack_size = MemOps::PAGE_SIZE*8;
+    m_stack = proc->allocate_segment();
+    m_stack->reserve(MemOps::PAGE_SIZE + stack_size);
+    m_stack->skip_paged(MemOps::PAGE_SIZE);
+    m_stack->grow_paged(PROT_READ | PROT_WRITE, stack_size);
+
+    m_frame = reinterpret_cast<Frame*>(m_segment->pointer(blob_symbol(qine_gate_frame), sizeof(Frame)));
+    m_frame->host_rsp = m_stack->location() + MemOps::PAGE_SIZE + stack_size;
+    m_frame->handler = reinterpret_cast<uintptr_t>(handler);
+
+    __asm__ ("mov %%cs, %0": "=r" (m_host_cs));
+
+    for (uint8_t int_nr: {0xF0, 0xF1, 0xF2}) {
+        struct user_desc ud = {0};
+        ud.entry_number = SegmentDescriptor::sel_to_id(gate_selector(int_nr));
+        ud.base_addr = m_segment->location();
+        ud.limit = GATE_SIZE - 1;
+        ud.seg_32bit = 1;
+        ud.contents = 2;
+        ud.useable = 1;
+        int r = syscall(SYS_modify_ldt, 1, &ud, sizeof(ud));
+        if (r != 0) {
+            throw std::logic_error(strerror(errno));
+        }
+    }
+    Log::print(Log::GATE, "syscall gate at %x, host cs %x\n", m_segment->location(), m_host_cs);
+}
+
+uint32_t SyscallGate::entry_for(uint8_t int_nr) const {
+    switch (int_nr) {
+        case 0xF0:
+            return blob_symbol(qine_gate_entry_f0);
+        case 0xF1:
+            return blob_symbol(qine_gate_entry_f1);
+        default:
+            return blob_symbol(qine_gate_entry_f2);
+    }
+}
+
+uint32_t SyscallGate::stub_for(const uint8_t *insn, size_t insn_len, uint8_t int_nr, bool b16) {
+    uint64_t key = static_cast<uint64_t>(int_nr) << 48 | static_cast<uint64_t>(b16) << 40;
+    for (size_t i = 0; i < insn_len; i++) {
+        key |= static_cast<uint64_t>(insn[i]) << (8 * i);
+    }
+
+    auto it = m_stubs.find(key);
+    if (it != m_stubs.end()) {
+        return it->second;
+    }
+
+    if (m_stub_pos + STUB_SIZE > GATE_SIZE) {
+        return 0;
+    }
+
+    /* The stub runs in 32-bit code segment, 16-bit mov needs operand size override */
+    auto stub = static_cast<uint8_t*>(m_segment->pointer(m_stub_pos, STUB_SIZE));
+    size_t pos = 0;
+    if (b16) {
+        stub[pos++] = 0x66;
+    }
+    memcpy(stub + pos, insn, insn_len);
+    pos += insn_len;
+
+    /* ljmp host_cs:entry */
+    uint32_t entry = m_segment->location() + entry_for(int_nr);
+    stub[pos++] = 0xEA;
+    memcpy(stub + pos, &entry, sizeof(entry));
+    pos += sizeof(entry);
+    memcpy(stub + pos, &m_host_cs, sizeof(m_host_cs));
+
+    uint32_t stub_offset = m_stub_pos;
+    m_stub_pos += STUB_SIZE;
+    m_stubs[key] = stub_offset;
+    return stub_offset;
+}
+
+uint32_t& SyscallGate::guest_reg(GuestContext& ctx, int reg) {
+    switch (reg) {
+        case 0: return ctx.reg_eax();
+        case 1: return ctx.reg_ecx();
+        case 2: return ctx.reg_edx();
+        case 3: return ctx.reg_ebx();
+        case 4: return ctx.reg_esp();
+        case 5: return ctx.reg_ebp();
+        case 6: return ctx.reg_esi();
+        default: return ctx.reg_edi();
+    }
+}
+
+bool SyscallGate::redirect(GuestContext& ctx, uint8_t int_nr, Bitness bits) {
+    if (!m_segment) {
+        return false;
+    }
+
+    bool b16 = bits == B16;
+    size_t mov_len = b16 ? 3 : 5;
+    uint32_t site = ctx.reg_eip();
+    if (site < mov_len) {
+        return false;
+    }
+
+    uint32_t start = site - mov_len;
+    uint8_t insn[5];
+    try {
+        ctx.read_data(GuestContext::CS, insn, start, mov_len);
+    } catch (const SegmentationFault&) {
+        return false;
+    }
+
+    // mov reg, imm, but not to esp
+    if (insn[0] < 0xB8 || insn[0] > 0xBF || insn[0] == 0xBC) {
+        return false;
+    }
+
+    /* The bytes might just be a tail of a longer instruction or the int might have been reached by a jump.
+     * If the register does not hold the immediate, it is certainly one of these. */
+    uint32_t imm = 0;
+    memcpy(&imm, insn + 1, mov_len - 1);
+    uint32_t value = guest_reg(ctx, insn[0] - 0xB8);
+    if (b16) {
+        value &= 0xFFFF;
+    }
+    if (value != imm) {
+        return false;
+    }
+
+    uint32_t stub = stub_for(insn, mov_len, int_nr, b16);
+    if (!stub) {
+        return false;
+    }
+
+    uint8_t patch[7];
+    uint16_t selector = gate_selector(int_nr);
+    patch[0] = 0x9A;
+    memcpy(patch + 1, &stub, mov_len - 1);
+    memcpy(patch + mov_len, &selector, sizeof(selector));
+
+    void *dst;
+    try {
+        dst = ctx.translate(GuestContext::CS, start, mov_len + 2);
+    } catch (const SegmentationFault&) {
+        return false;
+    }
+    if (!write_code(dst, patch, mov_len + 2)) {
+        return false;
+    }
+
+    Log::print(Log::GATE, "redirected %x:%x (int %x) to gate stub %x\n", ctx.reg_cs(), start, int_nr, stub);
+    return true;
+}
+
+void SyscallGate::load_context(Frame& frame, GuestContext& ctx, Bitness bits) {
+    memset(ctx.m_ctx->uc_mcontext.gregs, 0, sizeof(ctx.m_ctx->uc_mcontext.gregs));
+    ctx.reg_eax() = frame.eax;
+    ctx.reg_ecx() = frame.ecx;
+    ctx.reg_edx() = frame.edx;
+    ctx.reg_ebx() = frame.ebx;
+    ctx.reg_esp() = frame.esp;
+    ctx.reg_ebp() = frame.ebp;
+    ctx.reg_esi() = frame.esi;
+    ctx.reg_edi() = frame.edi;
+    ctx.reg_eflags() = frame.eflags;
+    ctx.reg_ss() = frame.ss;
+    ctx.reg_ds() = frame.ds;
+    ctx.reg_es() = frame.es;
+    ctx.reg_fs() = frame.fs;
+    ctx.reg_gs() = frame.gs;
+    ctx.m_ectx->fs = frame.fs;
+    ctx.m_ectx->gs = frame.gs;
+
+    if (bits == B16) {
+        ctx.reg_eip() = ctx.pop_stack16();
+        ctx.reg_cs() = ctx.pop_stack16();
+    } else {
+        ctx.reg_eip() = ctx.pop_stack();
+        ctx.reg_cs() = ctx.pop_stack();
+    }
+}
+
+void SyscallGate::store_context(GuestContext& ctx, Frame& frame) {
+    frame.eax = ctx.reg_eax();
+    frame.ecx = ctx.reg_ecx();
+    frame.edx = ctx.reg_edx();
+    frame.ebx = ctx.reg_ebx();
+    frame.esp = ctx.reg_esp();
+    frame.ebp = ctx.reg_ebp();
+    frame.esi = ctx.reg_esi();
+    frame.edi = ctx.reg_edi();
+    frame.eip = ctx.reg_eip();
+    frame.eflags = ctx.reg_eflags();
+    frame.cs = ctx.reg_cs();
+    frame.ss = ctx.reg_ss();
+    frame.ds = ctx.reg_ds();
+    frame.es = ctx.reg_es();
+    frame.fs = ctx.m_ectx->fs;
+    frame.gs = ctx.m_ectx->gs;
+}
+
+void SyscallGate::fixup_host_return(GuestContext& ctx) {
+    if (!m_segment) {
+        return;
+    }
+
+    // the host code is not below 4GB, we need the full RIP
+    auto& rip = ctx.m_ctx->uc_mcontext.gregs[REG_RIP];
+    auto in_blob = [&rip, this] (const char *start, const char *end) {
+        greg_t base = m_segment->location();
+        return rip >= base + blob_symbol(start) && rip < base + blob_symbol(end);
+    };
+
+    if (in_blob(qine_gate_prologue_start, qine_gate_prologue_end)) {
+        // guest segments are not saved yet, put them back
+        ctx.m_ectx->to_cpu();
+    } else if (in_blob(qine_gate_epilogue_start, qine_gate_epilogue_end)) {
+        // restart loading of the guest segments, the frame is still intact
+        rip = m_segment->location() + blob_symbol(qine_gate_epilogue_start);
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include "guest_context.h"
+#include "types.h"
+
+class Segment;
+
+/*
+ * Signal-free entry into the emulator for QNX kernel calls.
+ *
+ * A trapping site of the form `mov reg, imm; int 0xFx` is rewritten into a direct far call to a gate selector.
+ * The gate selectors are chosen so that their encoding is `CD Fx`, so the last two bytes of the far call are
+ * still the original int. A jump directly onto the int thus still traps the old way and nothing else changes
+ * for the code around the site.
+ *
+ * The far call lands in a small 32-bit stub that replays the `mov` and jumps to the 64-bit host entry.
+ * The entry saves the guest state into the Frame and calls the handler on its own stack. The return
+ * to the guest is done using iretq, since it needs to restore SS:ESP and EFLAGS at the same time.
+ *
+ * The SIGSEGV path remains the fallback for all sites that do not match the pattern.
+ */
+class SyscallGate {
+public:
+    /* Guest state as saved by the host entry. Layout is shared with the assembly in syscall_gate.cpp */
+    struct Frame {
+        /* pushad order */
+        uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+        uint32_t eip;
+        uint32_t eflags;
+        uint16_t cs, ss, ds, es, fs, gs;
+        uint32_t int_nr;
+        uint64_t host_rsp;
+        uint64_t handler;
+        uint64_t reserved;
+        alignas(16) uint8_t fxsave[512];
+    };
+    using Handler = void (*)(Frame *frame);
+
+    SyscallGate();
+    ~SyscallGate();
+
+    void enable() { m_enabled = true; }
+    bool enabled() const { return m_enabled; }
+    void install(Handler handler);
+
+    /* Try to redirect the site that just trapped. EIP must point to the int instruction. */
+    bool redirect(GuestContext& ctx, uint8_t int_nr, Bitness bits);
+
+    /* Load the guest context from the frame, including popping the far return address */
+    static void load_context(Frame& frame, GuestContext& ctx, Bitness bits);
+    static void store_context(GuestContext& ctx, Frame& frame);
+
+    /*
+     * Must be called when a host signal returns to host code. If we interrupted the gate
+     * while it had guest segments loaded, the TLS fixup in the handler broke them, so repair them.
+     */
+    void fixup_host_return(GuestContext& ctx);
+
+    static constexpr uint16_t gate_selector(uint8_t int_nr);
+private:
+    uint32_t stub_for(const uint8_t *insn, size_t insn_len, uint8_t int_nr, bool b16);
+    uint32_t entry_for(uint8_t int_nr) const;
+    uint32_t blob_symbol(const void *sym) const;
+    static uint32_t& guest_reg(GuestContext& ctx, int reg);
+
+    bool m_enabled;
+    uint16_t m_host_cs;
+    std::shared_ptr<Segment> m_segment;
+    std::shared_ptr<Segment> m_stack;
+    Frame *m_frame;
+    uint32_t m_stub_pos;
+    std::unordered_map<uint64_t, uint32_t> m_stubs;
+
+    static constexpr size_t GATE_SIZE = 64 * 1024;
+    static constexpr size_t STUB_SIZE = 16;
+};
+
+constexpr uint16_t SyscallGate::gate_selector(uint8_t int_nr) {
+    /* Little-endian encoding of `int int_nr`. The low byte (0xCD) selects LDT and RPL 1, which is fine for a call. */
+    return (static_cast<uint16_t>(int_nr) << 8) | 0xCD;
+}
@@ -375,6 +375,7 @@ void MainHandler::dev_read(MsgContext &i) {
         return;
     }
 
+    i.proc().result_cache().uncacheable("reads a terminal");
     auto fd = i.proc().fds().get_open_fd(msg.m_fd);
     if (fd->m_filter) {
         fd->m_filter->dev_read(i,*fd, msg);
@@ -395,7 +396,7 @@ void MainHandler::dev_read(MsgContext &i) {
 
     QnxMsg::dev::read_reply reply;
     clear(&reply);
-    std::vector<struct iovec> iov;
+    ScratchVector<struct iovec> iov(i.proc().scratch());
     i.msg().write_iovec(sizeof(reply), msg.m_nbytes, iov);
 
     r = readv(fd->m_host_fd, iov.data(), iov.size());
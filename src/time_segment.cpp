@@ -0,0 +1,117 @@
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "log.h"
+#include "mem_ops.h"
+#include "time_segment.h"
+#include "timespec.h"
+
+TimeSegment::TimeSegment(): m_timesel(nullptr), m_rate(DEFAULT_RATE), m_armed(false) {}
+
+void TimeSegment::attach(Qnx::timesel *timesel) {
+    m_timesel = timesel;
+    m_timesel->cnt8254 = 0;
+    m_timesel->nsec_inc = 0;
+    m_timesel->cycles_per_sec = 1000;
+    refresh();
+}
+
+void TimeSegment::start() {
+    if (refresh_on_syscall() || !m_timesel) {
+        return;
+    }
+    if (mprotect(m_timesel, MemOps::PAGE_SIZE, PROT_NONE) != 0) {
+        Log::print(Log::SIG, "time segment: cannot arm, refreshing on kernel calls: %s\n", strerror(errno));
+        m_rate = 0;
+        return;
+    }
+    m_armed = true;
+}
+
+bool TimeSegment::handle_fault(const void *addr) {
+    auto page = reinterpret_cast<const char*>(m_timesel);
+    auto p = static_cast<const char*>(addr);
+    if (!m_armed || p < page || p >= page + MemOps::PAGE_SIZE) {
+        return false;
+    }
+    wake();
+    return true;
+}
+
+void TimeSegment::wake() {
+    if (!m_armed) {
+        return;
+    }
+    m_armed = false;
+    mprotect(m_timesel, MemOps::PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC);
+    refresh();
+    if (!start_thread()) {
+        m_rate = 0;
+    }
+}
+
+bool TimeSegment::start_thread() {
+    /* The thread must not receive any signals, they are for the guest */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int r = pthread_create(&thread, &attr, &TimeSegment::thread_main, this);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    if (r != 0) {
+        Log::print(Log::SIG, "time segment: no thread, refreshing on kernel calls: %s\n", strerror(r));
+        return false;
+    }
+    return true;
+}
+
+void TimeSegment::refresh() {
+    Timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t cycles = static_cast<int64_t>(now.tv_sec) * 1000 + static_cast<int64_t>(now.tv_nsec) / 1000 / 1000;
+
+    /*
+     * The guest reads the fields without any locking, so nsec and seconds, and cycle_lo and cycle_hi are adjacent
+     * pairs that are each published by a single 64-bit store (the segment is page aligned).
+     */
+    static_assert(offsetof(Qnx::timesel, seconds) == offsetof(Qnx::timesel, nsec) + 4);
+    static_assert(offsetof(Qnx::timesel, cycle_hi) == offsetof(Qnx::timesel, cycle_lo) + 4);
+    static_assert(offsetof(Qnx::timesel, nsec) % 8 == 0 && offsetof(Qnx::timesel, cycle_lo) % 8 == 0);
+    auto t = reinterpret_cast<char*>(m_timesel);
+    uint64_t time = static_cast<uint32_t>(now.tv_nsec) | static_cast<uint64_t>(static_cast<uint32_t>(now.tv_sec)) << 32;
+    __atomic_store_n(reinterpret_cast<uint64_t*>(t + offsetof(Qnx::timesel, cycle_lo)), static_cast<uint64_t>(cycles),
+        __ATOMIC_RELEASE);
+    __atomic_store_n(reinterpret_cast<uint64_t*>(t + offsetof(Qnx::timesel, nsec)), time, __ATOMIC_RELEASE);
+}
+
+void* TimeSegment::thread_main(void *arg) {
+    auto self = static_cast<TimeSegment*>(arg);
+    auto period = Timespec(0, 1000 * 1000 * 1000 / self->m_rate);
+
+    Timespec next, now;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;) {
+        next = next + period;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr) == EINTR) {}
+        self->refresh();
+
+        // do not try to catch up if we were stopped for a while
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now >= next + period) {
+            next = now;
+        }
+    }
+    return nullptr;
+}
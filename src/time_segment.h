@@ -0,0 +1,40 @@
+#pragma once
+
+#include "qnx/osinfo.h"
+
+/*
+ * Keeps the QNX time segment (Qnx::timesel) up to date.
+ *
+ * On QNX, the kernel updates the segment on each tick and the guests read it directly. Here a helper thread
+ * refreshes it m_rate times per second, so that kernel calls do not pay for it and guests polling the time without
+ * doing kernel calls still see it advance.
+ *
+ * Most short-lived tools never read the time, so the thread is only started when the segment is first touched: until
+ * then its page is inaccessible, and the fault (or a kernel access through translate_segmented) calls wake. With rate
+ * 0, the segment is refreshed on each kernel call instead.
+ */
+class TimeSegment {
+public:
+    TimeSegment();
+
+    void set_rate(unsigned hz) { m_rate = hz; }
+    /* timesel is at the start of its own page */
+    void attach(Qnx::timesel *timesel);
+    /* Make the segment inaccessible until it is touched. Must be called again in a forked child, it has no thread. */
+    void start();
+    /* If the guest faulted on the armed segment, wake and return true */
+    bool handle_fault(const void *addr);
+    /* Refresh the segment, make it accessible and start the thread, if it is armed */
+    void wake();
+    void refresh();
+    bool refresh_on_syscall() const { return m_rate == 0; }
+
+    static constexpr unsigned DEFAULT_RATE = 1000;
+private:
+    static void* thread_main(void *arg);
+    bool start_thread();
+
+    Qnx::timesel *m_timesel;
+    unsigned m_rate;
+    bool m_armed;
+};
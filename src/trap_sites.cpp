@@ -0,0 +1,58 @@
+#include "segment_descriptor.h"
+#include "stats.h"
+#include "trap_sites.h"
+
+static Stats::Counter stat_hit("trap_site.hit");
+static Stats::Counter stat_miss("trap_site.miss");
+static Stats::Counter stat_stale("trap_site.stale");
+static Stats::Counter stat_invalidated("trap_site.invalidated");
+
+TrapSites::Site* TrapSites::lookup(uint16_t cs, uint32_t eip) {
+    auto it = m_sites.find(key(cs, eip));
+    if (it == m_sites.end()) {
+        stat_miss.inc();
+        return nullptr;
+    }
+
+    if (!matches(it->second)) {
+        stat_stale.inc();
+        stat_miss.inc();
+        m_sites.erase(it);
+        return nullptr;
+    }
+
+    stat_hit.inc();
+    it->second.hits++;
+    return &it->second;
+}
+
+TrapSites::Site* TrapSites::insert(uint16_t cs, uint32_t eip, const uint8_t *insn, uint8_t len, uint8_t int_nr) {
+    Site site = {insn, len, int_nr, 0};
+    auto r = m_sites.insert_or_assign(key(cs, eip), site);
+    return &r.first->second;
+}
+
+void TrapSites::forget(uint16_t cs, uint32_t eip) {
+    m_sites.erase(key(cs, eip));
+}
+
+void TrapSites::invalidate_segment(uint16_t sel) {
+    auto id = SegmentDescriptor::sel_to_id(sel);
+    for (auto it = m_sites.begin(); it != m_sites.end();) {
+        auto site_cs = static_cast<uint16_t>(it->first >> 32);
+        if (SegmentDescriptor::sel_to_id(site_cs) == id) {
+            stat_invalidated.inc();
+            it = m_sites.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool TrapSites::matches(const Site& site) {
+    const uint8_t *p = site.insn;
+    if (site.len == 3 && *p++ != 0x66) {
+        return false;
+    }
+    return p[0] == 0xCD && p[1] == site.int_nr;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+
+/*
+ * Cache of the kernel call sites (`int 0xF0-0xF2`) that trapped in the current process, keyed by CS:EIP.
+ *
+ * The same few sites (mostly in Slib) trap over and over, so we remember the decoded instruction
+ * instead of reading it through the segment translation each time. Each site keeps a host pointer to
+ * its code, so that a hit can be checked against the actual bytes; a site overwritten by the guest
+ * (or by us) simply stops matching. Sites in a segment that is freed or changed must be invalidated
+ * explicitly, since the host pointer is no longer valid then.
+ */
+class TrapSites {
+public:
+    struct Site {
+        /* Host pointer to the instruction, including prefix */
+        const uint8_t *insn;
+        uint8_t len;
+        uint8_t int_nr;
+        uint32_t hits;
+    };
+
+    /* Returns the cached site at CS:EIP if its code still matches */
+    Site* lookup(uint16_t cs, uint32_t eip);
+    Site* insert(uint16_t cs, uint32_t eip, const uint8_t *insn, uint8_t len, uint8_t int_nr);
+    void forget(uint16_t cs, uint32_t eip);
+    /* Forget all sites in the segment with the given selector */
+    void invalidate_segment(uint16_t sel);
+
+    /* Number of hits after which the site can be considered stable and rewritten */
+    static constexpr uint32_t STABLE_HITS = 2;
+private:
+    static uint64_t key(uint16_t cs, uint32_t eip) {
+        return (static_cast<uint64_t>(cs) << 32) | eip;
+    }
+    static bool matches(const Site& site);
+
+    std::unordered_map<uint64_t, Site> m_sites;
+};
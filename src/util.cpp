@@ -1,7 +1,10 @@
 #include "util.h"
+#include "unique_fd.h"
+#include <fcntl.h>
 #include <stdexcept>
 #include <stdint.h>
 #include <memory.h>
+#include <unistd.h>
 
 bool starts_with(std::string_view string, std::string_view prefix) {
     if (prefix.length() > string.length())
@@ -41,4 +44,15 @@ size_t qine_strlcpy(char * dst, const char * src, size_t maxlen) {
         dst[maxlen-1] = '\0';
     }
     return srclen;
-}
\ No newline at end of file
+}
+
+bool write_code(void *dst, const void *src, size_t size) {
+    /* Code segments need not be writable, /proc/self/mem writes regardless of the protection.
+     * Do not keep the fd, it would refer to the parent memory after fork. */
+    UniqueFd mem(open("/proc/self/mem", O_RDWR | O_CLOEXEC));
+    if (!mem.valid()) {
+        return false;
+    }
+    auto r = pwrite(mem.get(), src, size, reinterpret_cast<uintptr_t>(dst));
+    return r == static_cast<ssize_t>(size);
+}
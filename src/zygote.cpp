@@ -0,0 +1,265 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <map>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "process.h"
+#include "qnx_fd.h"
+#include "unique_fd.h"
+#include "util.h"
+#include "zygote.h"
+
+using Zygote::Request;
+
+static_assert(Zygote::RLIMITS == RLIMIT_NLIMITS);
+
+static bool read_full(int fd, void *dst, size_t size) {
+    auto p = static_cast<uint8_t*>(dst);
+    while (size) {
+        ssize_t r = read(fd, p, size);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        size -= r;
+    }
+    return true;
+}
+
+static void send_int(int fd, int32_t v) {
+    // the client may be gone, do not die on SIGPIPE (and do not make the children inherit SIG_IGN)
+    send(fd, &v, sizeof(v), MSG_NOSIGNAL);
+}
+
+static bool recv_request(int conn, Request& req, UniqueFd fds[Zygote::STDIO_FDS], std::vector<char>& strings) {
+    struct iovec iov = {&req, sizeof(req)};
+    alignas(struct cmsghdr) char cbuf[CMSG_SPACE(sizeof(int) * Zygote::STDIO_FDS)];
+    struct msghdr mh = {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+
+    ssize_t r = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    for (auto cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (i < Zygote::STDIO_FDS) {
+                fds[i] = UniqueFd(fd);
+            } else {
+                close(fd);
+            }
+        }
+    }
+
+    if (r != sizeof(req) || req.magic != Zygote::MAGIC || req.size > Zygote::MAX_SIZE
+        || req.ctty < -1 || req.ctty >= Zygote::STDIO_FDS)
+    {
+        return false;
+    }
+    strings.resize(req.size);
+    if (!read_full(conn, strings.data(), req.size)) {
+        return false;
+    }
+    return req.size == 0 || strings.back() == 0;
+}
+
+/* In the forked child, make it look like it was started by the client */
+static void setup_child(Process *proc, pid_t client, const Request& req, UniqueFd fds[Zygote::STDIO_FDS],
+    const std::vector<char>& strings, std::vector<std::string>& argv)
+{
+    // do not get killed along with the zygote or get its terminal signals, the client forwards the signals
+    setsid();
+
+    for (int i = 0; i < Zygote::STDIO_FDS; i++) {
+        if (fds[i].valid() && dup2(fds[i].get(), i) < 0) {
+            perror("zygote: dup2");
+            exit(127);
+        }
+        // the entries of the zygote are for its own stdio, which may even have been closed
+        proc->fds().rescan_host_fd(i, proc->nid(), 1, 1);
+    }
+    // only possible if the session of the client has given up the terminal, otherwise it is just not controlling
+    if (req.ctty >= 0 && ioctl(req.ctty, TIOCSCTTY, 0) < 0) {
+        Log::print(Log::LOADER, "zygote: controlling terminal not taken: %s\n", strerror(errno));
+    }
+
+    umask(req.umask);
+    for (int r = 0; r < Zygote::RLIMITS; r++) {
+        struct rlimit lim = {req.rlimits[r][0], req.rlimits[r][1]};
+        if ((r == RLIMIT_NOFILE ? FdMap::set_fd_limit(lim) : setrlimit(r, &lim)) < 0) {
+            // e.g. a hard limit above the one of the zygote
+            Log::print(Log::LOADER, "zygote: setrlimit %d: %s\n", r, strerror(errno));
+        }
+    }
+
+    const char *p = strings.data();
+    const char *end = p + strings.size();
+    auto next = [&p, end] () -> const char* {
+        if (p >= end) {
+            return nullptr;
+        }
+        const char *s = p;
+        p += strlen(p) + 1;
+        return s;
+    };
+
+    const char *cwd = next();
+    if (!cwd || chdir(cwd) < 0) {
+        perror("zygote: chdir");
+        exit(127);
+    }
+
+    for (uint32_t i = 0; i < req.argc; i++) {
+        auto a = next();
+        if (!a) {
+            break;
+        }
+        argv.push_back(a);
+    }
+
+    clearenv();
+    for (uint32_t i = 0; i < req.envc; i++) {
+        auto e = next();
+        if (!e) {
+            break;
+        }
+        auto eq = strchr(e, '=');
+        if (eq) {
+            setenv(std::string(e, eq - e).c_str(), eq + 1, 1);
+        }
+    }
+
+    proc->update_pids_for_client(client);
+}
+
+static void reap(std::map<pid_t, int>& running) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        auto it = running.find(pid);
+        if (it == running.end()) {
+            continue;
+        }
+        Log::print(Log::LOADER, "zygote: %d exited with %x\n", pid, status);
+        send_int(it->second, status);
+        close(it->second);
+        running.erase(it);
+    }
+}
+
+void Zygote::serve(Process *proc, const char *socket_path, std::vector<std::string>& argv) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        throw ConfigurationError(std_printf("zygote socket path too long: %s", socket_path));
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    UniqueFd listen_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    unlink(socket_path);
+    if (!listen_fd.valid()
+        || bind(listen_fd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+        || listen(listen_fd.get(), 128) < 0)
+    {
+        throw ConfigurationError(std_printf("zygote socket %s: %s", socket_path, strerror(errno)));
+    }
+
+    sigset_t chld, old_mask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old_mask);
+    UniqueFd sig_fd(signalfd(-1, &chld, SFD_CLOEXEC));
+    if (!sig_fd.valid()) {
+        throw ConfigurationError(std_printf("zygote signalfd: %s", strerror(errno)));
+    }
+
+    /* Connections of the clients whose process is running, to report the exit status */
+    std::map<pid_t, int> running;
+    Log::print(Log::LOADER, "zygote: listening on %s\n", socket_path);
+
+    for (;;) {
+        struct pollfd polls[2] = {{listen_fd.get(), POLLIN, 0}, {sig_fd.get(), POLLIN, 0}};
+        if (poll(polls, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("zygote: poll");
+            exit(1);
+        }
+
+        if (polls[1].revents) {
+            struct signalfd_siginfo si;
+            read(sig_fd.get(), &si, sizeof(si));
+            reap(running);
+        }
+        if (!polls[0].revents) {
+            continue;
+        }
+
+        UniqueFd conn(accept4(listen_fd.get(), nullptr, nullptr, SOCK_CLOEXEC));
+        if (!conn.valid()) {
+            continue;
+        }
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(conn.get(), SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+            continue;
+        }
+        if (cred.uid != getuid()) {
+            Log::print(Log::LOADER, "zygote: connection of uid %d rejected\n", cred.uid);
+            continue;
+        }
+        struct timeval timeout = {RECV_TIMEOUT_MS / 1000, RECV_TIMEOUT_MS % 1000 * 1000};
+        setsockopt(conn.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        Request req;
+        UniqueFd fds[STDIO_FDS];
+        std::vector<char> strings;
+        if (!recv_request(conn.get(), req, fds, strings)) {
+            Log::print(Log::LOADER, "zygote: bad request\n");
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            for (auto& c: running) {
+                close(c.second);
+            }
+            conn.close();
+            listen_fd.close();
+            sig_fd.close();
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+            setup_child(proc, cred.pid, req, fds, strings, argv);
+            return;
+        }
+
+        if (pid < 0) {
+            send_int(conn.get(), -errno);
+            continue;
+        }
+        Log::print(Log::LOADER, "zygote: started %d for %d\n", pid, cred.pid);
+        send_int(conn.get(), pid);
+        running[pid] = conn.release();
+    }
+}
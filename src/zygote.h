@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class Process;
+
+/*
+ * Zygote: a qine that has parsed its options, mapped the paths and loaded the Slib, and then forks
+ * a ready-to-run process for each client request. Used to avoid the qine startup for short-lived tools.
+ *
+ * Protocol over a UNIX stream socket, which only accepts clients of the same user:
+ *  - client sends Request, with stdin, stdout and stderr attached as SCM_RIGHTS,
+ *    followed by `size` bytes: cwd, argv and environment strings, each null-terminated
+ *  - zygote replies with the host pid of the new process (int32_t, negative errno on failure)
+ *  - and once the process terminates with its wait status (int32_t)
+ */
+namespace Zygote {
+    /* Resource limits passed to the process, RLIMIT_NLIMITS of Linux */
+    static constexpr int RLIMITS = 16;
+
+    struct Request {
+        uint32_t magic;
+        uint32_t argc;
+        uint32_t envc;
+        uint32_t size;
+        uint32_t umask;
+        /* Index of the stdio FD that is the controlling terminal of the client, -1 if none */
+        int32_t ctty;
+        /* Soft and hard limit for each resource, as rlim_t */
+        uint64_t rlimits[RLIMITS][2];
+    };
+
+    static constexpr uint32_t MAGIC = 0x5A594732;
+    static constexpr uint32_t MAX_SIZE = 1024 * 1024;
+    static constexpr int STDIO_FDS = 3;
+    /* A client sends the whole request at once, a connection that stalls must not block the zygote */
+    static constexpr int RECV_TIMEOUT_MS = 2000;
+
+    /*
+     * Serve requests on the socket. Returns only in a forked child, which is ready to load the
+     * executable: its cwd, environment and stdio are set up, and argv is filled.
+     */
+    void serve(Process *proc, const char *socket_path, std::vector<std::string>& argv);
+}
@@ -0,0 +1,165 @@
+/*
+ * Thin client for `qine --zygote`: asks the zygote to run a QNX program with our argv, environment,
+ * cwd and stdio, then waits for it and exits with its status.
+ *
+ * Usage: qine-client SOCKET PROGRAM [ARGS...]
+ */
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "zygote.h"
+
+extern char **environ;
+
+static volatile pid_t child_pid;
+
+static void forward_signal(int sig) {
+    if (child_pid > 0) {
+        kill(child_pid, sig);
+    }
+}
+
+static bool read_int(int fd, int32_t *v) {
+    size_t done = 0;
+    while (done < sizeof(*v)) {
+        ssize_t r = read(fd, reinterpret_cast<char*>(v) + done, sizeof(*v) - done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        done += r;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: qine-client SOCKET PROGRAM [ARGS...]\n");
+        return 127;
+    }
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "qine-client: socket path too long\n");
+        return 127;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        perror("qine-client: connect");
+        return 127;
+    }
+
+    char *cwd = getcwd(nullptr, 0);
+    if (!cwd) {
+        perror("qine-client: getcwd");
+        return 127;
+    }
+
+    Zygote::Request req = {};
+    req.magic = Zygote::MAGIC;
+    std::string strings(cwd);
+    strings.push_back(0);
+    for (int i = 2; i < argc; i++) {
+        strings.append(argv[i]);
+        strings.push_back(0);
+        req.argc++;
+    }
+    for (char **e = environ; e && *e; e++) {
+        strings.append(*e);
+        strings.push_back(0);
+        req.envc++;
+    }
+    if (strings.size() > Zygote::MAX_SIZE) {
+        fprintf(stderr, "qine-client: arguments too long\n");
+        return 127;
+    }
+    req.size = strings.size();
+
+    mode_t mask = umask(0);
+    umask(mask);
+    req.umask = mask;
+    for (int r = 0; r < Zygote::RLIMITS; r++) {
+        struct rlimit lim;
+        if (getrlimit(r, &lim) < 0) {
+            lim.rlim_cur = lim.rlim_max = RLIM_INFINITY;
+        }
+        req.rlimits[r][0] = lim.rlim_cur;
+        req.rlimits[r][1] = lim.rlim_max;
+    }
+    req.ctty = -1;
+    for (int i = 0; i < Zygote::STDIO_FDS && req.ctty < 0; i++) {
+        if (isatty(i) && tcgetsid(i) == getsid(0)) {
+            req.ctty = i;
+        }
+    }
+
+    // closed stdio is passed as /dev/null
+    int fds[Zygote::STDIO_FDS];
+    for (int i = 0; i < Zygote::STDIO_FDS; i++) {
+        fds[i] = fcntl(i, F_GETFD) < 0 ? open("/dev/null", O_RDWR) : i;
+    }
+
+    struct iovec iov[2] = {{&req, sizeof(req)}, {strings.data(), strings.size()}};
+    alignas(struct cmsghdr) char cbuf[CMSG_SPACE(sizeof(fds))] = {};
+    struct msghdr mh = {};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    auto cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // blocking send on a stream socket only returns short on error
+    if (sendmsg(sock, &mh, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(req) + strings.size())) {
+        perror("qine-client: send");
+        return 127;
+    }
+
+    int32_t pid;
+    if (!read_int(sock, &pid)) {
+        fprintf(stderr, "qine-client: zygote closed connection\n");
+        return 127;
+    }
+    if (pid < 0) {
+        fprintf(stderr, "qine-client: zygote failed to fork: %s\n", strerror(-pid));
+        return 127;
+    }
+
+    child_pid = pid;
+    for (int sig: {SIGINT, SIGTERM, SIGHUP, SIGQUIT}) {
+        signal(sig, forward_signal);
+    }
+
+    int32_t status;
+    if (!read_int(sock, &status)) {
+        fprintf(stderr, "qine-client: zygote closed connection\n");
+        return 127;
+    }
+
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}